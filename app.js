@@ -43,16 +43,82 @@ cppSocket.on('error', (err) => {
   console.error('WebSocket error:', err);
 });
 
-cppSocket.on('message', (message) => {
-  console.log('Received from C++:', message);
+// 每个请求带 id，C++ 端按完成顺序返回 {id, result} 或 {id, error}
+// format 为 binary 的路线以二进制帧返回：uint32 LE 标签长度 + 标签 JSON {id} + 路线数据
+const pending = new Map();
+let nextRequestId = 1;
+const requestTimeoutMs = 30000;
+
+cppSocket.on('message', (message, isBinary) => {
+  let reply;
+  try {
+    if (isBinary) {
+      const tagLength = message.readUInt32LE(0);
+      reply = JSON.parse(message.subarray(4, 4 + tagLength).toString());
+      reply.result = message.subarray(4 + tagLength);
+    } else {
+      reply = JSON.parse(message);
+    }
+  } catch (error) {
+    console.error('Error parsing C++ response:', error);
+    return;
+  }
+  const entry = reply && pending.get(reply.id);
+  if (!entry) {
+    console.log('Received untagged message from C++:', String(message).slice(0, 200));
+    return;
+  }
+  pending.delete(reply.id);
+  clearTimeout(entry.timer);
+  if ('error' in reply) {
+    entry.reject(new Error(reply.error));
+  } else {
+    entry.resolve(reply.result);
+  }
+});
+
+cppSocket.on('close', () => {
+  for (const [id, entry] of pending) {
+    clearTimeout(entry.timer);
+    entry.reject(new Error('C++ server connection closed'));
+  }
+  pending.clear();
 });
 
+// Send one query to the C++ server; resolves with its result once the reply with the same id arrives.
+function queryCpp(query) {
+  return new Promise((resolve, reject) => {
+    const id = nextRequestId++;
+    const timer = setTimeout(() => {
+      pending.delete(id);
+      reject(new Error('C++ server timeout'));
+    }, requestTimeoutMs);
+    pending.set(id, { resolve, reject, timer });
+    cppSocket.send(JSON.stringify({ ...query, id }), (err) => {
+      if (err) {
+        pending.delete(id);
+        clearTimeout(timer);
+        reject(err);
+      }
+    });
+  });
+}
+
+// Binary routes are passed through untouched.
+function sendResult(res, result) {
+  if (Buffer.isBuffer(result)) {
+    res.type('application/octet-stream').send(result);
+  } else {
+    res.send(result);
+  }
+}
+
 app.use(express.json());
 
-app.post('/calculate-path', (req, res) => {
+app.post('/calculate-path', async (req, res) => {
   try {
 
-    const { startLocation, endLocation, type } = req.body;
+    const { startLocation, endLocation, type, algorithm, format, precision } = req.body;
 
     if (!startLocation || !endLocation) {
       return res.status(400).send({ error: 'Start and end required' });
@@ -60,37 +126,21 @@ app.post('/calculate-path', (req, res) => {
 
     console.log('Received request to calculate path from:', startLocation, 'to:', endLocation, 'type:', type);
 
-    let request = JSON.stringify();
-    if (type == "car") {
-      request = JSON.stringify({ queryType: 'path', startLocation, endLocation });
-    } else if (type == "ped") {
-      request = JSON.stringify({ queryType: 'ped_path', startLocation, endLocation });
+    const queryType = type == "ped" ? 'ped_path' : 'path';
+    try {
+      sendResult(res, await queryCpp({ queryType, startLocation, endLocation, algorithm, format, precision }));
+    } catch (error) {
+      console.error('C++ server error:', error.message);
+      res.status(500).send({ error: error.message });
     }
 
-    cppSocket.send(request, (err) => {
-      if (err) {
-        console.error('Error sending to C++ server:', err);
-        return res.status(500).send({error: 'C++ server error'})
-      }
-
-      cppSocket.once('message', (message) => {
-        try {
-          const result = JSON.parse(message);
-          res.send(result);
-        } catch (error) {
-          console.error('Error parsing c++ response:', error);
-          res.status(500).send({error: 'c++ return type error'});
-        }
-      });
-    });
-
   } catch (err) {
     console.error('Server error:', err);
     res.status(500).send({ error: 'An unexpected error occurred.' });
   }
 });
 
-app.post('/fuzzy-search', (req, res) => {
+app.post('/fuzzy-search', async (req, res) => {
   try {
     const { locationName } = req.body;
 
@@ -100,34 +150,21 @@ app.post('/fuzzy-search', (req, res) => {
 
     console.log('Received fuzzy search request for:', locationName);
 
-    // 准备 WebSocket 请求
-    const request = JSON.stringify({ queryType: 'fuzzy', locationName });
-
-    cppSocket.send(request, (err) => {
-      if (err) {
-        console.error('Error sending to C++ server:', err);
-        return res.status(500).send({ error: 'C++ server error' });
-      }
-
-      cppSocket.once('message', (message) => {
-        try {
-          const results = JSON.parse(message);
-          res.send(results);
-        } catch (error) {
-          console.error('Error parsing C++ response:', error);
-          res.status(500).send({ error: 'C++ response parse error' });
-        }
-      });
-    });
+    try {
+      res.send(await queryCpp({ queryType: 'fuzzy', locationName }));
+    } catch (error) {
+      console.error('C++ server error:', error.message);
+      res.status(500).send({ error: error.message });
+    }
   } catch (err) {
     console.error('Server error:', err);
     res.status(500).send({ error: 'An unexpected error occurred.' });
   }
 });
 
-app.post('/calculate-route-arbitrary', (req, res) => {
+app.post('/calculate-route-arbitrary', async (req, res) => {
   try {
-    const { start, end } = req.body;
+    const { start, end, algorithm, format, precision } = req.body;
 
     if (!start || !end || start.length !== 2 || end.length !== 2) {
       return res.status(400).send({ error: 'Start and end coordinates are required and must be valid' });
@@ -135,28 +172,19 @@ app.post('/calculate-route-arbitrary', (req, res) => {
 
     console.log('Received request to calculate path from:', start, 'to:', end);
 
-    const request = JSON.stringify({
-      queryType: 'arbitrary',
-      startLocation: { lat: start[0], lng: start[1] },
-      endLocation: { lat: end[0], lng: end[1] }
-    });
-
-    cppSocket.send(request, (err) => {
-      if (err) {
-        console.error('Error sending to C++ server:', err);
-        return res.status(500).send({error: 'C++ server error'})
-      }
-
-      cppSocket.once('message', (message) => {
-        try {
-          const result = JSON.parse(message);
-          res.send(result);
-        } catch (error) {
-          console.error('Error parsing c++ response:', error);
-          res.status(500).send({error: 'c++ return type error'});
-        }
-      });
-    });
+    try {
+      sendResult(res, await queryCpp({
+        queryType: 'arbitrary',
+        startLocation: { lat: start[0], lng: start[1] },
+        endLocation: { lat: end[0], lng: end[1] },
+        algorithm,
+        format,
+        precision
+      }));
+    } catch (error) {
+      console.error('C++ server error:', error.message);
+      res.status(500).send({ error: error.message });
+    }
 
   } catch (err) {
     console.error('Server error:', err);
@@ -0,0 +1,444 @@
+#include "Graph.h"
+#include "Node.h"
+#include "SearchContext.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+/**
+ * Routing benchmarks over a graph cache, for every profile it holds.
+ *
+ *   bench [--queries N] [--seed S] <graph cache>
+ *
+ * Every workload is drawn from a seeded generator, so runs are comparable. Each
+ * engine's path length is checked against plain Dijkstra; the exit status is 1
+ * if any of them differ.
+ */
+
+namespace {
+
+using node_id = Graph::node_id;
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    string cache;
+    size_t queries = 200;
+    uint32_t seed = 1;
+};
+
+struct Workload {
+    string name;
+    vector<std::pair<node_id, node_id>> pairs;
+};
+
+struct Sample {
+    double ms;
+    uint64_t settled;
+    uint64_t heap_ops;
+};
+
+using Engine = std::function<vector<Node>(const Graph &, const Node &, const Node &)>;
+
+double straight_distance(const Graph &graph, node_id a, node_id b) {
+    return calculate_distance(graph.nodeAt(a), graph.nodeAt(b));
+}
+
+// Random pairs, then pairs whose straight-line distance falls into each band.
+vector<Workload> make_workloads(const Graph &graph, size_t count, uint32_t seed) {
+    struct Band {
+        const char *name;
+        double min_m, max_m;
+    };
+    const Band bands[] = {
+        {"short (<2 km)", 0, 2000},
+        {"medium (2-10 km)", 2000, 10000},
+        {"cross-city (>10 km)", 10000, std::numeric_limits<double>::infinity()},
+    };
+
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<node_id> pick(0, graph.nodeCount() - 1);
+    vector<Workload> workloads;
+    workloads.push_back({"random", {}});
+    for (size_t i = 0; i < count; ++i) {
+        workloads.back().pairs.push_back({pick(rng), pick(rng)});
+    }
+    for (const Band &band : bands) {
+        Workload workload{band.name, {}};
+        // rejection sampling; a small graph may not have enough long pairs
+        for (size_t attempt = 0; attempt < count * 1000 && workload.pairs.size() < count; ++attempt) {
+            node_id s = pick(rng), t = pick(rng);
+            double d = straight_distance(graph, s, t);
+            if (d >= band.min_m && d < band.max_m) {
+                workload.pairs.push_back({s, t});
+            }
+        }
+        workloads.push_back(std::move(workload));
+    }
+    return workloads;
+}
+
+double percentile(vector<double> values, double p) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t index = static_cast<size_t>(std::ceil(p / 100 * values.size()));
+    return values[std::min(values.size() - 1, index == 0 ? 0 : index - 1)];
+}
+
+void report(const string &label, const vector<Sample> &samples, size_t mismatches) {
+    vector<double> ms;
+    double total = 0, settled = 0, heap_ops = 0;
+    for (const Sample &sample : samples) {
+        ms.push_back(sample.ms);
+        total += sample.ms;
+        settled += sample.settled;
+        heap_ops += sample.heap_ops;
+    }
+    size_t n = std::max<size_t>(1, samples.size());
+    printf("  %-10s %6zu q %10.0f q/s  p50 %8.3f  p95 %8.3f  p99 %8.3f ms  settled %9.0f  heap ops %9.0f  mismatches %zu\n",
+           label.c_str(), samples.size(), total > 0 ? samples.size() / (total / 1000) : 0.0,
+           percentile(ms, 50), percentile(ms, 95), percentile(ms, 99), settled / n, heap_ops / n, mismatches);
+}
+
+bool same_length(double a, double b) {
+    if (std::isinf(a) || std::isinf(b)) {
+        return std::isinf(a) && std::isinf(b);
+    }
+    return std::abs(a - b) <= 1e-9 * std::max(1.0, b);
+}
+
+// Runs every engine on every workload; returns the number of mismatches.
+size_t bench_routing(const Graph &graph, const vector<Workload> &workloads) {
+    vector<std::pair<string, Engine>> engines = {
+        {"dijkstra", &Graph::Dijkstra},
+        {"astar", &Graph::AStar},
+        {"biastar", &Graph::BiAStar},
+    };
+    if (graph.hasContractionHierarchy()) {
+        engines.push_back({"ch", &Graph::CHQuery});
+    }
+
+    size_t total_mismatches = 0;
+    for (const Workload &workload : workloads) {
+        printf(" %s, %zu pairs\n", workload.name.c_str(), workload.pairs.size());
+        vector<double> reference;
+        for (const auto &[name, engine] : engines) {
+            vector<Sample> samples;
+            size_t mismatches = 0;
+            for (size_t i = 0; i < workload.pairs.size(); ++i) {
+                Node start = graph.nodeAt(workload.pairs[i].first), goal = graph.nodeAt(workload.pairs[i].second);
+                SearchSpace::Stats before = SearchContext::stats();
+                auto t0 = Clock::now();
+                vector<Node> path = engine(graph, start, goal);
+                auto t1 = Clock::now();
+                SearchSpace::Stats after = SearchContext::stats();
+                samples.push_back({std::chrono::duration<double, std::milli>(t1 - t0).count(), after.settled - before.settled,
+                                   after.pushes - before.pushes + after.pops - before.pops});
+
+                double length = graph.pathLength(path);
+                if (name == "dijkstra") {
+                    reference.push_back(length);
+                } else if (!same_length(length, reference[i])) {
+                    ++mismatches;
+                }
+            }
+            report(name, samples, mismatches);
+            total_mismatches += mismatches;
+        }
+    }
+    return total_mismatches;
+}
+
+// Square matrices of random nodes; a sample of cells is checked against Dijkstra.
+size_t bench_matrix(const Graph &graph, uint32_t seed) {
+    std::mt19937 rng(seed);
+    size_t total_mismatches = 0;
+    for (size_t size : {10, 100}) {
+        vector<Sample> samples;
+        size_t mismatches = 0;
+        for (size_t round = 0; round < 5; ++round) {
+            vector<Node> sources, targets;
+            for (size_t i = 0; i < size; ++i) {
+                sources.push_back(graph.nodeAt(rng() % graph.nodeCount()));
+                targets.push_back(graph.nodeAt(rng() % graph.nodeCount()));
+            }
+            SearchSpace::Stats before = SearchContext::stats();
+            auto t0 = Clock::now();
+            vector<double> costs = graph.distanceMatrix(sources, targets);
+            auto t1 = Clock::now();
+            SearchSpace::Stats after = SearchContext::stats();
+            samples.push_back({std::chrono::duration<double, std::milli>(t1 - t0).count(), after.settled - before.settled,
+                               after.pushes - before.pushes + after.pops - before.pops});
+
+            for (size_t k = 0; k < 10; ++k) {
+                size_t i = rng() % size, j = rng() % size;
+                if (!same_length(costs[i * size + j], graph.pathLength(graph.Dijkstra(sources[i], targets[j])))) {
+                    ++mismatches;
+                }
+            }
+        }
+        report("matrix " + std::to_string(size), samples, mismatches);
+        total_mismatches += mismatches;
+    }
+    return total_mismatches;
+}
+
+// Nearest node and edge snapping of random points in the bounding box, the first
+// nearest nodes checked by brute force.
+size_t bench_nearest(const Graph &graph, size_t count, uint32_t seed) {
+    double min_lng = 180, max_lng = -180, min_lat = 90, max_lat = -90;
+    for (node_id v = 0; v < graph.nodeCount(); ++v) {
+        Node node = graph.nodeAt(v);
+        min_lng = std::min(min_lng, node.getLng());
+        max_lng = std::max(max_lng, node.getLng());
+        min_lat = std::min(min_lat, node.getLat());
+        max_lat = std::max(max_lat, node.getLat());
+    }
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> lng(min_lng, max_lng), lat(min_lat, max_lat);
+
+    vector<Sample> samples, edge_samples;
+    size_t mismatches = 0, edge_mismatches = 0;
+    double node_meters = 0, edge_meters = 0;
+    const size_t checked = 100;
+    for (size_t i = 0; i < count; ++i) {
+        std::pair<double, double> point = {lng(rng), lat(rng)};
+        auto t0 = Clock::now();
+        auto found = graph.queryByArbitrary(point);
+        auto t1 = Clock::now();
+        Graph::EdgeSnap snap = graph.snapToEdge(point);
+        auto t2 = Clock::now();
+        samples.push_back({std::chrono::duration<double, std::milli>(t1 - t0).count(), 0, 0});
+        edge_samples.push_back({std::chrono::duration<double, std::milli>(t2 - t1).count(), 0, 0});
+        // every usable node is the end of some usable segment, so the edge snap is never farther away
+        double node_distance = calculate_distance(Node(point), Node(found));
+        node_meters += node_distance;
+        edge_meters += snap.distance;
+        if (snap.distance > node_distance + 1e-6) {
+            ++edge_mismatches;
+        }
+        if (i < checked) {
+            double best = std::numeric_limits<double>::infinity();
+            for (node_id v = 0; v < graph.nodeCount(); ++v) {
+                if (!graph.accessible(v)) {
+                    continue;
+                }
+                best = std::min(best, calculate_distance(Node(point), graph.nodeAt(v)));
+            }
+            if (calculate_distance(Node(point), Node(found)) != best) {
+                ++mismatches;
+            }
+        }
+    }
+    report("nearest", samples, mismatches);
+    report("edge snap", edge_samples, edge_mismatches);
+    printf("  mean snap distance: %.1f m to the nearest node, %.1f m to the nearest edge\n",
+           node_meters / std::max<size_t>(1, count), edge_meters / std::max<size_t>(1, count));
+    return mismatches + edge_mismatches;
+}
+
+// Batches of weight changes along roads around random places, each applied on top of
+// the last through the customizable hierarchy (in full the first time); the CH on
+// every updated graph is checked against Dijkstra.
+size_t bench_updates(const Graph &graph, size_t count, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> factor(0.5, 4);
+    // node ids follow a Hilbert curve, so nearby ids are nearby places
+    const node_id window = std::min<node_id>(graph.nodeCount(), 2000);
+    vector<Sample> full, partial;
+    size_t mismatches = 0, full_arcs = 0, partial_arcs = 0;
+    std::shared_ptr<const Graph> updated;
+    const Graph *current = &graph;
+    for (size_t round = 0; round < 6; ++round) {
+        vector<Graph::WeightChange> changes;
+        node_id first = rng() % (graph.nodeCount() - window + 1);
+        for (size_t attempt = 0; changes.size() < count && attempt < count; ++attempt) {
+            vector<Node> path = current->Dijkstra(current->nodeAt(first + rng() % window), current->nodeAt(first + rng() % window));
+            for (size_t i = 0; i + 1 < path.size() && changes.size() < count; ++i) {
+                // one in ten closed
+                double weight = rng() % 10 == 0 ? std::numeric_limits<double>::infinity()
+                                                : current->pathLength({path[i], path[i + 1]}) * factor(rng);
+                changes.push_back({path[i], path[i + 1], weight});
+            }
+        }
+
+        size_t arcs = 0;
+        auto t0 = Clock::now();
+        updated = current->withWeights(changes, &arcs);
+        auto t1 = Clock::now();
+        current = updated.get();
+        (round == 0 ? full : partial).push_back({std::chrono::duration<double, std::milli>(t1 - t0).count(), 0, 0});
+        (round == 0 ? full_arcs : partial_arcs) += arcs;
+
+        for (size_t k = 0; k < 20; ++k) {
+            Node start = current->nodeAt(rng() % current->nodeCount()), goal = current->nodeAt(rng() % current->nodeCount());
+            if (!same_length(current->pathLength(current->CHQuery(start, goal)), current->pathLength(current->Dijkstra(start, goal)))) {
+                ++mismatches;
+            }
+        }
+    }
+    report("customize", full, 0);
+    report("update", partial, mismatches);
+    printf("  %zu edges per update, mean arcs recomputed: %.0f in full, %.0f per update\n",
+           count, double(full_arcs), double(partial_arcs) / std::max<size_t>(1, partial.size()));
+    return mismatches;
+}
+
+// Time-dependent A* against time-dependent Dijkstra on random pairs, for a few
+// departures; the static A* route is timed and costed at the same departure.
+size_t bench_time_dependent(const Graph &graph, const Workload &workload) {
+    const std::pair<const char *, double> departures[] = {{"03:00", 3 * 3600}, {"08:00", 8 * 3600}, {"17:30", 17.5 * 3600}};
+    size_t total_mismatches = 0;
+    for (const auto &[label, departure] : departures) {
+        vector<Sample> dijkstra, astar, static_astar;
+        size_t mismatches = 0;
+        double td_seconds = 0, static_seconds = 0;
+        size_t found = 0;
+        auto run = [&](vector<Sample> &samples, const std::function<vector<Node>()> &engine) {
+            SearchSpace::Stats before = SearchContext::stats();
+            auto t0 = Clock::now();
+            vector<Node> path = engine();
+            auto t1 = Clock::now();
+            SearchSpace::Stats after = SearchContext::stats();
+            samples.push_back({std::chrono::duration<double, std::milli>(t1 - t0).count(), after.settled - before.settled,
+                               after.pushes - before.pushes + after.pops - before.pops});
+            return path;
+        };
+        for (const auto &[s, t] : workload.pairs) {
+            Node start = graph.nodeAt(s), goal = graph.nodeAt(t);
+            double reference = graph.travelTime(run(dijkstra, [&] { return graph.TDDijkstra(start, goal, departure); }), departure);
+            double seconds = graph.travelTime(run(astar, [&] { return graph.TDAStar(start, goal, departure); }), departure);
+            double fixed = graph.travelTime(run(static_astar, [&] { return graph.AStar(start, goal); }), departure);
+            if (!same_length(seconds, reference)) {
+                ++mismatches;
+            }
+            if (!std::isinf(seconds) && !std::isinf(fixed)) {
+                td_seconds += seconds;
+                static_seconds += fixed;
+                ++found;
+            }
+        }
+        printf(" departure %s, %zu pairs\n", label, workload.pairs.size());
+        report("tddijkstra", dijkstra, 0);
+        report("tdastar", astar, mismatches);
+        report("astar", static_astar, 0);
+        printf("  mean travel time %.0f s, %.0f s along the static route\n",
+               td_seconds / std::max<size_t>(1, found), static_seconds / std::max<size_t>(1, found));
+        total_mismatches += mismatches;
+    }
+    return total_mismatches;
+}
+
+// Fuzzy search for the first one to four characters of random place names.
+void bench_fuzzy(const Graph &graph, size_t count, uint32_t seed) {
+    if (graph.nameCount() == 0) {
+        return;
+    }
+    std::mt19937 rng(seed);
+    vector<Sample> samples;
+    for (size_t i = 0; i < count; ++i) {
+        string name(graph.nameAt(rng() % graph.nameCount()));
+        size_t chars = 1 + rng() % 4, end = 0;
+        // cut on UTF-8 character boundaries
+        while (end < name.size() && chars > 0) {
+            ++end;
+            while (end < name.size() && (static_cast<unsigned char>(name[end]) & 0xC0) == 0x80) {
+                ++end;
+            }
+            --chars;
+        }
+        string query = name.substr(0, end);
+        auto t0 = Clock::now();
+        graph.fuzzySearch(query, 75.0, 20);
+        auto t1 = Clock::now();
+        samples.push_back({std::chrono::duration<double, std::milli>(t1 - t0).count(), 0, 0});
+    }
+    report("fuzzy", samples, 0);
+}
+
+bool parse_options(int argc, char **argv, Options &options) {
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--queries" && i + 1 < argc) {
+            options.queries = std::stoul(argv[++i]);
+        } else if (arg == "--seed" && i + 1 < argc) {
+            options.seed = std::stoul(argv[++i]);
+        } else if (!arg.empty() && arg[0] != '-') {
+            if (!options.cache.empty()) {
+                return false;
+            }
+            options.cache = arg;
+        } else {
+            return false;
+        }
+    }
+    return !options.cache.empty();
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        std::cerr << "Usage: " << argv[0] << " [--queries N] [--seed S] <graph cache>" << std::endl;
+        return 2;
+    }
+
+    printf("search queue: %s\n", SearchSpace::queue_name);
+    const char *profiles[] = {"car", "pedestrian"};
+    auto t0 = Clock::now();
+    auto mapped = MappedSnapshot::open(options.cache);
+    double open_ms = std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+    printf("%s opened in %.2f ms\n", options.cache.c_str(), open_ms);
+    size_t mismatches = 0;
+    for (uint32_t p = 0; p < 2; ++p) {
+        if (!mapped->has(SectionId::weights, p)) {
+            continue;
+        }
+        Graph graph;
+        auto t1 = Clock::now();
+        graph.mapSnapshot(mapped, p);
+        double map_ms = std::chrono::duration<double, std::milli>(Clock::now() - t1).count();
+        printf("%s: %zu nodes, %zu edges, %zu names, mapped in %.2f ms\n", profiles[p],
+               graph.nodeCount(), graph.edgeCount(), graph.nameCount(), map_ms);
+        if (graph.nodeCount() == 0) {
+            continue;
+        }
+
+        vector<Workload> workloads = make_workloads(graph, options.queries, options.seed);
+        mismatches += bench_routing(graph, workloads);
+        printf(" many-to-many\n");
+        mismatches += bench_matrix(graph, options.seed);
+        printf(" lookups\n");
+        mismatches += bench_nearest(graph, options.queries * 10, options.seed);
+        bench_fuzzy(graph, options.queries, options.seed);
+        if (graph.hasCustomizableHierarchy()) {
+            printf(" weight updates\n");
+            mismatches += bench_updates(graph, options.queries * 10, options.seed);
+        }
+        if (graph.hasTravelTimes()) {
+            printf(" time-dependent routing\n");
+            mismatches += bench_time_dependent(graph, workloads.front());
+        }
+    }
+
+    if (mismatches > 0) {
+        printf("%zu results differ from the reference\n", mismatches);
+        return 1;
+    }
+    return 0;
+}
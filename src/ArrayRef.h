@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+// Read-only view over a contiguous array, either owned elsewhere or mapped from a snapshot.
+template <typename T>
+class ArrayRef {
+public:
+    ArrayRef() : ptr(nullptr), len(0) {}
+    ArrayRef(const T *_ptr, size_t _len) : ptr(_ptr), len(_len) {}
+    ArrayRef(const std::vector<T> &vec) : ptr(vec.data()), len(vec.size()) {}
+
+    inline const T &operator[](size_t i) const {
+        return ptr[i];
+    }
+
+    inline const T &at(size_t i) const {
+        if (i >= len) {
+            throw std::out_of_range("ArrayRef index out of range.");
+        }
+        return ptr[i];
+    }
+
+    inline const T *data() const {
+        return ptr;
+    }
+
+    inline size_t size() const {
+        return len;
+    }
+
+    inline bool empty() const {
+        return len == 0;
+    }
+
+    inline const T *begin() const {
+        return ptr;
+    }
+
+    inline const T *end() const {
+        return ptr + len;
+    }
+
+private:
+    const T *ptr;
+    size_t len;
+};
@@ -0,0 +1,560 @@
+#include "ContractionHierarchy.h"
+#include "SearchContext.h"
+
+#include <algorithm>
+#include <cmath>
+#include <queue>
+#include <stdexcept>
+#include <unordered_map>
+
+using std::vector;
+
+namespace {
+
+using node_id = ContractionHierarchy::node_id;
+const node_id npos = ContractionHierarchy::npos;
+const double inf = std::numeric_limits<double>::infinity();
+
+// settled-node limits of the witness search while ordering and while contracting
+const size_t simulate_settle_limit = 20;
+const size_t contract_settle_limit = 100;
+
+struct DynEdge {
+    node_id to;
+    double weight;
+    node_id middle;
+};
+
+struct Shortcut {
+    node_id from, to;
+    double weight;
+};
+
+class Contractor {
+public:
+    Contractor(ArrayRef<uint32_t> offsets, ArrayRef<node_id> targets, ArrayRef<double> weights)
+        : n(offsets.size() - 1), out(n), in(n), up(n), down(n), contracted(n, 0), deleted_neighbors(n, 0), level(n, 0), dist(n, inf), is_target(n, 0)
+    {
+        for (node_id u = 0; u < n; ++u) {
+            for (uint32_t e = offsets[u]; e < offsets[u + 1]; ++e) {
+                if (targets[e] != u && std::isfinite(weights[e])) {
+                    addEdge(u, targets[e], weights[e], npos);
+                }
+            }
+        }
+    }
+
+    // Contracts every node; returns the rank of each node.
+    vector<uint32_t> run() {
+        vector<int64_t> priority(n);
+        using QueueItem = std::pair<int64_t, node_id>;
+        std::priority_queue<QueueItem, vector<QueueItem>, std::greater<QueueItem>> queue;
+        for (node_id v = 0; v < n; ++v) {
+            priority[v] = computePriority(v);
+            queue.push({priority[v], v});
+        }
+
+        vector<uint32_t> rank(n);
+        uint32_t next_rank = 0;
+        vector<Shortcut> shortcuts;
+        while (!queue.empty()) {
+            auto [prio, v] = queue.top();
+            queue.pop();
+            if (contracted[v] || prio != priority[v]) {
+                continue;
+            }
+            // lazy update: contract v only if it is still the cheapest
+            priority[v] = computePriority(v);
+            if (!queue.empty() && priority[v] > queue.top().first) {
+                queue.push({priority[v], v});
+                continue;
+            }
+
+            shortcuts.clear();
+            findShortcuts(v, contract_settle_limit, shortcuts);
+            contract(v, shortcuts);
+            rank[v] = next_rank++;
+
+            for (const auto *edges : {&up[v], &down[v]}) {
+                for (const auto &edge : *edges) {
+                    ++deleted_neighbors[edge.to];
+                    level[edge.to] = std::max(level[edge.to], level[v] + 1);
+                    priority[edge.to] = computePriority(edge.to);
+                    queue.push({priority[edge.to], edge.to});
+                }
+            }
+        }
+        return rank;
+    }
+
+    size_t n;
+    vector<vector<DynEdge>> out, in;
+    // final edges, stored at the lower-ranked end
+    vector<vector<DynEdge>> up, down;
+    size_t shortcut_count = 0;
+
+private:
+    vector<char> contracted;
+    vector<uint32_t> deleted_neighbors;
+    // depth of v in the hierarchy built so far
+    vector<uint32_t> level;
+
+    // witness search scratch
+    vector<double> dist;
+    vector<node_id> touched;
+    vector<char> is_target;
+    vector<std::pair<double, node_id>> heap;
+
+    void addEdge(node_id from, node_id to, double weight, node_id middle) {
+        for (auto &edge : out[from]) {
+            if (edge.to == to) {
+                if (weight < edge.weight) {
+                    edge.weight = weight;
+                    edge.middle = middle;
+                    for (auto &rev : in[to]) {
+                        if (rev.to == from) {
+                            rev.weight = weight;
+                            rev.middle = middle;
+                        }
+                    }
+                }
+                return;
+            }
+        }
+        out[from].push_back({to, weight, middle});
+        in[to].push_back({from, weight, middle});
+    }
+
+    static void removeEdgesTo(vector<DynEdge> &edges, node_id to) {
+        edges.erase(std::remove_if(edges.begin(), edges.end(), [to](const DynEdge &edge) {
+            return edge.to == to;
+        }), edges.end());
+    }
+
+    // Dijkstra from source over uncontracted nodes other than excluded, up to limit,
+    // stopping early once every node marked in is_target has been settled
+    void witnessSearch(node_id source, node_id excluded, double limit, size_t settle_limit, size_t target_count) {
+        for (node_id v : touched) {
+            dist[v] = inf;
+        }
+        touched.clear();
+
+        using QueueItem = std::pair<double, node_id>;
+        auto cmp = std::greater<QueueItem>();
+        heap.clear();
+        dist[source] = 0;
+        touched.push_back(source);
+        heap.push_back({0, source});
+        size_t settled = 0;
+        while (!heap.empty() && settled < settle_limit && target_count > 0) {
+            std::pop_heap(heap.begin(), heap.end(), cmp);
+            auto [d, u] = heap.back();
+            heap.pop_back();
+            if (d > dist[u]) {
+                continue;
+            }
+            if (d > limit) {
+                break;
+            }
+            ++settled;
+            if (is_target[u]) {
+                --target_count;
+            }
+            for (const auto &edge : out[u]) {
+                if (edge.to == excluded || contracted[edge.to]) {
+                    continue;
+                }
+                double t = d + edge.weight;
+                if (t < dist[edge.to]) {
+                    if (dist[edge.to] == inf) {
+                        touched.push_back(edge.to);
+                    }
+                    dist[edge.to] = t;
+                    heap.push_back({t, edge.to});
+                    std::push_heap(heap.begin(), heap.end(), cmp);
+                }
+            }
+        }
+    }
+
+    void findShortcuts(node_id v, size_t settle_limit, vector<Shortcut> &shortcuts) {
+        for (const auto &out_edge : out[v]) {
+            is_target[out_edge.to] = 1;
+        }
+        for (const auto &in_edge : in[v]) {
+            node_id u = in_edge.to;
+            double limit = 0;
+            size_t target_count = 0;
+            for (const auto &out_edge : out[v]) {
+                if (out_edge.to != u) {
+                    limit = std::max(limit, in_edge.weight + out_edge.weight);
+                    ++target_count;
+                }
+            }
+            if (target_count == 0) {
+                continue;
+            }
+            // u itself is never a target of its own search
+            is_target[u] = 0;
+            witnessSearch(u, v, limit, settle_limit, target_count);
+            for (const auto &out_edge : out[v]) {
+                if (out_edge.to == u) {
+                    is_target[u] = 1;
+                } else if (dist[out_edge.to] > in_edge.weight + out_edge.weight) {
+                    shortcuts.push_back({u, out_edge.to, in_edge.weight + out_edge.weight});
+                }
+            }
+        }
+        for (const auto &out_edge : out[v]) {
+            is_target[out_edge.to] = 0;
+        }
+    }
+
+    int64_t computePriority(node_id v) {
+        vector<Shortcut> shortcuts;
+        findShortcuts(v, simulate_settle_limit, shortcuts);
+        int64_t edge_difference = static_cast<int64_t>(shortcuts.size()) - static_cast<int64_t>(in[v].size() + out[v].size());
+        return 4 * edge_difference + deleted_neighbors[v] + 2 * level[v];
+    }
+
+    void contract(node_id v, const vector<Shortcut> &shortcuts) {
+        for (const auto &edge : in[v]) {
+            removeEdgesTo(out[edge.to], v);
+        }
+        for (const auto &edge : out[v]) {
+            removeEdgesTo(in[edge.to], v);
+        }
+        up[v] = std::move(out[v]);
+        down[v] = std::move(in[v]);
+        out[v].clear();
+        in[v].clear();
+        contracted[v] = 1;
+
+        for (const auto &shortcut : shortcuts) {
+            addEdge(shortcut.from, shortcut.to, shortcut.weight, v);
+            ++shortcut_count;
+        }
+    }
+};
+
+void flatten(const vector<vector<DynEdge>> &edges, vector<uint32_t> &offsets, vector<node_id> &targets,
+             vector<double> &weights, vector<node_id> &middle)
+{
+    offsets.assign(1, 0);
+    for (const auto &list : edges) {
+        for (const auto &edge : list) {
+            targets.push_back(edge.to);
+            weights.push_back(edge.weight);
+            middle.push_back(edge.middle);
+        }
+        offsets.push_back(targets.size());
+    }
+}
+
+}
+
+ContractionHierarchy ContractionHierarchy::build(ArrayRef<uint32_t> offsets, ArrayRef<node_id> targets, ArrayRef<double> weights)
+{
+    Contractor contractor(offsets, targets, weights);
+    ContractionHierarchy ch;
+    ch.owned.rank = contractor.run();
+    flatten(contractor.up, ch.owned.up_offsets, ch.owned.up_targets, ch.owned.up_weights, ch.owned.up_middle);
+    flatten(contractor.down, ch.owned.down_offsets, ch.owned.down_targets, ch.owned.down_weights, ch.owned.down_middle);
+    ch.shortcuts = contractor.shortcut_count;
+    ch.bindOwned();
+    return ch;
+}
+
+void ContractionHierarchy::bindOwned()
+{
+    rank = owned.rank;
+    up_offsets = owned.up_offsets;
+    up_targets = owned.up_targets;
+    up_weights = owned.up_weights;
+    up_middle = owned.up_middle;
+    down_offsets = owned.down_offsets;
+    down_targets = owned.down_targets;
+    down_weights = owned.down_weights;
+    down_middle = owned.down_middle;
+}
+
+ContractionHierarchy ContractionHierarchy::fromSnapshot(const MappedSnapshot &snapshot, uint32_t layer)
+{
+    ContractionHierarchy ch;
+    if (!snapshot.has(SectionId::ch_rank, layer)) {
+        return ch;
+    }
+    ch.rank = snapshot.get<uint32_t>(SectionId::ch_rank, layer);
+    ch.up_offsets = snapshot.get<uint32_t>(SectionId::ch_up_offsets, layer);
+    ch.up_targets = snapshot.get<node_id>(SectionId::ch_up_targets, layer);
+    ch.up_weights = snapshot.get<double>(SectionId::ch_up_weights, layer);
+    ch.up_middle = snapshot.get<node_id>(SectionId::ch_up_middle, layer);
+    ch.down_offsets = snapshot.get<uint32_t>(SectionId::ch_down_offsets, layer);
+    ch.down_targets = snapshot.get<node_id>(SectionId::ch_down_targets, layer);
+    ch.down_weights = snapshot.get<double>(SectionId::ch_down_weights, layer);
+    ch.down_middle = snapshot.get<node_id>(SectionId::ch_down_middle, layer);
+    if (ch.up_offsets.size() != ch.rank.size() + 1 || ch.down_offsets.size() != ch.rank.size() + 1
+        || ch.up_targets.size() != ch.up_weights.size() || ch.up_targets.size() != ch.up_middle.size()
+        || ch.down_targets.size() != ch.down_weights.size() || ch.down_targets.size() != ch.down_middle.size()) {
+        throw std::runtime_error("Snapshot has inconsistent contraction hierarchy sections.");
+    }
+    // every shortcut is stored once, either up or down
+    ch.shortcuts = std::count_if(ch.up_middle.begin(), ch.up_middle.end(), [](node_id m) { return m != npos; })
+        + std::count_if(ch.down_middle.begin(), ch.down_middle.end(), [](node_id m) { return m != npos; });
+    return ch;
+}
+
+void ContractionHierarchy::addSections(SnapshotWriter &writer, uint32_t layer) const
+{
+    if (empty()) {
+        return;
+    }
+    writer.add(SectionId::ch_rank, rank, layer);
+    writer.add(SectionId::ch_up_offsets, up_offsets, layer);
+    writer.add(SectionId::ch_up_targets, up_targets, layer);
+    writer.add(SectionId::ch_up_weights, up_weights, layer);
+    writer.add(SectionId::ch_up_middle, up_middle, layer);
+    writer.add(SectionId::ch_down_offsets, down_offsets, layer);
+    writer.add(SectionId::ch_down_targets, down_targets, layer);
+    writer.add(SectionId::ch_down_weights, down_weights, layer);
+    writer.add(SectionId::ch_down_middle, down_middle, layer);
+}
+
+std::vector<ContractionHierarchy::node_id> ContractionHierarchy::query(node_id s, node_id t) const
+{
+    if (s == t) {
+        return {s};
+    }
+    return query(vector<Seed>{{s, 0}}, vector<Seed>{{t, 0}});
+}
+
+std::vector<ContractionHierarchy::node_id> ContractionHierarchy::query(const std::vector<Seed> &sources, const std::vector<Seed> &targets) const
+{
+    SearchContext &context = SearchContext::local(rank.size());
+    SearchSpace &forward = context.forward;
+    SearchSpace &backward = context.backward;
+
+    for (const Seed &seed : sources) {
+        if (seed.dist < forward.dist(seed.node)) {
+            forward.update(seed.node, seed.dist, seed.dist, npos);
+            forward.push(seed.dist, seed.node);
+        }
+    }
+    for (const Seed &seed : targets) {
+        if (seed.dist < backward.dist(seed.node)) {
+            backward.update(seed.node, seed.dist, seed.dist, npos);
+            backward.push(seed.dist, seed.node);
+        }
+    }
+
+    double min_length = inf;
+    node_id meet = npos;
+    while (!forward.empty() || !backward.empty()) {
+        double top_f = forward.empty() ? inf : forward.top().first;
+        double top_b = backward.empty() ? inf : backward.top().first;
+        if (std::min(top_f, top_b) >= min_length) {
+            break;
+        }
+
+        if (top_f <= top_b) {
+            auto [d, v] = forward.top();
+            forward.pop();
+            if (d > forward.dist(v)) {
+                continue;
+            }
+            forward.settle(v);
+            if (d + backward.dist(v) < min_length) {
+                min_length = d + backward.dist(v);
+                meet = v;
+            }
+            // stall-on-demand: a higher node already reaches v more cheaply
+            bool stalled = false;
+            for (uint32_t e = down_offsets[v]; e < down_offsets[v + 1] && !stalled; ++e) {
+                stalled = forward.dist(down_targets[e]) + down_weights[e] < d;
+            }
+            if (stalled) {
+                continue;
+            }
+            for (uint32_t e = up_offsets[v]; e < up_offsets[v + 1]; ++e) {
+                node_id w = up_targets[e];
+                double nd = d + up_weights[e];
+                if (nd < forward.dist(w)) {
+                    forward.update(w, nd, nd, v, e);
+                    forward.push(nd, w);
+                }
+            }
+        } else {
+            auto [d, v] = backward.top();
+            backward.pop();
+            if (d > backward.dist(v)) {
+                continue;
+            }
+            backward.settle(v);
+            if (d + forward.dist(v) < min_length) {
+                min_length = d + forward.dist(v);
+                meet = v;
+            }
+            bool stalled = false;
+            for (uint32_t e = up_offsets[v]; e < up_offsets[v + 1] && !stalled; ++e) {
+                stalled = backward.dist(up_targets[e]) + up_weights[e] < d;
+            }
+            if (stalled) {
+                continue;
+            }
+            for (uint32_t e = down_offsets[v]; e < down_offsets[v + 1]; ++e) {
+                node_id u = down_targets[e];
+                double nd = d + down_weights[e];
+                if (nd < backward.dist(u)) {
+                    backward.update(u, nd, nd, v, e);
+                    backward.push(nd, u);
+                }
+            }
+        }
+    }
+
+    if (meet == npos) {
+        return {};
+    }
+
+    // forward half: source seed -> meet over up edges, collected backwards
+    vector<uint32_t> forward_edges;
+    node_id s = meet;
+    for (; forward.parent(s) != npos; s = forward.parent(s)) {
+        forward_edges.push_back(forward.edge(s));
+    }
+    std::reverse(forward_edges.begin(), forward_edges.end());
+
+    vector<node_id> path = {s};
+    node_id cur = s;
+    for (uint32_t e : forward_edges) {
+        unpack(cur, up_targets[e], up_middle[e], path);
+        cur = up_targets[e];
+    }
+    // backward half: meet -> target seed, each down edge points from cur to the stored parent
+    for (node_id v = meet; backward.parent(v) != npos; v = backward.parent(v)) {
+        uint32_t e = backward.edge(v);
+        node_id next = backward.parent(v);
+        unpack(v, next, down_middle[e], path);
+    }
+    return path;
+}
+
+template <bool Forward, typename Visit>
+void ContractionHierarchy::upwardSearch(node_id root, SearchSpace &space, Visit visit) const
+{
+    const ArrayRef<uint32_t> &relax_offsets = Forward ? up_offsets : down_offsets;
+    const ArrayRef<node_id> &relax_targets = Forward ? up_targets : down_targets;
+    const ArrayRef<double> &relax_weights = Forward ? up_weights : down_weights;
+    const ArrayRef<uint32_t> &stall_offsets = Forward ? down_offsets : up_offsets;
+    const ArrayRef<node_id> &stall_targets = Forward ? down_targets : up_targets;
+    const ArrayRef<double> &stall_weights = Forward ? down_weights : up_weights;
+
+    space.reset(rank.size());
+    space.update(root, 0, 0, npos);
+    space.push(0, root);
+    while (!space.empty()) {
+        auto [d, v] = space.top();
+        space.pop();
+        if (d > space.dist(v)) {
+            continue;
+        }
+        space.settle(v);
+        bool stalled = false;
+        for (uint32_t e = stall_offsets[v]; e < stall_offsets[v + 1] && !stalled; ++e) {
+            stalled = space.dist(stall_targets[e]) + stall_weights[e] < d;
+        }
+        if (stalled) {
+            continue;
+        }
+        visit(v, d);
+        for (uint32_t e = relax_offsets[v]; e < relax_offsets[v + 1]; ++e) {
+            node_id w = relax_targets[e];
+            double nd = d + relax_weights[e];
+            if (nd < space.dist(w)) {
+                space.update(w, nd, nd, v, e);
+                space.push(nd, w);
+            }
+        }
+    }
+}
+
+std::vector<double> ContractionHierarchy::manyToMany(const std::vector<node_id> &sources, const std::vector<node_id> &targets) const
+{
+    struct BucketEntry {
+        node_id node;
+        uint32_t target;
+        double dist;
+    };
+
+    SearchContext &context = SearchContext::local(rank.size());
+
+    vector<BucketEntry> entries;
+    for (uint32_t j = 0; j < targets.size(); ++j) {
+        upwardSearch<false>(targets[j], context.backward, [&](node_id v, double d) {
+            entries.push_back({v, j, d});
+        });
+    }
+    std::sort(entries.begin(), entries.end(), [](const BucketEntry &a, const BucketEntry &b) {
+        return a.node < b.node;
+    });
+
+    // bucket of node v is entries[first, last) for buckets[v] = {first, last}; only
+    // nodes some backward search reached are present
+    std::unordered_map<node_id, std::pair<uint32_t, uint32_t>> buckets;
+    buckets.reserve(entries.size());
+    for (uint32_t i = 0; i < entries.size();) {
+        uint32_t first = i;
+        while (i < entries.size() && entries[i].node == entries[first].node) {
+            ++i;
+        }
+        buckets.emplace(entries[first].node, std::make_pair(first, i));
+    }
+
+    vector<double> result(sources.size() * targets.size(), inf);
+    for (size_t i = 0; i < sources.size(); ++i) {
+        double *row = result.data() + i * targets.size();
+        upwardSearch<true>(sources[i], context.forward, [&](node_id v, double d) {
+            auto it = buckets.find(v);
+            if (it == buckets.end()) {
+                return;
+            }
+            for (uint32_t k = it->second.first; k < it->second.second; ++k) {
+                row[entries[k].target] = std::min(row[entries[k].target], d + entries[k].dist);
+            }
+        });
+    }
+    return result;
+}
+
+void ContractionHierarchy::unpack(node_id from, node_id to, node_id middle, std::vector<node_id> &path) const
+{
+    struct Pending {
+        node_id from, to, middle;
+    };
+    vector<Pending> stack = {{from, to, middle}};
+    while (!stack.empty()) {
+        Pending cur = stack.back();
+        stack.pop_back();
+        if (cur.middle == npos) {
+            path.push_back(cur.to);
+            continue;
+        }
+        // the middle node was contracted first: from -> middle is a down edge of middle,
+        // middle -> to an up edge of middle
+        node_id first_middle = npos, second_middle = npos;
+        for (uint32_t e = down_offsets[cur.middle]; e < down_offsets[cur.middle + 1]; ++e) {
+            if (down_targets[e] == cur.from) {
+                first_middle = down_middle[e];
+                break;
+            }
+        }
+        for (uint32_t e = up_offsets[cur.middle]; e < up_offsets[cur.middle + 1]; ++e) {
+            if (up_targets[e] == cur.to) {
+                second_middle = up_middle[e];
+                break;
+            }
+        }
+        stack.push_back({cur.middle, cur.to, second_middle});
+        stack.push_back({cur.from, cur.middle, first_middle});
+    }
+}
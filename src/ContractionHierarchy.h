@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include "ArrayRef.h"
+#include "Snapshot.h"
+
+class SearchSpace;
+
+/**
+ * Contraction hierarchy over a frozen CSR graph.
+ *
+ * Nodes are contracted one by one in order of edge difference plus deleted
+ * neighbours; a shortcut u -> w through v is only added when a bounded witness
+ * search finds no path from u to w of at most the same length avoiding v.
+ * Every edge is stored at its lower-ranked end: `up` holds v -> w with
+ * rank[w] > rank[v], `down` holds u -> v with rank[u] > rank[v] (indexed by v).
+ * Shortcuts remember their middle node so paths can be unpacked.
+ */
+class ContractionHierarchy {
+    // builds hierarchies over its own ranks and arcs
+    friend class CustomizableHierarchy;
+public:
+    using node_id = uint32_t;
+    static constexpr node_id npos = std::numeric_limits<node_id>::max();
+
+    ContractionHierarchy() = default;
+    ContractionHierarchy(const ContractionHierarchy &) = delete;
+    ContractionHierarchy &operator=(const ContractionHierarchy &) = delete;
+    ContractionHierarchy(ContractionHierarchy &&) = default;
+    ContractionHierarchy &operator=(ContractionHierarchy &&) = default;
+
+    // Edges of infinite weight are left out.
+    static ContractionHierarchy build(ArrayRef<uint32_t> offsets, ArrayRef<node_id> targets, ArrayRef<double> weights);
+
+    // Views the sections of one layer of a mapped snapshot; returns an empty hierarchy if it has none.
+    static ContractionHierarchy fromSnapshot(const MappedSnapshot &snapshot, uint32_t layer = 0);
+
+    void addSections(SnapshotWriter &writer, uint32_t layer = 0) const;
+
+    inline bool empty() const {
+        return rank.empty();
+    }
+
+    inline size_t nodeCount() const {
+        return rank.size();
+    }
+
+    inline size_t shortcutCount() const {
+        return shortcuts;
+    }
+
+    // Bidirectional upward search; returns the unpacked path as original node ids,
+    // empty if t is unreachable.
+    std::vector<node_id> query(node_id s, node_id t) const;
+
+    // A start or end point with the cost already spent getting to it (or still to
+    // pay from it).
+    struct Seed {
+        node_id node;
+        double dist;
+    };
+
+    // Same search started from several seeds on each side; returns the path from the
+    // chosen source seed to the chosen target seed.
+    std::vector<node_id> query(const std::vector<Seed> &sources, const std::vector<Seed> &targets) const;
+
+    // Bucket-based many-to-many: one backward upward search per target leaves
+    // (target, distance) entries at every node it settles, then one forward
+    // upward search per source scans the buckets of the nodes it settles.
+    // Returns sources.size() x targets.size() distances, row-major, infinity
+    // where a target is unreachable.
+    std::vector<double> manyToMany(const std::vector<node_id> &sources, const std::vector<node_id> &targets) const;
+
+private:
+    ArrayRef<uint32_t> rank;
+
+    ArrayRef<uint32_t> up_offsets;
+    ArrayRef<node_id> up_targets;
+    ArrayRef<double> up_weights;
+    ArrayRef<node_id> up_middle;
+
+    ArrayRef<uint32_t> down_offsets;
+    ArrayRef<node_id> down_targets;
+    ArrayRef<double> down_weights;
+    ArrayRef<node_id> down_middle;
+
+    size_t shortcuts = 0;
+
+    struct Buffers {
+        std::vector<uint32_t> rank;
+        std::vector<uint32_t> up_offsets;
+        std::vector<node_id> up_targets;
+        std::vector<double> up_weights;
+        std::vector<node_id> up_middle;
+        std::vector<uint32_t> down_offsets;
+        std::vector<node_id> down_targets;
+        std::vector<double> down_weights;
+        std::vector<node_id> down_middle;
+    } owned;
+
+    void bindOwned();
+
+    void unpack(node_id from, node_id to, node_id middle, std::vector<node_id> &path) const;
+
+    // Complete upward search from root with stall-on-demand, calling visit(v, dist)
+    // for every settled node that is not stalled. Forward walks `up`, backward `down`.
+    template <bool Forward, typename Visit>
+    void upwardSearch(node_id root, SearchSpace &space, Visit visit) const;
+};
@@ -0,0 +1,451 @@
+#include "CustomizableHierarchy.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <stdexcept>
+
+using std::vector;
+
+namespace {
+
+using node_id = CustomizableHierarchy::node_id;
+const node_id npos = CustomizableHierarchy::npos;
+const double inf = std::numeric_limits<double>::infinity();
+
+// cells this small are ranked as they come instead of being cut further
+const size_t leaf_size = 2;
+
+// Nested dissection by coordinates; returns the rank of every node. Ranks are
+// handed out from the top, so each separator ranks above the cells it splits.
+vector<uint32_t> dissection_ranks(ArrayRef<Coord> coords, const vector<vector<node_id>> &neighbors)
+{
+    uint32_t n = coords.size();
+    vector<node_id> nodes(n);
+    std::iota(nodes.begin(), nodes.end(), 0);
+    vector<uint32_t> rank(n);
+    uint32_t next = n;
+    // 1 or 2 for the halves of the cell being cut, 0 elsewhere
+    vector<uint8_t> side(n, 0);
+
+    int64_t lat_sum = 0;
+    for (const Coord &coord : coords) {
+        lat_sum += coord.lat;
+    }
+    double lng_factor = n == 0 ? 1 : std::cos(double(lat_sum) / n / Coord::scale * M_PI / 180.0);
+
+    vector<std::pair<uint32_t, uint32_t>> cells = {{0, n}};
+    while (!cells.empty()) {
+        auto [begin, end] = cells.back();
+        cells.pop_back();
+        if (end - begin <= leaf_size) {
+            for (uint32_t i = begin; i < end; ++i) {
+                rank[nodes[i]] = --next;
+            }
+            continue;
+        }
+
+        int32_t min_lng = coords[nodes[begin]].lng, max_lng = min_lng;
+        int32_t min_lat = coords[nodes[begin]].lat, max_lat = min_lat;
+        for (uint32_t i = begin; i < end; ++i) {
+            const Coord &coord = coords[nodes[i]];
+            min_lng = std::min(min_lng, coord.lng);
+            max_lng = std::max(max_lng, coord.lng);
+            min_lat = std::min(min_lat, coord.lat);
+            max_lat = std::max(max_lat, coord.lat);
+        }
+        bool by_lng = (double(max_lng) - min_lng) * lng_factor >= double(max_lat) - min_lat;
+        uint32_t mid = begin + (end - begin) / 2;
+        std::nth_element(nodes.begin() + begin, nodes.begin() + mid, nodes.begin() + end, [&](node_id a, node_id b) {
+            return by_lng ? coords[a] < coords[b] : std::make_pair(coords[a].lat, coords[a].lng) < std::make_pair(coords[b].lat, coords[b].lng);
+        });
+        for (uint32_t i = begin; i < end; ++i) {
+            side[nodes[i]] = i < mid ? 1 : 2;
+        }
+
+        auto on_boundary = [&](node_id v) {
+            uint8_t other = side[v] == 1 ? 2 : 1;
+            for (node_id w : neighbors[v]) {
+                if (side[w] == other) {
+                    return true;
+                }
+            }
+            return false;
+        };
+        size_t lower_boundary = std::count_if(nodes.begin() + begin, nodes.begin() + mid, on_boundary);
+        size_t upper_boundary = std::count_if(nodes.begin() + mid, nodes.begin() + end, on_boundary);
+
+        // the boundary nodes of the side with fewer of them separate the halves
+        auto inside = [&](node_id v) {
+            return !on_boundary(v);
+        };
+        uint32_t separator_begin, separator_end;
+        if (lower_boundary <= upper_boundary) {
+            separator_begin = std::partition(nodes.begin() + begin, nodes.begin() + mid, inside) - nodes.begin();
+            separator_end = mid;
+            cells.push_back({begin, separator_begin});
+            cells.push_back({mid, end});
+        } else {
+            separator_begin = std::partition(nodes.begin() + mid, nodes.begin() + end, inside) - nodes.begin();
+            separator_end = end;
+            cells.push_back({begin, mid});
+            cells.push_back({mid, separator_begin});
+        }
+        for (uint32_t i = separator_begin; i < separator_end; ++i) {
+            rank[nodes[i]] = --next;
+        }
+        for (uint32_t i = begin; i < end; ++i) {
+            side[nodes[i]] = 0;
+        }
+    }
+    return rank;
+}
+
+// Lightest edge from -> to, infinity if there is none.
+double input_weight(ArrayRef<uint32_t> offsets, ArrayRef<node_id> targets, ArrayRef<double> weights, node_id from, node_id to)
+{
+    double weight = inf;
+    for (uint32_t e = offsets[from]; e < offsets[from + 1]; ++e) {
+        if (targets[e] == to) {
+            weight = std::min(weight, weights[e]);
+        }
+    }
+    return weight;
+}
+
+}
+
+CustomizableHierarchy CustomizableHierarchy::build(ArrayRef<Coord> coords, ArrayRef<uint32_t> offsets, ArrayRef<node_id> targets)
+{
+    uint32_t n = coords.size();
+    vector<vector<node_id>> neighbors(n);
+    for (node_id u = 0; u < n; ++u) {
+        for (uint32_t e = offsets[u]; e < offsets[u + 1]; ++e) {
+            if (targets[e] != u) {
+                neighbors[u].push_back(targets[e]);
+                neighbors[targets[e]].push_back(u);
+            }
+        }
+    }
+    for (auto &list : neighbors) {
+        std::sort(list.begin(), list.end());
+        list.erase(std::unique(list.begin(), list.end()), list.end());
+    }
+
+    CustomizableHierarchy cch;
+    cch.owned.rank = dissection_ranks(coords, neighbors);
+    const vector<uint32_t> &rank = cch.owned.rank;
+    cch.owned.order.resize(n);
+    for (node_id v = 0; v < n; ++v) {
+        cch.owned.order[rank[v]] = v;
+    }
+
+    // Contract in rank order without witnesses: the higher neighbours of each node
+    // become neighbours of the lowest of them, its parent in the elimination tree.
+    vector<vector<node_id>> up(n);
+    for (node_id u = 0; u < n; ++u) {
+        for (node_id v : neighbors[u]) {
+            if (rank[u] < rank[v]) {
+                up[u].push_back(v);
+            }
+        }
+    }
+    neighbors = {};
+    auto by_rank = [&](node_id a, node_id b) {
+        return rank[a] < rank[b];
+    };
+    for (node_id v : cch.owned.order) {
+        auto &list = up[v];
+        std::sort(list.begin(), list.end(), by_rank);
+        list.erase(std::unique(list.begin(), list.end()), list.end());
+        if (list.size() > 1) {
+            up[list.front()].insert(up[list.front()].end(), list.begin() + 1, list.end());
+        }
+    }
+
+    cch.owned.up_offsets.assign(1, 0);
+    vector<uint32_t> lower_count(n + 1, 0);
+    for (auto &list : up) {
+        std::sort(list.begin(), list.end());
+        for (node_id w : list) {
+            cch.owned.up_targets.push_back(w);
+            ++lower_count[w + 1];
+        }
+        cch.owned.up_offsets.push_back(cch.owned.up_targets.size());
+        list = {};
+    }
+
+    // owners come in id order, so every lower list ends up sorted by source
+    std::partial_sum(lower_count.begin(), lower_count.end(), lower_count.begin());
+    cch.owned.lower_offsets = lower_count;
+    cch.owned.lower_sources.resize(cch.owned.up_targets.size());
+    cch.owned.lower_arcs.resize(cch.owned.up_targets.size());
+    for (node_id u = 0; u < n; ++u) {
+        for (uint32_t a = cch.owned.up_offsets[u]; a < cch.owned.up_offsets[u + 1]; ++a) {
+            uint32_t slot = lower_count[cch.owned.up_targets[a]]++;
+            cch.owned.lower_sources[slot] = u;
+            cch.owned.lower_arcs[slot] = a;
+        }
+    }
+
+    cch.bindOwned();
+    return cch;
+}
+
+void CustomizableHierarchy::bindOwned()
+{
+    rank = owned.rank;
+    order = owned.order;
+    up_offsets = owned.up_offsets;
+    up_targets = owned.up_targets;
+    lower_offsets = owned.lower_offsets;
+    lower_sources = owned.lower_sources;
+    lower_arcs = owned.lower_arcs;
+}
+
+CustomizableHierarchy CustomizableHierarchy::fromSnapshot(const MappedSnapshot &snapshot)
+{
+    CustomizableHierarchy cch;
+    if (!snapshot.has(SectionId::cch_rank)) {
+        return cch;
+    }
+    cch.rank = snapshot.get<uint32_t>(SectionId::cch_rank);
+    cch.order = snapshot.get<node_id>(SectionId::cch_order);
+    cch.up_offsets = snapshot.get<uint32_t>(SectionId::cch_up_offsets);
+    cch.up_targets = snapshot.get<node_id>(SectionId::cch_up_targets);
+    cch.lower_offsets = snapshot.get<uint32_t>(SectionId::cch_lower_offsets);
+    cch.lower_sources = snapshot.get<node_id>(SectionId::cch_lower_sources);
+    cch.lower_arcs = snapshot.get<uint32_t>(SectionId::cch_lower_arcs);
+    size_t n = cch.rank.size(), arcs = cch.up_targets.size();
+    if (cch.order.size() != n || cch.up_offsets.size() != n + 1 || cch.lower_offsets.size() != n + 1
+        || cch.lower_sources.size() != arcs || cch.lower_arcs.size() != arcs
+        || cch.up_offsets[n] != arcs || cch.lower_offsets[n] != arcs) {
+        throw std::runtime_error("Snapshot has inconsistent customizable hierarchy sections.");
+    }
+    for (size_t i = 0; i < n; ++i) {
+        if (cch.order[i] >= n || cch.rank[cch.order[i]] != i) {
+            throw std::runtime_error("Snapshot has a customizable hierarchy with a bad node order.");
+        }
+    }
+    for (size_t a = 0; a < arcs; ++a) {
+        if (cch.up_targets[a] >= n || cch.lower_sources[a] >= n || cch.lower_arcs[a] >= arcs) {
+            throw std::runtime_error("Snapshot has a customizable hierarchy with a bad arc.");
+        }
+    }
+    return cch;
+}
+
+void CustomizableHierarchy::addSections(SnapshotWriter &writer) const
+{
+    if (empty()) {
+        return;
+    }
+    writer.add(SectionId::cch_rank, rank);
+    writer.add(SectionId::cch_order, order);
+    writer.add(SectionId::cch_up_offsets, up_offsets);
+    writer.add(SectionId::cch_up_targets, up_targets);
+    writer.add(SectionId::cch_lower_offsets, lower_offsets);
+    writer.add(SectionId::cch_lower_sources, lower_sources);
+    writer.add(SectionId::cch_lower_arcs, lower_arcs);
+}
+
+uint32_t CustomizableHierarchy::findArc(node_id low, node_id high) const
+{
+    auto first = up_targets.begin() + up_offsets[low], last = up_targets.begin() + up_offsets[low + 1];
+    auto it = std::lower_bound(first, last, high);
+    return it != last && *it == high ? static_cast<uint32_t>(it - up_targets.begin()) : npos;
+}
+
+ContractionHierarchy CustomizableHierarchy::emptyMetric() const
+{
+    // up and down share the arcs: the down weight of arc v - w is that of w -> v
+    ContractionHierarchy ch;
+    ch.rank = rank;
+    ch.up_offsets = up_offsets;
+    ch.up_targets = up_targets;
+    ch.down_offsets = up_offsets;
+    ch.down_targets = up_targets;
+    ch.owned.up_weights.assign(arcCount(), inf);
+    ch.owned.up_middle.assign(arcCount(), npos);
+    ch.owned.down_weights.assign(arcCount(), inf);
+    ch.owned.down_middle.assign(arcCount(), npos);
+    return ch;
+}
+
+void CustomizableHierarchy::bindMetric(ContractionHierarchy &ch)
+{
+    ch.up_weights = ch.owned.up_weights;
+    ch.up_middle = ch.owned.up_middle;
+    ch.down_weights = ch.owned.down_weights;
+    ch.down_middle = ch.owned.down_middle;
+    ch.shortcuts = std::count_if(ch.up_middle.begin(), ch.up_middle.end(), [](node_id m) { return m != npos; })
+        + std::count_if(ch.down_middle.begin(), ch.down_middle.end(), [](node_id m) { return m != npos; });
+}
+
+bool CustomizableHierarchy::relax(ContractionHierarchy &ch, node_id owner, uint32_t a, double up_input, double down_input) const
+{
+    vector<double> &up_weights = ch.owned.up_weights, &down_weights = ch.owned.down_weights;
+    node_id other = up_targets[a];
+    double up = up_input, down = down_input;
+    node_id up_middle = npos, down_middle = npos;
+
+    // lower triangles: the nodes below both ends that reach each of them
+    uint32_t i = lower_offsets[owner], i_end = lower_offsets[owner + 1];
+    uint32_t j = lower_offsets[other], j_end = lower_offsets[other + 1];
+    while (i < i_end && j < j_end) {
+        if (lower_sources[i] < lower_sources[j]) {
+            ++i;
+        } else if (lower_sources[j] < lower_sources[i]) {
+            ++j;
+        } else {
+            node_id u = lower_sources[i];
+            uint32_t to_owner = lower_arcs[i], to_other = lower_arcs[j];
+            double via = down_weights[to_owner] + up_weights[to_other];
+            if (via < up) {
+                up = via;
+                up_middle = u;
+            }
+            via = down_weights[to_other] + up_weights[to_owner];
+            if (via < down) {
+                down = via;
+                down_middle = u;
+            }
+            ++i;
+            ++j;
+        }
+    }
+
+    bool changed = up != up_weights[a] || down != down_weights[a];
+    up_weights[a] = up;
+    ch.owned.up_middle[a] = up_middle;
+    down_weights[a] = down;
+    ch.owned.down_middle[a] = down_middle;
+    return changed;
+}
+
+ContractionHierarchy CustomizableHierarchy::customize(ArrayRef<uint32_t> offsets, ArrayRef<node_id> targets, ArrayRef<double> weights) const
+{
+    ContractionHierarchy ch = emptyMetric();
+    vector<double> &up_weights = ch.owned.up_weights, &down_weights = ch.owned.down_weights;
+    for (node_id u = 0; u + 1 < offsets.size(); ++u) {
+        for (uint32_t e = offsets[u]; e < offsets[u + 1]; ++e) {
+            node_id v = targets[e];
+            if (v == u) {
+                continue;
+            }
+            if (rank[u] < rank[v]) {
+                double &weight = up_weights[findArc(u, v)];
+                weight = std::min(weight, weights[e]);
+            } else {
+                double &weight = down_weights[findArc(v, u)];
+                weight = std::min(weight, weights[e]);
+            }
+        }
+    }
+    // every triangle below an arc is final once the arcs of lower owners are
+    for (node_id owner : order) {
+        for (uint32_t a = up_offsets[owner]; a < up_offsets[owner + 1]; ++a) {
+            relax(ch, owner, a, up_weights[a], down_weights[a]);
+        }
+    }
+
+    bindMetric(ch);
+    return ch;
+}
+
+ContractionHierarchy CustomizableHierarchy::customize(const ContractionHierarchy &previous, ArrayRef<uint32_t> offsets, ArrayRef<node_id> targets,
+                                                      ArrayRef<double> weights, const std::vector<uint32_t> &changed, size_t *recomputed) const
+{
+    if (previous.up_targets.data() != up_targets.data() || previous.up_weights.size() != arcCount()) {
+        throw std::runtime_error("Contraction hierarchy is not a customization of this hierarchy.");
+    }
+    ContractionHierarchy ch = emptyMetric();
+    ch.owned.up_weights.assign(previous.up_weights.begin(), previous.up_weights.end());
+    ch.owned.up_middle.assign(previous.up_middle.begin(), previous.up_middle.end());
+    ch.owned.down_weights.assign(previous.down_weights.begin(), previous.down_weights.end());
+    ch.owned.down_middle.assign(previous.down_middle.begin(), previous.down_middle.end());
+
+    vector<char> dirty(arcCount(), 0);
+    uint32_t lowest = nodeCount();
+    for (uint32_t e : changed) {
+        node_id u = static_cast<node_id>(std::upper_bound(offsets.begin(), offsets.end(), e) - offsets.begin() - 1), v = targets[e];
+        if (u != v) {
+            node_id low = rank[u] < rank[v] ? u : v;
+            dirty[findArc(low, low == u ? v : u)] = 1;
+            lowest = std::min(lowest, rank[low]);
+        }
+    }
+
+    // Sweep the owners upwards from the lowest dirty arc. A changed arc x - y is a
+    // side of the triangle under y - z for every other arc x - z; that arc only
+    // needs recomputing if its weight came through x or the new way through x is
+    // lighter, and its owner ranks above x, so it comes later in the sweep.
+    vector<double> &up_weights = ch.owned.up_weights, &down_weights = ch.owned.down_weights;
+    vector<uint32_t> changed_arcs;
+    size_t count = 0;
+    for (uint32_t r = lowest; r < nodeCount(); ++r) {
+        node_id x = order[r];
+        changed_arcs.clear();
+        for (uint32_t a = up_offsets[x]; a < up_offsets[x + 1]; ++a) {
+            if (!dirty[a]) {
+                continue;
+            }
+            ++count;
+            node_id y = up_targets[a];
+            if (relax(ch, x, a, input_weight(offsets, targets, weights, x, y), input_weight(offsets, targets, weights, y, x))) {
+                changed_arcs.push_back(a);
+            }
+        }
+        if (changed_arcs.empty()) {
+            continue;
+        }
+        uint32_t highest_changed = 0;
+        for (uint32_t a : changed_arcs) {
+            highest_changed = std::max(highest_changed, rank[up_targets[a]]);
+        }
+        // every pair low - high of x's upper neighbours is an arc of low; walk x's
+        // arcs and low's side by side, both sorted by id
+        uint32_t begin = up_offsets[x], end = up_offsets[x + 1];
+        size_t next_changed = 0;
+        for (uint32_t p = begin; p < end; ++p) {
+            node_id low = up_targets[p];
+            bool p_changed = next_changed < changed_arcs.size() && changed_arcs[next_changed] == p;
+            next_changed += p_changed;
+            if (!p_changed && highest_changed <= rank[low]) {
+                continue;
+            }
+            uint32_t q = begin, c = up_offsets[low], c_end = up_offsets[low + 1];
+            size_t q_changed = 0;
+            while (q < end && c < c_end) {
+                if (up_targets[q] < up_targets[c]) {
+                    ++q;
+                    continue;
+                }
+                if (up_targets[c] < up_targets[q]) {
+                    ++c;
+                    continue;
+                }
+                while (q_changed < changed_arcs.size() && changed_arcs[q_changed] < q) {
+                    ++q_changed;
+                }
+                bool q_is_changed = q_changed < changed_arcs.size() && changed_arcs[q_changed] == q;
+                if ((p_changed || q_is_changed) && !dirty[c]) {
+                    double up_via = down_weights[p] + up_weights[q];
+                    double down_via = down_weights[q] + up_weights[p];
+                    if (ch.owned.up_middle[c] == x || ch.owned.down_middle[c] == x
+                        || up_via < up_weights[c] || down_via < down_weights[c]) {
+                        dirty[c] = 1;
+                    }
+                }
+                ++q;
+                ++c;
+            }
+        }
+    }
+    if (recomputed) {
+        *recomputed += count;
+    }
+
+    bindMetric(ch);
+    return ch;
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include "ArrayRef.h"
+#include "ContractionHierarchy.h"
+#include "Node.h"
+#include "Snapshot.h"
+
+/**
+ * Customizable contraction hierarchy: the metric-independent half of a CH.
+ *
+ * Nodes are ranked by geometric nested dissection (each cell is cut at the median
+ * of its wider axis and the boundary nodes of the smaller side rank above both
+ * halves) and contracted without witness searches, so the arcs, a chordal
+ * supergraph of the road graph taken as undirected, serve every metric. Each arc
+ * is stored once at its lower-ranked end, sorted by the node id of the other end;
+ * `lower` lists the arcs that reach each node from below.
+ *
+ * customize() fills in the weights of one metric bottom-up: an arc x - y takes
+ * the lighter of its own edges and every x - u - y through a lower node u. The
+ * result is an ordinary ContractionHierarchy that queries and unpacks like a built
+ * one, and views this object's ranks and arcs, so it must not outlive it.
+ */
+class CustomizableHierarchy {
+public:
+    using node_id = uint32_t;
+    static constexpr node_id npos = std::numeric_limits<node_id>::max();
+
+    CustomizableHierarchy() = default;
+    CustomizableHierarchy(const CustomizableHierarchy &) = delete;
+    CustomizableHierarchy &operator=(const CustomizableHierarchy &) = delete;
+    CustomizableHierarchy(CustomizableHierarchy &&) = default;
+    CustomizableHierarchy &operator=(CustomizableHierarchy &&) = default;
+
+    static CustomizableHierarchy build(ArrayRef<Coord> coords, ArrayRef<uint32_t> offsets, ArrayRef<node_id> targets);
+
+    // Views the sections of a mapped snapshot; returns an empty hierarchy if it has none.
+    static CustomizableHierarchy fromSnapshot(const MappedSnapshot &snapshot);
+
+    void addSections(SnapshotWriter &writer) const;
+
+    inline bool empty() const {
+        return rank.empty();
+    }
+
+    inline size_t nodeCount() const {
+        return rank.size();
+    }
+
+    inline size_t arcCount() const {
+        return up_targets.size();
+    }
+
+    // Full customization for a metric over the graph the hierarchy was built from;
+    // edges of infinite weight are closed.
+    ContractionHierarchy customize(ArrayRef<uint32_t> offsets, ArrayRef<node_id> targets, ArrayRef<double> weights) const;
+
+    // Partial customization: previous is a customization of this hierarchy for a
+    // metric that differs from weights only on the `changed` edges. Only the arcs
+    // of those edges and the arcs above them whose triangles change are recomputed;
+    // their number is added to *recomputed.
+    ContractionHierarchy customize(const ContractionHierarchy &previous, ArrayRef<uint32_t> offsets, ArrayRef<node_id> targets,
+                                   ArrayRef<double> weights, const std::vector<uint32_t> &changed, size_t *recomputed = nullptr) const;
+
+private:
+    ArrayRef<uint32_t> rank;
+    // node ids by rank, lowest first
+    ArrayRef<node_id> order;
+
+    // arcs owned by v are [up_offsets[v], up_offsets[v + 1]), up_targets sorted by id
+    ArrayRef<uint32_t> up_offsets;
+    ArrayRef<node_id> up_targets;
+
+    // arcs u - v with rank[u] < rank[v] are [lower_offsets[v], lower_offsets[v + 1]),
+    // lower_sources (u, sorted by id) and lower_arcs (the arc index) side by side
+    ArrayRef<uint32_t> lower_offsets;
+    ArrayRef<node_id> lower_sources;
+    ArrayRef<uint32_t> lower_arcs;
+
+    struct Buffers {
+        std::vector<uint32_t> rank;
+        std::vector<node_id> order;
+        std::vector<uint32_t> up_offsets;
+        std::vector<node_id> up_targets;
+        std::vector<uint32_t> lower_offsets;
+        std::vector<node_id> lower_sources;
+        std::vector<uint32_t> lower_arcs;
+    } owned;
+
+    void bindOwned();
+
+    // Arc between low and high (rank[low] < rank[high]), npos if there is none.
+    uint32_t findArc(node_id low, node_id high) const;
+
+    // The hierarchy over this object's arcs, with every weight infinite.
+    ContractionHierarchy emptyMetric() const;
+
+    // Points the weight and middle views of ch at its own buffers once they are filled in.
+    static void bindMetric(ContractionHierarchy &ch);
+
+    // Recomputes arc a of owner from its input weights and lower triangles; returns
+    // whether either direction changed.
+    bool relax(ContractionHierarchy &ch, node_id owner, uint32_t a, double up_input, double down_input) const;
+};
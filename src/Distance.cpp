@@ -0,0 +1,78 @@
+#include "Distance.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MAP_DISTANCE_AVX2 1
+#endif
+
+DistanceBound::DistanceBound(const Coord &anchor)
+    : anchor(anchor), cos_lat(std::cos(anchor.getLat() * M_PI / 180.0)),
+      sin_lat(std::abs(std::sin(anchor.getLat() * M_PI / 180.0))) {}
+
+#ifdef MAP_DISTANCE_AVX2
+
+// Four points per step, the same operations in the same order as bound(), so both
+// paths give identical results.
+__attribute__((target("avx2")))
+void distance_bound_avx2(const DistanceBound &bound, const Coord *points, size_t n, double *out)
+{
+    const __m256d sign = _mm256_set1_pd(-0.0), zero = _mm256_setzero_pd();
+    const __m256d one = _mm256_set1_pd(1), half = _mm256_set1_pd(0.5), sixth = _mm256_set1_pd(DistanceBound::sixth);
+    const __m256d unit = _mm256_set1_pd(DistanceBound::unit), two_pi = _mm256_set1_pd(2 * M_PI);
+    const __m256d scale = _mm256_set1_pd(2 * DistanceBound::earth_radius * DistanceBound::slack);
+    const __m256d margin = _mm256_set1_pd(DistanceBound::margin);
+    const __m256d anchor_lng = _mm256_set1_pd(bound.anchor.lng), anchor_lat = _mm256_set1_pd(bound.anchor.lat);
+    const __m256d cos_lat = _mm256_set1_pd(bound.cos_lat), sin_lat = _mm256_set1_pd(bound.sin_lat);
+    // lng of the four points to the low half, lat to the high half
+    const __m256i lanes = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i raw = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(points + i));
+        raw = _mm256_permutevar8x32_epi32(raw, lanes);
+        __m256d lng = _mm256_cvtepi32_pd(_mm256_castsi256_si128(raw));
+        __m256d lat = _mm256_cvtepi32_pd(_mm256_extracti128_si256(raw, 1));
+
+        __m256d y = _mm256_mul_pd(_mm256_andnot_pd(sign, _mm256_sub_pd(lng, anchor_lng)), unit);
+        y = _mm256_mul_pd(half, _mm256_min_pd(y, _mm256_sub_pd(two_pi, y)));
+        __m256d b = _mm256_mul_pd(_mm256_andnot_pd(sign, _mm256_sub_pd(lat, anchor_lat)), unit);
+        __m256d x = _mm256_mul_pd(half, b);
+
+        __m256d sx = _mm256_max_pd(zero, _mm256_mul_pd(x, _mm256_sub_pd(one, _mm256_mul_pd(_mm256_mul_pd(x, x), sixth))));
+        __m256d sy = _mm256_max_pd(zero, _mm256_mul_pd(y, _mm256_sub_pd(one, _mm256_mul_pd(_mm256_mul_pd(y, y), sixth))));
+        __m256d cos_other = _mm256_max_pd(zero, _mm256_sub_pd(
+            _mm256_mul_pd(cos_lat, _mm256_sub_pd(one, _mm256_mul_pd(_mm256_mul_pd(half, b), b))),
+            _mm256_mul_pd(sin_lat, b)));
+        __m256d lng_part = _mm256_mul_pd(_mm256_mul_pd(_mm256_mul_pd(cos_lat, cos_other), sy), sy);
+        __m256d sum = _mm256_add_pd(_mm256_mul_pd(sx, sx), lng_part);
+        _mm256_storeu_pd(out + i, _mm256_sub_pd(_mm256_mul_pd(scale, _mm256_sqrt_pd(sum)), margin));
+    }
+    for (; i < n; ++i) {
+        out[i] = bound(points[i]);
+    }
+}
+
+#endif
+
+void DistanceBound::batch(const Coord *points, size_t n, double *out) const
+{
+#ifdef MAP_DISTANCE_AVX2
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    if (avx2) {
+        distance_bound_avx2(*this, points, n, out);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = (*this)(points[i]);
+    }
+}
+
+PlaneProjection PlaneProjection::around(double lat)
+{
+    const double earth_radius = 6371000;
+    PlaneProjection projection;
+    projection.lat_meters = earth_radius * M_PI / 180.0 / Coord::scale;
+    projection.lng_meters = projection.lat_meters * std::cos(lat * M_PI / 180.0);
+    return projection;
+}
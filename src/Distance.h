@@ -0,0 +1,74 @@
+#pragma once
+
+#include "Node.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+/**
+ * Cheap stand-ins for calculate_distance where a bound is all that is needed.
+ *
+ * DistanceBound is a lower bound on the great-circle distance from one anchor,
+ * built from the chord under the arc with sin and cos replaced by polynomial
+ * bounds: no trigonometry per point, within about theta^2 / 24 of the exact value
+ * for an arc of theta radians. batch() evaluates it for many points at once, with
+ * AVX2 where the CPU has it.
+ *
+ * PlaneProjection is an equirectangular projection of the fixed-point grid around
+ * one reference latitude. Its distances are Euclidean, hence a metric, but are not
+ * bounds of the great-circle distance by themselves; see Graph::lowerBound.
+ */
+class DistanceBound {
+    friend void distance_bound_avx2(const DistanceBound &bound, const Coord *points, size_t n, double *out);
+public:
+    DistanceBound() = default;
+    explicit DistanceBound(const Coord &anchor);
+
+    inline double operator()(const Coord &point) const {
+        return bound(point.lng - double(anchor.lng), point.lat - double(anchor.lat));
+    }
+
+    // out[i] = (*this)(points[i]) for i < n
+    void batch(const Coord *points, size_t n, double *out) const;
+
+private:
+    // radians per fixed-point unit
+    static constexpr double unit = M_PI / 180.0 / Coord::scale;
+    static constexpr double earth_radius = 6371000;
+    // cover the rounding of both, so the bound never exceeds calculate_distance;
+    // the margin (meters) is for the cancellation in its differences of degrees
+    static constexpr double slack = 1 - 1e-9;
+    static constexpr double margin = 1e-6;
+    static constexpr double sixth = 1.0 / 6;
+
+    // from the differences in fixed-point units
+    inline double bound(double dlng, double dlat) const {
+        double y = std::abs(dlng) * unit;
+        y = 0.5 * std::min(y, 2 * M_PI - y);
+        double b = std::abs(dlat) * unit, x = 0.5 * b;
+        // sin t >= t - t^3 / 6, cos(lat + b) >= cos(lat) (1 - b^2 / 2) - |sin(lat)| b
+        double sx = std::max(0.0, x * (1 - x * x * sixth));
+        double sy = std::max(0.0, y * (1 - y * y * sixth));
+        double cos_other = std::max(0.0, cos_lat * (1 - 0.5 * b * b) - sin_lat * b);
+        return 2 * earth_radius * slack * std::sqrt(sx * sx + cos_lat * cos_other * sy * sy) - margin;
+    }
+
+    Coord anchor = {0, 0};
+    double cos_lat = 1;
+    // absolute value
+    double sin_lat = 0;
+};
+
+struct PlaneProjection {
+    // meters per fixed-point unit along each axis
+    double lng_meters = 0;
+    double lat_meters = 0;
+
+    static PlaneProjection around(double lat);
+
+    inline double distance(const Coord &a, const Coord &b) const {
+        double dx = (a.lng - double(b.lng)) * lng_meters, dy = (a.lat - double(b.lat)) * lat_meters;
+        return std::sqrt(dx * dx + dy * dy);
+    }
+};
@@ -0,0 +1,172 @@
+#include "GeoJSONReader.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+
+namespace {
+
+const size_t read_buffer_size = 1 << 20;
+
+}
+
+GeoJSONReader::GeoJSONReader(const std::string &filename) : buffer(read_buffer_size)
+{
+    // the buffer has to be installed before the file is opened
+    file.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+    file.open(filename, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error("Cannot open GeoJSON file " + filename);
+    }
+    input = file.rdbuf();
+
+    Json::CharReaderBuilder builder;
+    parser.reset(builder.newCharReader());
+
+    seekFeatures();
+}
+
+int GeoJSONReader::skipSpace()
+{
+    int c = read();
+    while (c != EOF && std::isspace(c)) {
+        c = read();
+    }
+    return c;
+}
+
+// Walks the members of the top-level object up to `"features": [`.
+void GeoJSONReader::seekFeatures()
+{
+    if (skipSpace() != '{') {
+        throw std::runtime_error("GeoJSON file does not start with an object.");
+    }
+    std::string key;
+    while (true) {
+        int c = skipSpace();
+        if (c == ',') {
+            c = skipSpace();
+        }
+        if (c == '}' || c == EOF) {
+            // no features at all
+            return;
+        }
+        if (c != '"') {
+            throw std::runtime_error("Malformed GeoJSON: expected a member name.");
+        }
+        key.clear();
+        readString(key);
+        if (skipSpace() != ':') {
+            throw std::runtime_error("Malformed GeoJSON: expected ':' after \"" + key + "\".");
+        }
+        if (key == "features") {
+            if (skipSpace() != '[') {
+                throw std::runtime_error("Malformed GeoJSON: \"features\" is not an array.");
+            }
+            in_array = true;
+            return;
+        }
+        readValue(skipSpace(), text);
+    }
+}
+
+// Appends the body of a string whose opening quote was just read, escapes kept
+// as written; consumes the closing quote without appending it.
+void GeoJSONReader::readString(std::string &out)
+{
+    while (true) {
+        int c = read();
+        if (c == EOF) {
+            throw std::runtime_error("Malformed GeoJSON: unterminated string.");
+        }
+        if (c == '"') {
+            return;
+        }
+        out.push_back(static_cast<char>(c));
+        if (c == '\\') {
+            c = read();
+            if (c == EOF) {
+                throw std::runtime_error("Malformed GeoJSON: unterminated string.");
+            }
+            out.push_back(static_cast<char>(c));
+        }
+    }
+}
+
+// Copies one complete JSON value starting with `c` into out.
+void GeoJSONReader::readValue(int c, std::string &out)
+{
+    out.clear();
+    int depth = 0;
+    for (;; c = read()) {
+        if (c == EOF) {
+            throw std::runtime_error("Malformed GeoJSON: unexpected end of file.");
+        }
+        if (depth == 0 && !out.empty() && (c == ',' || c == '}' || c == ']' || std::isspace(c))) {
+            // end of a bare number / literal
+            input->sungetc();
+            return;
+        }
+        out.push_back(static_cast<char>(c));
+        if (c == '"') {
+            readString(out);
+            out.push_back('"');
+            if (depth == 0) {
+                return;
+            }
+        } else if (c == '{' || c == '[') {
+            ++depth;
+        } else if (c == '}' || c == ']') {
+            if (--depth == 0) {
+                return;
+            }
+        }
+    }
+}
+
+bool GeoJSONReader::nextText(std::string &out)
+{
+    if (!in_array) {
+        return false;
+    }
+    int c = skipSpace();
+    if (c == ',') {
+        c = skipSpace();
+    }
+    if (c == ']') {
+        in_array = false;
+        return false;
+    }
+    readValue(c, out);
+    ++features;
+    return true;
+}
+
+bool GeoJSONReader::next(Json::Value &feature)
+{
+    if (!nextText(text)) {
+        return false;
+    }
+
+    std::string errors;
+    if (!parser->parse(text.data(), text.data() + text.size(), &feature, &errors)) {
+        throw std::runtime_error("Malformed GeoJSON feature " + std::to_string(features - 1) + ": " + errors);
+    }
+    return true;
+}
+
+size_t read_features(const std::string &filename, const std::function<void(const Json::Value &)> &callback)
+{
+    auto start = std::chrono::steady_clock::now();
+    GeoJSONReader reader(filename);
+    Json::Value feature;
+    while (reader.next(feature)) {
+        callback(feature);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Read " << reader.count() << " features from " << filename << " in " << seconds << " s ("
+              << static_cast<size_t>(reader.count() / std::max(seconds, 1e-9)) << " features/s)" << std::endl;
+    return reader.count();
+}
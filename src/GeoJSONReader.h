@@ -0,0 +1,57 @@
+#pragma once
+
+#include <jsoncpp/json/json.h>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Streams the "features" array of a GeoJSON FeatureCollection.
+ *
+ * The file is scanned through a fixed read buffer, and only the raw text of the
+ * current feature is kept and parsed into a Json::Value. Memory is therefore
+ * bounded by the largest feature, not by the size of the file. Top-level members
+ * other than "features" are skipped.
+ */
+class GeoJSONReader {
+public:
+    explicit GeoJSONReader(const std::string &filename);
+
+    // Parses the next feature into `feature`; returns false after the last one.
+    bool next(Json::Value &feature);
+
+    // Copies the unparsed JSON text of the next feature into `text`, so parsing can
+    // happen on another thread; returns false after the last one.
+    bool nextText(std::string &text);
+
+    inline size_t count() const {
+        return features;
+    }
+
+private:
+    std::vector<char> buffer;
+    std::ifstream file;
+    std::streambuf *input;
+    // raw text of the value being read
+    std::string text;
+    std::unique_ptr<Json::CharReader> parser;
+    bool in_array = false;
+    size_t features = 0;
+
+    inline int read() {
+        return input->sbumpc();
+    }
+
+    int skipSpace();
+    void seekFeatures();
+    void readString(std::string &out);
+    void readValue(int c, std::string &out);
+};
+
+/**
+ * Calls `callback` on every feature of the file in order and prints the ingest
+ * rate. Returns the number of features read.
+ */
+size_t read_features(const std::string &filename, const std::function<void(const Json::Value &)> &callback);
@@ -2,159 +2,540 @@
 
 #include <rapidfuzz/fuzz.hpp>
 #include <map>
-#include <queue>
 #include <algorithm>
+#include <cmath>
 #include <limits>
 #include <set>
+#include <unordered_map>
 
 using std::string;
 using std::vector;
 using std::map;
 
-void Graph::serialize(std::ofstream &out) const {
-    // serialize rev_adjacent list
-    size_t rev_adjCount = rev_adjList.size();
-    out.write(reinterpret_cast<const char*>(&rev_adjCount), sizeof(rev_adjCount));
-    for (const auto& [node, neighbors] : rev_adjList) {
-        node.serialize(out);
+namespace {
 
-        size_t neighborCount = neighbors.size();
-        out.write(reinterpret_cast<const char *>(&neighborCount), sizeof(neighborCount));
+// longest gap between the samples of one road segment in the segment index, meters
+const double segment_spacing = 50;
 
-        for (const auto& neighbor : neighbors) {
-            neighbor.serialize(out);
-        }
+}
+
+void Graph::freeze(std::vector<Coord> _coords, std::vector<uint32_t> _offsets,
+                   std::vector<node_id> _targets, std::vector<double> _weights) {
+    auto built = std::make_shared<Topology>();
+    built->coords = std::move(_coords);
+    built->offsets = std::move(_offsets);
+    built->targets = std::move(_targets);
+    size_t n = built->coords.size();
+    if (built->offsets.size() != n + 1 || built->targets.size() != _weights.size()
+        || built->offsets.back() != built->targets.size()) {
+        throw std::runtime_error("Inconsistent CSR arrays passed to Graph::freeze.");
     }
 
-    // serialize adjacent list
-    size_t adjCount = adjList.size();
-    out.write(reinterpret_cast<const char*>(&adjCount), sizeof(adjCount));
-    for (const auto& [node, neighbors] : adjList) {
-        node.serialize(out);
+    built->coord_order.resize(n);
+    for (node_id id = 0; id < n; ++id) {
+        built->coord_order[id] = id;
+    }
+    std::sort(built->coord_order.begin(), built->coord_order.end(), [&built](node_id a, node_id b) {
+        return built->coords[a] < built->coords[b];
+    });
 
-        size_t neighborCount = neighbors.size();
-        out.write(reinterpret_cast<const char*>(&neighborCount), sizeof(neighborCount));
+    built->rev_offsets.assign(n + 1, 0);
+    for (node_id v : built->targets) {
+        ++built->rev_offsets[v + 1];
+    }
 
-        for (const auto& neighbor : neighbors) {
-            neighbor.serialize(out);
+    // reverse CSR by counting sort on the target
+    for (size_t i = 0; i < n; ++i) {
+        built->rev_offsets[i + 1] += built->rev_offsets[i];
+    }
+    built->rev_targets.resize(built->targets.size());
+    built->rev_edges.resize(built->targets.size());
+    vector<uint32_t> fill(built->rev_offsets.begin(), built->rev_offsets.end() - 1);
+    for (node_id src = 0; src < n; ++src) {
+        for (uint32_t e = built->offsets[src]; e < built->offsets[src + 1]; ++e) {
+            uint32_t pos = fill[built->targets[e]]++;
+            built->rev_targets[pos] = src;
+            built->rev_edges[pos] = e;
         }
     }
 
-    // serialize distance map
-    size_t distCount = distances.size();
-    out.write(reinterpret_cast<const char*>(&distCount), sizeof(distCount));
-    for (const auto& [nodePair, dist] : distances) {
-        nodePair.first.serialize(out);
-        nodePair.second.serialize(out);
-        out.write(reinterpret_cast<const char*>(&dist), sizeof(dist));
+    // std::map keeps names sorted as well
+    for (const auto& [name, coord] : location_map) {
+        built->names.push_back({static_cast<uint32_t>(built->name_text.size()), static_cast<uint32_t>(name.size()), coord.first, coord.second});
+        built->name_text.insert(built->name_text.end(), name.begin(), name.end());
     }
 
-    // serialize location map
-    size_t locationCount = location_map.size();
-    out.write(reinterpret_cast<const char*>(&locationCount), sizeof(locationCount));
-    for (const auto& [name, coord] : location_map) {
-        size_t nameLength = name.size();
-        out.write(reinterpret_cast<const char*>(&nameLength), sizeof(nameLength));
-        out.write(name.c_str(), nameLength);
-        
-        out.write(reinterpret_cast<const char*>(&coord.first), sizeof(coord.first));
-        out.write(reinterpret_cast<const char*>(&coord.second), sizeof(coord.second));
+    coords = built->coords;
+    coord_order = built->coord_order;
+    offsets = built->offsets;
+    targets = built->targets;
+    rev_offsets = built->rev_offsets;
+    rev_targets = built->rev_targets;
+    rev_edges = built->rev_edges;
+    names = built->names;
+    name_text = built->name_text;
+    topology = built;
+    snapshot.reset();
+
+    vector<KDNode> kd_points;
+    kd_points.reserve(n);
+    for (node_id id = 0; id < n; ++id) {
+        kd_points.emplace_back(coords[id], id);
     }
+    kdtree = std::make_shared<const KDTree>(std::move(kd_points));
+    name_index = std::make_shared<const NameIndex>(NameIndex::build(names, name_text));
 
-    // serialize kdtree
-    kdtree.serialize(out);
+    // each segment is cut into pieces of at most segment_spacing and sampled at their
+    // middles, so every point of it lies within segment_spacing / 2 of a sample; two-way
+    // roads are sampled once, from the lower id
+    auto has_edge = [this](node_id from, node_id to) {
+        for (uint32_t e = offsets[from]; e < offsets[from + 1]; ++e) {
+            if (targets[e] == to) {
+                return true;
+            }
+        }
+        return false;
+    };
+    vector<KDNode> samples;
+    for (node_id u = 0; u < n; ++u) {
+        for (uint32_t e = offsets[u]; e < offsets[u + 1]; ++e) {
+            node_id v = targets[e];
+            if (v == u || (v < u && has_edge(v, u))) {
+                continue;
+            }
+            const Coord &a = coords[u], &b = coords[v];
+            size_t pieces = std::max<size_t>(1, std::ceil(calculate_distance(a, b) / segment_spacing));
+            for (size_t k = 0; k < pieces; ++k) {
+                double t = (k + 0.5) / pieces;
+                Coord sample = {static_cast<int32_t>(a.lng + std::lround(t * (int64_t(b.lng) - a.lng))),
+                                static_cast<int32_t>(a.lat + std::lround(t * (int64_t(b.lat) - a.lat)))};
+                samples.emplace_back(sample, e);
+            }
+        }
+    }
+    segment_index = std::make_shared<const KDTree>(std::move(samples));
+
+    setWeights(std::move(_weights));
+    location_map.clear();
 }
 
-void Graph::deserialize(std::ifstream &in) {
-    // clear current content
-    rev_adjList.clear();
-    adjList.clear();
-    distances.clear();
+void Graph::freezeProfile(const Graph &base, std::vector<double> _weights) {
+    if (_weights.size() != base.targets.size()) {
+        throw std::runtime_error("Profile weights do not match the shared topology.");
+    }
+    coords = base.coords;
+    coord_order = base.coord_order;
+    offsets = base.offsets;
+    targets = base.targets;
+    rev_offsets = base.rev_offsets;
+    rev_targets = base.rev_targets;
+    rev_edges = base.rev_edges;
+    names = base.names;
+    name_text = base.name_text;
+    topology = base.topology;
+    snapshot = base.snapshot;
+    kdtree = base.kdtree;
+    segment_index = base.segment_index;
+    name_index = base.name_index;
+    cch = base.cch;
+
+    setWeights(std::move(_weights));
     location_map.clear();
+}
 
-    // deserialize rev_adjList
-    size_t rev_adjCount;
-    in.read(reinterpret_cast<char*>(&rev_adjCount), sizeof(rev_adjCount));
-    for (size_t i = 0; i < rev_adjCount; ++i) {
-        Node node;
-        node.deserialize(in);
-        size_t neighborCount;
-        in.read(reinterpret_cast<char*>(&neighborCount), sizeof(neighborCount));
+void Graph::setWeights(std::vector<double> _weights) {
+    owned_weights = std::move(_weights);
+    weights = owned_weights;
 
-        for (size_t j = 0; j < neighborCount; ++j) {
-            Node neighbor;
-            neighbor.deserialize(in);
-            rev_adjList[node].insert(neighbor);
+    int32_t min_lat = std::numeric_limits<int32_t>::max(), max_lat = std::numeric_limits<int32_t>::min();
+    for (const Coord &coord : coords) {
+        min_lat = std::min(min_lat, coord.lat);
+        max_lat = std::max(max_lat, coord.lat);
+    }
+    meta.projection = PlaneProjection::around(coords.empty() ? 0 : (double(min_lat) + max_lat) / 2 / Coord::scale);
+
+    // The projection is a plane metric, so bounding every edge by its weight makes
+    // the heuristic consistent over the graph wherever the projection is off.
+    restricted = false;
+    meta.heuristic_scale = 1;
+    for (node_id src = 0; src < nodeCount(); ++src) {
+        for (uint32_t e = offsets[src]; e < offsets[src + 1]; ++e) {
+            if (!std::isfinite(weights[e])) {
+                restricted = true;
+                continue;
+            }
+            double straight = meta.projection.distance(coords[src], coords[targets[e]]);
+            if (straight > 0) {
+                meta.heuristic_scale = std::min(meta.heuristic_scale, weights[e] / straight);
+            }
         }
     }
+    // leave room for rounding
+    meta.heuristic_scale *= 0.999999;
 
-    // deserialize adjList
-    size_t adjCount;
-    in.read(reinterpret_cast<char*>(&adjCount), sizeof(adjCount));
-    for (size_t i = 0; i < adjCount; ++i) {
-        Node node;
-        node.deserialize(in);
-        size_t neighborCount;
-        in.read(reinterpret_cast<char*>(&neighborCount), sizeof(neighborCount));
+    ch = ContractionHierarchy();
+    customized = false;
+    landmarks = std::make_shared<const Landmarks>();
+    travel_times = std::make_shared<const TravelTimes>();
+}
 
-        for (size_t j = 0; j < neighborCount; ++j) {
-            Node neighbor;
-            neighbor.deserialize(in);
-            adjList[node].insert(neighbor);
+bool Graph::accessible(node_id v) const {
+    for (uint32_t e = offsets[v]; e < offsets[v + 1]; ++e) {
+        if (std::isfinite(weights[e])) {
+            return true;
+        }
+    }
+    for (uint32_t e = rev_offsets[v]; e < rev_offsets[v + 1]; ++e) {
+        if (std::isfinite(weights[rev_edges[e]])) {
+            return true;
         }
     }
+    return false;
+}
+
+KDTree::Filter Graph::nodeFilter() const {
+    if (!restricted) {
+        return nullptr;
+    }
+    return [this](uint32_t id) {
+        return accessible(id);
+    };
+}
+
+Graph::node_id Graph::findNode(const Node &node) const {
+    const Coord &key = node.getCoord();
+    auto it = std::lower_bound(coord_order.begin(), coord_order.end(), key, [this](node_id id, const Coord &key) {
+        return coords[id] < key;
+    });
+    if (it == coord_order.end() || coords[*it] != key) {
+        return npos;
+    }
+    return *it;
+}
+
+const NamePoint &Graph::findName(const std::string &name) const {
+    auto it = std::lower_bound(names.begin(), names.end(), name, [this](const NamePoint &point, const std::string &key) {
+        return std::string_view(name_text.data() + point.offset, point.length) < key;
+    });
+    if (it == names.end() || std::string_view(name_text.data() + it->offset, it->length) != name) {
+        throw std::out_of_range("Unknown place: " + name);
+    }
+    return *it;
+}
 
-    // deserialize distance
-    size_t distCount;
-    in.read(reinterpret_cast<char*>(&distCount), sizeof(distCount));
-    for (size_t i = 0; i < distCount; ++i) {
-        Node src, dest;
-        double dist;
-        src.deserialize(in);
-        dest.deserialize(in);
-        in.read(reinterpret_cast<char*>(&dist), sizeof(dist));
-        distances[{src, dest}] = dist;
+double Graph::edgeWeight(node_id from, node_id to) const {
+    double weight = std::numeric_limits<double>::infinity();
+    for (uint32_t e = offsets[from]; e < offsets[from + 1]; ++e) {
+        if (targets[e] == to) {
+            weight = std::min(weight, weights[e]);
+        }
     }
+    return weight;
+}
 
-    // deserialize location_map
-    size_t locationCount;
-    in.read(reinterpret_cast<char*>(&locationCount), sizeof(locationCount));
-    for (size_t i = 0; i < locationCount; ++i) {
-        size_t nameLength;
-        in.read(reinterpret_cast<char*>(&nameLength), sizeof(nameLength));
+Graph::node_id Graph::edgeSource(uint32_t e) const {
+    return static_cast<node_id>(std::upper_bound(offsets.begin(), offsets.end(), e) - offsets.begin() - 1);
+}
 
-        std::string name(nameLength, '\0');
-        in.read(&name[0], nameLength);
+Graph::EdgeSnap Graph::projectOnEdge(const std::array<double, 2> &coord, uint32_t e) const {
+    node_id u = edgeSource(e), v = targets[e];
+    std::array<double, 2> a = {coords[u].getLng(), coords[u].getLat()}, b = {coords[v].getLng(), coords[v].getLat()};
+    // flat plane around the query, lng scaled by cos(lat); exact enough at road lengths
+    double kx = std::cos(coord[1] * M_PI / 180.0);
+    double ax = (a[0] - coord[0]) * kx, ay = a[1] - coord[1];
+    double dx = (b[0] - a[0]) * kx, dy = b[1] - a[1];
+    double len2 = dx * dx + dy * dy;
+    double t = len2 > 0 ? std::clamp(-(ax * dx + ay * dy) / len2, 0.0, 1.0) : 0.0;
+
+    EdgeSnap snap;
+    snap.from = u;
+    snap.to = v;
+    snap.fraction = t;
+    snap.point = {a[0] + t * (b[0] - a[0]), a[1] + t * (b[1] - a[1])};
+    snap.distance = calculate_distance(coord[0], coord[1], snap.point[0], snap.point[1]);
+    return snap;
+}
+
+std::vector<Node> Graph::toNodes(const std::vector<node_id> &ids) const {
+    vector<Node> path;
+    path.reserve(ids.size());
+    for (node_id id : ids) {
+        path.push_back(nodeAt(id));
+    }
+    return path;
+}
 
-        double lng, lat;
-        in.read(reinterpret_cast<char*>(&lng), sizeof(lng));
-        in.read(reinterpret_cast<char*>(&lat), sizeof(lat));
+void Graph::writeSnapshot(const std::string &filename) const {
+    writeSnapshot(filename, {this});
+}
 
-        location_map[name] = {lng, lat};
+void Graph::writeSnapshot(const std::string &filename, const std::vector<const Graph *> &profiles) {
+    if (profiles.empty()) {
+        throw std::runtime_error("No graph to write to " + filename + ".");
+    }
+    const Graph &base = *profiles.front();
+    for (const Graph *profile : profiles) {
+        if (profile->targets.data() != base.targets.data()) {
+            throw std::runtime_error("Profiles written to one snapshot must share their topology.");
+        }
     }
 
-    kdtree.deserialize(in);
+    SnapshotWriter writer;
+    writer.add(SectionId::coords, base.coords);
+    writer.add(SectionId::coord_order, base.coord_order);
+    writer.add(SectionId::offsets, base.offsets);
+    writer.add(SectionId::targets, base.targets);
+    writer.add(SectionId::rev_offsets, base.rev_offsets);
+    writer.add(SectionId::rev_targets, base.rev_targets);
+    writer.add(SectionId::rev_edges, base.rev_edges);
+    writer.add(SectionId::names, base.names);
+    writer.add(SectionId::name_text, base.name_text);
+    writer.add(SectionId::spatial_index, base.kdtree->flat());
+    writer.add(SectionId::segment_index, base.segment_index->flat());
+    base.name_index->addSections(writer);
+    if (base.cch) {
+        base.cch->addSections(writer);
+    }
+    for (uint32_t layer = 0; layer < profiles.size(); ++layer) {
+        const Graph &profile = *profiles[layer];
+        writer.add(SectionId::weights, profile.weights, layer);
+        profile.ch.addSections(writer, layer);
+        profile.landmarks->addSections(writer, layer);
+        profile.travel_times->addSections(writer, layer);
+        writer.add(SectionId::graph_meta, ArrayRef<GraphMeta>(&profile.meta, 1), layer);
+    }
+    writer.write(filename);
+}
+
+void Graph::mapSnapshot(const std::string &filename, uint32_t profile) {
+    mapSnapshot(MappedSnapshot::open(filename), profile);
+}
+
+void Graph::mapSnapshot(std::shared_ptr<const MappedSnapshot> mapped, uint32_t profile) {
+    coords = mapped->get<Coord>(SectionId::coords);
+    coord_order = mapped->get<node_id>(SectionId::coord_order);
+    offsets = mapped->get<uint32_t>(SectionId::offsets);
+    targets = mapped->get<node_id>(SectionId::targets);
+    weights = mapped->get<double>(SectionId::weights, profile);
+    rev_offsets = mapped->get<uint32_t>(SectionId::rev_offsets);
+    rev_targets = mapped->get<node_id>(SectionId::rev_targets);
+    rev_edges = mapped->get<uint32_t>(SectionId::rev_edges);
+    names = mapped->get<NamePoint>(SectionId::names);
+    name_text = mapped->get<char>(SectionId::name_text);
+    if (coord_order.size() != coords.size()) {
+        throw std::runtime_error("Snapshot has a node lookup index of the wrong size.");
+    }
+    for (node_id id : coord_order) {
+        if (id >= coords.size()) {
+            throw std::runtime_error("Snapshot has a node lookup index with a bad node id.");
+        }
+    }
+    if (offsets.size() != coords.size() + 1 || rev_offsets.size() != coords.size() + 1
+        || targets.size() != weights.size() || rev_targets.size() != targets.size() || rev_edges.size() != targets.size()) {
+        throw std::runtime_error("Snapshot has inconsistent adjacency sections.");
+    }
+    for (uint32_t e : rev_edges) {
+        if (e >= targets.size()) {
+            throw std::runtime_error("Snapshot has a reverse edge with a bad edge id.");
+        }
+    }
+    // every search trusts these, so a bad offset or node id must not get past here
+    auto checkAdjacency = [this](ArrayRef<uint32_t> edge_offsets, ArrayRef<node_id> edge_targets) {
+        if (edge_offsets[0] != 0 || edge_offsets[edge_offsets.size() - 1] != edge_targets.size()) {
+            throw std::runtime_error("Snapshot has edge offsets that do not cover the edges.");
+        }
+        for (size_t v = 0; v + 1 < edge_offsets.size(); ++v) {
+            if (edge_offsets[v] > edge_offsets[v + 1]) {
+                throw std::runtime_error("Snapshot has decreasing edge offsets.");
+            }
+        }
+        for (node_id v : edge_targets) {
+            if (v >= coords.size()) {
+                throw std::runtime_error("Snapshot has an edge with a bad node id.");
+            }
+        }
+    };
+    checkAdjacency(offsets, targets);
+    checkAdjacency(rev_offsets, rev_targets);
+
+    kdtree = std::make_shared<const KDTree>(KDTree::fromFlat(mapped->get<KDNode>(SectionId::spatial_index)));
+    if (kdtree->size() != coords.size()) {
+        throw std::runtime_error("Snapshot has a spatial index of the wrong size.");
+    }
+    segment_index = std::make_shared<const KDTree>(KDTree::fromFlat(mapped->get<KDNode>(SectionId::segment_index)));
+    for (const KDNode &sample : segment_index->flat()) {
+        if (sample.id >= targets.size()) {
+            throw std::runtime_error("Snapshot has a segment index with a bad edge id.");
+        }
+    }
+    ArrayRef<GraphMeta> mapped_meta = mapped->get<GraphMeta>(SectionId::graph_meta, profile);
+    if (mapped_meta.size() != 1) {
+        throw std::runtime_error("Snapshot has a bad meta section.");
+    }
+    meta = mapped_meta[0];
+    name_index = std::make_shared<const NameIndex>(NameIndex::fromSnapshot(*mapped));
+    ch = ContractionHierarchy::fromSnapshot(*mapped, profile);
+    if (!ch.empty() && ch.nodeCount() != coords.size()) {
+        throw std::runtime_error("Snapshot has a contraction hierarchy of the wrong size.");
+    }
+    customized = false;
+    metric_version = 0;
+    cch = std::make_shared<const CustomizableHierarchy>(CustomizableHierarchy::fromSnapshot(*mapped));
+    if (!cch->empty() && cch->nodeCount() != coords.size()) {
+        throw std::runtime_error("Snapshot has a customizable hierarchy of the wrong size.");
+    }
+    landmarks = std::make_shared<const Landmarks>(Landmarks::fromSnapshot(*mapped, profile));
+    if (!landmarks->empty() && landmarks->nodeCount() != coords.size()) {
+        throw std::runtime_error("Snapshot has landmark tables of the wrong size.");
+    }
+    travel_times = std::make_shared<const TravelTimes>(TravelTimes::fromSnapshot(*mapped, profile));
+    if (travel_times->edgeCount() != 0 && travel_times->edgeCount() != targets.size()) {
+        throw std::runtime_error("Snapshot has travel time patterns for the wrong number of edges.");
+    }
+    restricted = std::any_of(weights.begin(), weights.end(), [](double w) {
+        return !std::isfinite(w);
+    });
+
+    location_map.clear();
+    topology.reset();
+    owned_weights.clear();
+    snapshot = mapped;
+}
+
+void Graph::buildContractionHierarchy() {
+    ch = ContractionHierarchy::build(offsets, targets, weights);
+    customized = false;
+}
+
+void Graph::buildCustomizableHierarchy(const std::vector<Graph *> &profiles) {
+    if (profiles.empty()) {
+        return;
+    }
+    const Graph &base = *profiles.front();
+    for (const Graph *profile : profiles) {
+        if (profile->targets.data() != base.targets.data()) {
+            throw std::runtime_error("Profiles sharing a customizable hierarchy must share their topology.");
+        }
+    }
+    auto cch = std::make_shared<const CustomizableHierarchy>(CustomizableHierarchy::build(base.coords, base.offsets, base.targets));
+    for (Graph *profile : profiles) {
+        profile->cch = cch;
+    }
+}
+
+std::shared_ptr<Graph> Graph::withWeights(const std::vector<WeightChange> &changes, size_t *recomputed) const {
+    if (!hasCustomizableHierarchy()) {
+        throw std::runtime_error("Graph has no customizable hierarchy to update its weights with.");
+    }
+    vector<double> next(weights.begin(), weights.end());
+    vector<uint32_t> changed;
+    bool decreased = false;
+    for (const WeightChange &change : changes) {
+        node_id from = findNode(change.from), to = findNode(change.to);
+        if (from == npos || to == npos) {
+            throw std::runtime_error("No node at one end of a changed edge.");
+        }
+        if (!(change.weight >= 0)) {
+            throw std::runtime_error("Edge weights must not be negative.");
+        }
+        bool found = false;
+        for (uint32_t e = offsets[from]; e < offsets[from + 1]; ++e) {
+            if (targets[e] == to) {
+                decreased = decreased || change.weight < next[e];
+                next[e] = change.weight;
+                changed.push_back(e);
+                found = true;
+            }
+        }
+        if (!found) {
+            throw std::runtime_error("No edge between the given nodes.");
+        }
+    }
+
+    auto graph = std::make_shared<Graph>();
+    graph->freezeProfile(*this, std::move(next));
+    graph->ch = customized ? cch->customize(ch, offsets, targets, graph->weights, changed, recomputed)
+                           : cch->customize(offsets, targets, graph->weights);
+    if (!customized && recomputed) {
+        *recomputed += cch->arcCount();
+    }
+    graph->customized = true;
+    graph->metric_version = metric_version + 1;
+    if (!decreased) {
+        graph->landmarks = landmarks;
+    }
+    graph->travel_times = travel_times;
+    return graph;
+}
+
+void Graph::setTravelTimes(TravelTimes times) {
+    if (times.edgeCount() != 0 && times.edgeCount() != edgeCount()) {
+        throw std::runtime_error("Travel time patterns do not match the edges of the graph.");
+    }
+    travel_times = std::make_shared<const TravelTimes>(std::move(times));
+}
+
+void Graph::buildLandmarks(size_t count, LandmarkStrategy strategy) {
+    vector<double> rev_weights(rev_edges.size());
+    for (size_t e = 0; e < rev_edges.size(); ++e) {
+        rev_weights[e] = weights[rev_edges[e]];
+    }
+    landmarks = std::make_shared<const Landmarks>(
+        Landmarks::build(offsets, targets, weights, rev_offsets, rev_targets, rev_weights, count, strategy));
+}
+
+double Graph::lowerBound(node_id from, node_id to, const Landmarks::Active &active) const {
+    double straight = meta.heuristic_scale * meta.projection.distance(coords[from], coords[to]);
+    return std::max(straight, landmarks->lowerBound(from, to, active));
 }
 
 std::vector<string> Graph::fuzzySearch(const std::string &query, double threshold,  std::multimap<double, std::string>::size_type max_size) const
 {
+    // The first max_size names are always kept, later ones only when they reach the
+    // threshold. Every name that can reach it is a candidate, so scoring the first
+    // max_size names plus the candidates, in name order, gives the same result as
+    // scoring every name.
+    thread_local vector<uint32_t> candidates;
+    bool filtered = name_index->candidates(query, threshold, names, name_text, candidates);
+    size_t head = std::min<size_t>(max_size, names.size());
+
+    rapidfuzz::fuzz::CachedRatio<char> ratio(query);
+    rapidfuzz::fuzz::CachedPartialRatio<char> partial_ratio(query);
     std::multimap<double, string> res;
-    for (const auto &entry : location_map) {
-        double score = rapidfuzz::fuzz::ratio(query, entry.first);
-        if (query.size() <= entry.first.size()) {
-            double partial_score = rapidfuzz::fuzz::partial_ratio(query, entry.first);
+    auto consider = [&](size_t i, double cutoff) {
+        string name(nameAt(i));
+        double score = ratio.similarity(name, cutoff);
+        if (query.size() <= name.size()) {
+            double partial_score = partial_ratio.similarity(name, cutoff);
             score = std::max(score, partial_score);
         }
-        if (query == entry.first) {
+        if (query == name) {
             score = 200;
         }
         if (res.size() < max_size) {
-            res.insert({score, entry.first});
+            res.insert({score, name});
         } else if (score >= threshold && score > res.begin()->first) {
             res.erase(res.begin());
-            res.insert({score, entry.first});
+            res.insert({score, name});
         }
+    };
+
+    for (size_t i = 0; i < head; ++i) {
+        consider(i, 0);
     }
+    // past the head a score below the threshold is never kept, so the scorers may cut off there
+    if (filtered) {
+        for (uint32_t i : candidates) {
+            if (i >= head) {
+                consider(i, threshold);
+            }
+        }
+    } else {
+        for (size_t i = head; i < names.size(); ++i) {
+            consider(i, threshold);
+        }
+    }
+
     vector<string> result;
     for (auto itr = res.rbegin(); itr != res.rend(); ++itr) {
         result.push_back(itr->second);
@@ -162,184 +543,554 @@ std::vector<string> Graph::fuzzySearch(const std::string &query, double threshol
     return result;
 }
 
-std::vector<Node> constructPath(const map<Node, Node> &cameFromStart, Node &cur_start, const map<Node, Node> &cameFromGoal, Node &cur_goal) {
-    vector<Node> path;
-    while (cameFromStart.find(cur_start) != cameFromStart.end()) {
-        path.push_back(cur_start);
-        cur_start = cameFromStart.at(cur_start);
+std::vector<Node> Graph::BiAStar(const Node &start, const Node &dst) const
+{
+    node_id s = findNode(start), t = findNode(dst);
+    if (s == npos || t == npos) {
+        throw std::runtime_error("Start or dst node note found in graph.");
     }
-    path.push_back(cur_start);
-    std::reverse(path.begin(), path.end()); 
-    while (cameFromGoal.find(cur_goal) != cameFromGoal.end()) {
-        path.push_back(cur_goal);
-        cur_goal = cameFromGoal.at(cur_goal);
+    if (s == t) {
+        return {nodeAt(s)};
     }
-    path.push_back(cur_goal);
-    return path;
-}
 
-double potential_function_forward(const Node &cur, const Node &dst) {
-    return calculate_distance(cur, dst);
-}
+    const double inf = std::numeric_limits<double>::infinity();
 
-double potential_function_reverse(const Node &cur, const Node &start) {
-    return calculate_distance(cur, start);
-}
+    // Average potentials: p_f(v) = (pi_t(v) - pi_s(v)) / 2 and p_r(v) = -p_f(v), where
+    // pi_t bounds the distance to dst and pi_s the distance from start. Both searches
+    // then see the same reduced edge costs, so they may stop once the two queue tops
+    // together reach the best path found so far. The landmark tables are rounded, so
+    // p_f may be off a consistent potential by up to rounding() at every node and the
+    // two keys together by twice that; the stopping test leaves that margin.
+    Landmarks::Active active = landmarks->empty() ? Landmarks::Active() : landmarks->select(s, t);
+    const double margin = 2 * landmarks->rounding();
+    auto predict_forward = [&](node_id v) {
+        return 0.5 * (lowerBound(v, t, active) - lowerBound(s, v, active));
+    };
 
-double predict_forward(const Node &cur, const Node &start, const Node &dst, double dis_s_t) {
-    return 0.5 * (potential_function_forward(cur, dst) - potential_function_reverse(cur, start)) + 0.5 * dis_s_t;
-}
+    // best s-t path seen so far goes through the edge meet_from -> meet_to
+    double min_length = inf;
+    node_id meet_from = npos, meet_to = npos;
 
-double predict_reverse(const Node &cur, const Node &start, const Node &dst, double dis_s_t) {
-    return 0.5 * ( - potential_function_forward(cur, dst) + potential_function_reverse(cur, start)) + 0.5 * dis_s_t;
+    SearchContext &context = SearchContext::local(nodeCount());
+    SearchSpace &forward = context.forward;
+    SearchSpace &reverse = context.backward;
+
+    forward.update(s, 0, predict_forward(s), npos);
+    reverse.update(t, 0, -predict_forward(t), npos);
+    forward.push(forward.key(s), s);
+    reverse.push(reverse.key(t), t);
+
+    while (!forward.empty() && !reverse.empty()) {
+        auto top_f = forward.top();
+        forward.pop();
+
+        auto top_r = reverse.top();
+        reverse.pop();
+
+        if (top_f.first + top_r.first >= min_length + margin) {
+            break;
+        }
+
+        node_id u = top_f.second;
+        if (top_f.first <= forward.key(u)) {
+            forward.settle(u);
+            double dis_u = forward.dist(u);
+            for (uint32_t e = offsets[u]; e < offsets[u + 1]; ++e) {
+                node_id v = targets[e];
+                double t_dis = dis_u + weights[e];
+                if (t_dis < forward.dist(v)) {
+                    forward.update(v, t_dis, t_dis + predict_forward(v), u);
+                    forward.push(forward.key(v), v);
+                }
+                if (reverse.settled(v) && t_dis + reverse.dist(v) < min_length) {
+                    min_length = t_dis + reverse.dist(v);
+                    meet_from = u;
+                    meet_to = v;
+                }
+            }
+        }
+
+        u = top_r.second;
+        if (top_r.first <= reverse.key(u)) {
+            reverse.settle(u);
+            double dis_u = reverse.dist(u);
+            for (uint32_t e = rev_offsets[u]; e < rev_offsets[u + 1]; ++e) {
+                node_id v = rev_targets[e];
+                double t_dis = dis_u + weights[rev_edges[e]];
+                if (t_dis < reverse.dist(v)) {
+                    reverse.update(v, t_dis, t_dis - predict_forward(v), u);
+                    reverse.push(reverse.key(v), v);
+                }
+                if (forward.settled(v) && t_dis + forward.dist(v) < min_length) {
+                    min_length = t_dis + forward.dist(v);
+                    meet_from = v;
+                    meet_to = u;
+                }
+            }
+        }
+    }
+
+    if (meet_from == npos) {
+        return {};
+    }
+    vector<node_id> path = forward.walkParents(meet_from);
+    std::reverse(path.begin(), path.end());
+    vector<node_id> tail = reverse.walkParents(meet_to);
+    path.insert(path.end(), tail.begin(), tail.end());
+    return toNodes(path);
 }
 
-std::vector<Node> Graph::BiAStar(const Node &start, const Node &dst) const
+std::vector<Node> Graph::AStar(const Node &start, const Node &goal) const
 {
-    if (!containsNode(start) || !containsNode(dst)) {
-        throw std::runtime_error("Start or dst node note found in graph.");
+    node_id s = findNode(start), t = findNode(goal);
+    if (s == npos || t == npos) {
+        throw std::runtime_error("Start or goal node not found in graph.");
     }
 
-    double dis_s_t = calculate_distance(start, dst);
+    // labels and heap are reused from this thread's previous query
+    SearchSpace &openSet = SearchContext::local(nodeCount()).forward;
 
-    double min_length = std::numeric_limits<double>::infinity();
+    Landmarks::Active active = landmarks->empty() ? Landmarks::Active() : landmarks->select(s, t);
 
-    using QueueItem = std::pair<double, Node>;
-    std::priority_queue<QueueItem, std::vector<QueueItem>, std::greater<QueueItem>> forward;
-    std::priority_queue<QueueItem, std::vector<QueueItem>, std::greater<QueueItem>> reverse;
+    openSet.update(s, 0, lowerBound(s, t, active), npos);
+    openSet.push(openSet.key(s), s);
 
-    std::map<Node, Node> cameFromStart, cameFromDst;
-    std::map<Node, double> disStart, disDst;
-    std::map<Node, double> fStart, fDst;
+    while (!openSet.empty()) {
+        auto [f, current] = openSet.top();
+        openSet.pop();
 
-    std::set<Node> visited_forward, visited_reverse;
+        if (current == t) {
+            vector<node_id> path = openSet.walkParents(current);
+            std::reverse(path.begin(), path.end());
+            return toNodes(path);
+        }
+        if (f > openSet.key(current)) {
+            // stale entry, a shorter route to current was already expanded
+            continue;
+        }
+        openSet.settle(current);
 
-    for (const auto &node : adjList) {
-        disStart[node.first] = std::numeric_limits<double>::infinity();
-        fStart[node.first] = std::numeric_limits<double>::infinity();
+        double gScore = openSet.dist(current);
+        for (uint32_t e = offsets[current]; e < offsets[current + 1]; ++e) {
+            node_id neighbor = targets[e];
+            double tentative_gScore = gScore + weights[e];
+            if (tentative_gScore < openSet.dist(neighbor)) {
+                openSet.update(neighbor, tentative_gScore, tentative_gScore + lowerBound(neighbor, t, active), current);
+                openSet.push(openSet.key(neighbor), neighbor);
+            }
+        }
     }
 
-    for (const auto &node : rev_adjList) {
-        disDst[node.first] = std::numeric_limits<double>::infinity();
-        fDst[node.first] = std::numeric_limits<double>::infinity();
+    // Return an empty path if no path found
+    return {};
+}
+
+std::vector<Node> Graph::TDAStar(const Node &start, const Node &goal, double departure) const
+{
+    node_id s = findNode(start), t = findNode(goal);
+    if (s == npos || t == npos) {
+        throw std::runtime_error("Start or goal node not found in graph.");
     }
+    return toNodes(timeDependentSearch(s, t, departure, true));
+}
 
-    disStart[start] = 0;
-    fStart[start] = predict_forward(start, start, dst, dis_s_t);
+std::vector<Node> Graph::TDDijkstra(const Node &start, const Node &goal, double departure) const
+{
+    node_id s = findNode(start), t = findNode(goal);
+    if (s == npos || t == npos) {
+        throw std::runtime_error("Start or goal node not found in graph.");
+    }
+    return toNodes(timeDependentSearch(s, t, departure, false));
+}
 
-    disDst[dst] = 0;
-    fDst[dst] = predict_reverse(dst, start, dst, dis_s_t);
+std::vector<Graph::node_id> Graph::timeDependentSearch(node_id s, node_id t, double departure, bool use_heuristic) const
+{
+    if (!hasTravelTimes()) {
+        throw std::runtime_error("Graph has no travel times for time-dependent routing.");
+    }
+    const TravelTimes &times = *travel_times;
+    // no edge is ever faster than its weight at the smallest factor
+    double bound_scale = times.secondsPerUnit() * times.minFactor();
+    Landmarks::Active active = !use_heuristic || landmarks->empty() ? Landmarks::Active() : landmarks->select(s, t);
+    auto estimate = [&](node_id v) {
+        return use_heuristic ? bound_scale * lowerBound(v, t, active) : 0.0;
+    };
 
-    forward.push({fStart[start], start});
-    reverse.push({fDst[dst], dst});
+    SearchSpace &openSet = SearchContext::local(nodeCount()).forward;
+    openSet.update(s, 0, estimate(s), npos);
+    openSet.push(openSet.key(s), s);
 
-    while (!forward.empty() && !reverse.empty()) {
-        auto top_f = forward.top();
-        forward.pop();
+    while (!openSet.empty()) {
+        auto [f, current] = openSet.top();
+        openSet.pop();
 
-        auto top_r = reverse.top();
-        reverse.pop();
+        if (current == t) {
+            vector<node_id> path = openSet.walkParents(current);
+            std::reverse(path.begin(), path.end());
+            return path;
+        }
+        if (f > openSet.key(current)) {
+            continue;
+        }
+        openSet.settle(current);
 
-        bool isIntersect = ((top_f.second == top_r.second)
-         ||( visited_forward.count(top_r.second)
-         && visited_reverse.count(top_f.second)));
+        // FIFO travel times make the earliest arrival at current the only one worth expanding
+        double now = departure + openSet.dist(current);
+        for (uint32_t e = offsets[current]; e < offsets[current + 1]; ++e) {
+            node_id neighbor = targets[e];
+            double elapsed = times.arrival(e, weights[e], now) - departure;
+            if (elapsed < openSet.dist(neighbor)) {
+                openSet.update(neighbor, elapsed, elapsed + estimate(neighbor), current);
+                openSet.push(openSet.key(neighbor), neighbor);
+            }
+        }
+    }
+    return {};
+}
 
-        if (isIntersect && (top_f.first + top_r.first >= min_length + dis_s_t)) {
-            return constructPath(cameFromStart, top_f.second, cameFromDst, top_r.second);
+double Graph::travelTime(const std::vector<Node> &path, double departure) const {
+    if (path.empty() || !hasTravelTimes()) {
+        return std::numeric_limits<double>::infinity();
+    }
+    double now = departure;
+    for (size_t i = 0; i + 1 < path.size(); ++i) {
+        node_id from = findNode(path[i]), to = findNode(path[i + 1]);
+        if (from == npos || to == npos) {
+            return std::numeric_limits<double>::infinity();
+        }
+        double arrival = std::numeric_limits<double>::infinity();
+        for (uint32_t e = offsets[from]; e < offsets[from + 1]; ++e) {
+            if (targets[e] == to) {
+                arrival = std::min(arrival, travel_times->arrival(e, weights[e], now));
+            }
         }
+        now = arrival;
+    }
+    return now - departure;
+}
 
-        if (top_f.first <= fStart[top_f.second]) {
-            visited_forward.insert(top_f.second);
-            for (const Node &neighbor : getNeighbors(top_f.second)) {
-                double t = disStart[top_f.second] + distances.at({top_f.second, neighbor});
-                if (t < disStart[neighbor]) {
-                    cameFromStart[neighbor] = top_f.second;
-                    disStart[neighbor] = t;
-                    fStart[neighbor] = disStart[neighbor] + predict_forward(neighbor, start, dst, dis_s_t);
-                    forward.push({fStart[neighbor], neighbor});
-                }
-                if (visited_reverse.count(neighbor)) {
-                    min_length = std::min(min_length, disStart[top_f.second] + disDst[neighbor] + distances.at({top_f.second, neighbor}));
-                }
+std::vector<Node> Graph::Dijkstra(const Node &start, const Node &goal) const
+{
+    node_id s = findNode(start), t = findNode(goal);
+    if (s == npos || t == npos) {
+        throw std::runtime_error("Start or goal node not found in graph.");
+    }
+
+    SearchSpace &queue = SearchContext::local(nodeCount()).forward;
+    queue.update(s, 0, 0, npos);
+    queue.push(0, s);
+    while (!queue.empty()) {
+        auto [d, u] = queue.top();
+        queue.pop();
+        if (u == t) {
+            vector<node_id> path = queue.walkParents(u);
+            std::reverse(path.begin(), path.end());
+            return toNodes(path);
+        }
+        if (d > queue.dist(u)) {
+            continue;
+        }
+        queue.settle(u);
+        for (uint32_t e = offsets[u]; e < offsets[u + 1]; ++e) {
+            double nd = d + weights[e];
+            if (nd < queue.dist(targets[e])) {
+                queue.update(targets[e], nd, nd, u);
+                queue.push(nd, targets[e]);
             }
         }
+    }
+    return {};
+}
 
-        if (top_r.first <= fDst[top_r.second]) {
-            visited_reverse.insert(top_r.second);
-            for (const Node &neighbor : rev_getNeighbors(top_r.second)) {
-                double t = disDst[top_r.second] + distances.at({neighbor, top_r.second});
-                if (t < disDst[neighbor]) {
-                    cameFromDst[neighbor] = top_r.second;
-                    disDst[neighbor] = t;
-                    fDst[neighbor] = disDst[neighbor] + predict_reverse(neighbor, start, dst, dis_s_t);
-                    reverse.push({fDst[neighbor], neighbor});
-                }
-                if (visited_forward.count(neighbor)) {
-                    min_length = std::min(min_length, disDst[top_r.second] + disStart[neighbor] + distances.at({neighbor, top_r.second}));
+double Graph::pathLength(const std::vector<Node> &path) const
+{
+    const double inf = std::numeric_limits<double>::infinity();
+    if (path.empty()) {
+        return inf;
+    }
+    double length = 0;
+    for (size_t i = 0; i + 1 < path.size(); ++i) {
+        node_id u = findNode(path[i]), v = findNode(path[i + 1]);
+        if (u == npos || v == npos) {
+            return inf;
+        }
+        double best = inf;
+        for (uint32_t e = offsets[u]; e < offsets[u + 1]; ++e) {
+            if (targets[e] == v) {
+                best = std::min(best, weights[e]);
+            }
+        }
+        length += best;
+    }
+    return length;
+}
+
+std::vector<double> Graph::distanceMatrix(const std::vector<Node> &sources, const std::vector<Node> &destinations) const
+{
+    auto toIds = [this](const std::vector<Node> &nodes) {
+        vector<node_id> ids;
+        ids.reserve(nodes.size());
+        for (const Node &node : nodes) {
+            ids.push_back(findNode(node));
+            if (ids.back() == npos) {
+                throw std::runtime_error("Matrix node not found in graph.");
+            }
+        }
+        return ids;
+    };
+    vector<node_id> s = toIds(sources), t = toIds(destinations);
+    if (!ch.empty()) {
+        return ch.manyToMany(s, t);
+    }
+
+    const double inf = std::numeric_limits<double>::infinity();
+    vector<double> result(s.size() * t.size(), inf);
+    // target node -> columns asking for it
+    std::unordered_multimap<node_id, size_t> columns;
+    for (size_t j = 0; j < t.size(); ++j) {
+        columns.emplace(t[j], j);
+    }
+    for (size_t i = 0; i < s.size(); ++i) {
+        SearchSpace &queue = SearchContext::local(nodeCount()).forward;
+        queue.update(s[i], 0, 0, npos);
+        queue.push(0, s[i]);
+        size_t remaining = t.size();
+        while (!queue.empty() && remaining > 0) {
+            auto [d, u] = queue.top();
+            queue.pop();
+            if (d > queue.dist(u)) {
+                continue;
+            }
+            queue.settle(u);
+            auto range = columns.equal_range(u);
+            for (auto it = range.first; it != range.second; ++it) {
+                result[i * t.size() + it->second] = d;
+                --remaining;
+            }
+            for (uint32_t e = offsets[u]; e < offsets[u + 1]; ++e) {
+                double nd = d + weights[e];
+                if (nd < queue.dist(targets[e])) {
+                    queue.update(targets[e], nd, nd, u);
+                    queue.push(nd, targets[e]);
                 }
             }
         }
     }
-    return {};
+    return result;
 }
 
+Reachable Graph::reachable(const Node &start, double budget, size_t threads) const
+{
+    // above this many settled nodes the parallel search pays for its set-up
+    const size_t sequential_limit = 100000;
 
-std::vector<Node> reconstructPath(const std::map<Node, Node> &cameFrom, Node current)
+    node_id s = findNode(start);
+    if (s == npos) {
+        throw std::runtime_error("Start node not found in graph.");
+    }
+    Reachable result;
+    if (!bounded_dijkstra(offsets, targets, weights, s, budget, threads > 1 ? sequential_limit : nodeCount(), result)) {
+        delta_stepping(offsets, targets, weights, s, budget, 0, threads, result);
+    }
+    return result;
+}
+
+std::vector<Node> Graph::nearestNodes(const std::pair<double, double> &coord, size_t k) const
 {
-    std::vector<Node> path;
-    while (cameFrom.find(current) != cameFrom.end()) {
-        path.push_back(current);
-        current = cameFrom.at(current);
+    vector<Node> result;
+    for (const KDNode &point : kdtree->k_nearest(KDNode(Node(coord)), k, nodeFilter())) {
+        result.emplace_back(point.coord);
     }
-    path.push_back(current);
-    std::reverse(path.begin(), path.end());
-    return path;
+    return result;
 }
 
-std::vector<Node> Graph::AStar(const Node &start, const Node &goal) const
+std::vector<Node> Graph::nodesWithin(const std::pair<double, double> &coord, double radius) const
 {
-    if (!containsNode(start) || !containsNode(goal)) {
-        throw std::runtime_error("Start or goal node not found in graph.");
+    vector<Node> result;
+    for (const KDNode &point : kdtree->within_radius(KDNode(Node(coord)), radius, nodeFilter())) {
+        result.emplace_back(point.coord);
     }
+    return result;
+}
 
-    // Priority queue for A* search
-    using QueueItem = std::pair<double, Node>;
-    std::priority_queue<QueueItem, std::vector<QueueItem>, std::greater<>> openSet;
-    openSet.push({0, start});
+Graph::EdgeSnap Graph::snapToEdge(const std::pair<double, double> &coord) const
+{
+    // segments closed to this profile in both directions are skipped
+    KDTree::Filter usable;
+    if (restricted) {
+        usable = [this](uint32_t e) {
+            return std::isfinite(weights[e]) || std::isfinite(edgeWeight(targets[e], edgeSource(e)));
+        };
+    }
+    // on the fixed-point grid like every other lookup, so that it agrees with them
+    KDNode query{Node(coord)};
+    std::array<double, 2> point = {query.coord.getLng(), query.coord.getLat()};
+    vector<KDNode> nearest = segment_index->k_nearest(query, 1, usable);
+    if (nearest.empty()) {
+        throw std::runtime_error("Graph has no road segments to snap to.");
+    }
+    EdgeSnap best = projectOnEdge(point, nearest.front().id);
 
-    std::map<Node, Node> cameFrom;
-    std::map<Node, double> gScore;
-    std::map<Node, double> fScore;
+    // The closest segment has a sample within segment_spacing / 2 of its closest point,
+    // so that sample is at most best.distance + segment_spacing / 2 away; the extra
+    // meter covers the flat projection.
+    vector<uint32_t> edges;
+    for (const KDNode &sample : segment_index->within_radius(query, best.distance + segment_spacing / 2 + 1, usable)) {
+        edges.push_back(sample.id);
+    }
+    std::sort(edges.begin(), edges.end());
+    edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+    for (uint32_t e : edges) {
+        EdgeSnap snap = projectOnEdge(point, e);
+        if (snap.distance < best.distance) {
+            best = snap;
+        }
+    }
+    return best;
+}
 
-    for (const auto &node : adjList) {
-        gScore[node.first] = std::numeric_limits<double>::infinity();
-        fScore[node.first] = std::numeric_limits<double>::infinity();
+std::vector<Graph::node_id> Graph::seededAStar(const std::vector<ContractionHierarchy::Seed> &sources,
+                                               const std::vector<ContractionHierarchy::Seed> &goals) const
+{
+    const double inf = std::numeric_limits<double>::infinity();
+    if (sources.empty() || goals.empty()) {
+        return {};
     }
+    SearchSpace &openSet = SearchContext::local(nodeCount()).forward;
+    Landmarks::Active active = landmarks->empty() ? Landmarks::Active() : landmarks->select(sources[0].node, goals[0].node);
 
-    gScore[start] = 0;
-    fScore[start] = calculate_distance(start, goal);
+    // lower bound on the cost left to the end point, through whichever goal seed
+    auto estimate = [&](node_id v) {
+        double h = inf;
+        for (const auto &goal : goals) {
+            h = std::min(h, lowerBound(v, goal.node, active) + goal.dist);
+        }
+        return h;
+    };
+
+    for (const auto &source : sources) {
+        if (source.dist < openSet.dist(source.node)) {
+            openSet.update(source.node, source.dist, source.dist + estimate(source.node), npos);
+            openSet.push(openSet.key(source.node), source.node);
+        }
+    }
 
+    // the end point is virtual, so a goal seed is only a candidate until nothing
+    // left in the queue can beat it
+    double best = inf;
+    node_id best_goal = npos;
     while (!openSet.empty()) {
-        Node current = openSet.top().second;
+        auto [f, current] = openSet.top();
+        if (f >= best) {
+            break;
+        }
         openSet.pop();
-
-        if (current == goal) {
-            return reconstructPath(cameFrom, current);
+        if (f > openSet.key(current)) {
+            continue;
         }
+        openSet.settle(current);
 
-        for (const Node &neighbor : getNeighbors(current)) {
-            double tentative_gScore = gScore[current] + distances.at({current, neighbor});
-            if (tentative_gScore < gScore[neighbor]) {
-                cameFrom[neighbor] = current;
-                gScore[neighbor] = tentative_gScore;
-                fScore[neighbor] = gScore[neighbor] + calculate_distance(neighbor, goal);
-                openSet.push({fScore[neighbor], neighbor});
+        double gScore = openSet.dist(current);
+        for (const auto &goal : goals) {
+            if (goal.node == current && gScore + goal.dist < best) {
+                best = gScore + goal.dist;
+                best_goal = current;
+            }
+        }
+        for (uint32_t e = offsets[current]; e < offsets[current + 1]; ++e) {
+            node_id neighbor = targets[e];
+            double tentative_gScore = gScore + weights[e];
+            if (tentative_gScore < openSet.dist(neighbor)) {
+                openSet.update(neighbor, tentative_gScore, tentative_gScore + estimate(neighbor), current);
+                openSet.push(openSet.key(neighbor), neighbor);
             }
         }
     }
 
-    // Return an empty path if no path found
-    return {};
+    if (best_goal == npos) {
+        return {};
+    }
+    vector<node_id> path = openSet.walkParents(best_goal);
+    std::reverse(path.begin(), path.end());
+    return path;
 }
 
+std::vector<Node> Graph::routeSnapped(const EdgeSnap &start, const EdgeSnap &goal, bool use_ch) const
+{
+    using Seed = ContractionHierarchy::Seed;
+    const double inf = std::numeric_limits<double>::infinity();
+    double start_forward = edgeWeight(start.from, start.to), start_backward = edgeWeight(start.to, start.from);
+    double goal_forward = edgeWeight(goal.from, goal.to), goal_backward = edgeWeight(goal.to, goal.from);
+
+    vector<Seed> sources, goals;
+    if (start_forward < inf) {
+        sources.push_back({start.to, (1 - start.fraction) * start_forward});
+    }
+    if (start_backward < inf) {
+        sources.push_back({start.from, start.fraction * start_backward});
+    }
+    if (goal_forward < inf) {
+        goals.push_back({goal.from, goal.fraction * goal_forward});
+    }
+    if (goal_backward < inf) {
+        goals.push_back({goal.to, (1 - goal.fraction) * goal_backward});
+    }
+
+    // both points on one segment: driving straight along it may beat any detour
+    double direct = inf;
+    if ((start.from == goal.from && start.to == goal.to) || (start.from == goal.to && start.to == goal.from)) {
+        double goal_fraction = start.from == goal.from ? goal.fraction : 1 - goal.fraction;
+        // checked before multiplying: 0 * inf would be NaN for a closed direction
+        if (goal_fraction == start.fraction) {
+            direct = 0;
+        } else if (goal_fraction > start.fraction) {
+            direct = start_forward < inf ? (goal_fraction - start.fraction) * start_forward : inf;
+        } else {
+            direct = start_backward < inf ? (start.fraction - goal_fraction) * start_backward : inf;
+        }
+    }
+
+    vector<node_id> ids = use_ch && !ch.empty() ? ch.query(sources, goals) : seededAStar(sources, goals);
+    double via = inf;
+    if (!ids.empty()) {
+        auto seedCost = [](const vector<Seed> &seeds, node_id v) {
+            double cost = std::numeric_limits<double>::infinity();
+            for (const Seed &seed : seeds) {
+                if (seed.node == v) {
+                    cost = std::min(cost, seed.dist);
+                }
+            }
+            return cost;
+        };
+        via = seedCost(sources, ids.front()) + seedCost(goals, ids.back());
+        for (size_t i = 0; i + 1 < ids.size(); ++i) {
+            via += edgeWeight(ids[i], ids[i + 1]);
+        }
+    }
+    if (direct == inf && via == inf) {
+        return {};
+    }
 
+    vector<Node> path = {Node(start.point[0], start.point[1])};
+    if (via < direct) {
+        for (node_id id : ids) {
+            path.push_back(nodeAt(id));
+        }
+    }
+    path.emplace_back(goal.point[0], goal.point[1]);
+    // a point snapped onto an edge end coincides with that node
+    path.erase(std::unique(path.begin(), path.end()), path.end());
+    return path;
+}
+
+std::vector<Node> Graph::CHQuery(const Node &start, const Node &goal) const
+{
+    if (ch.empty()) {
+        throw std::runtime_error("Contraction hierarchy has not been built for this graph.");
+    }
+    node_id s = findNode(start), t = findNode(goal);
+    if (s == npos || t == npos) {
+        throw std::runtime_error("Start or goal node not found in graph.");
+    }
+    return toNodes(ch.query(s, t));
+}
@@ -3,94 +3,332 @@
 #include <iostream>
 #include <fstream>
 #include <map>
+#include <memory>
 #include <set>
 #include <stdexcept>
 #include <cmath>
+#include <cstdint>
+#include <limits>
+#include <string_view>
 #include <vector>
 #include "Node.h"
 #include "KDTree.h"
+#include "ArrayRef.h"
+#include "Snapshot.h"
+#include "Distance.h"
+#include "ContractionHierarchy.h"
+#include "CustomizableHierarchy.h"
+#include "Landmarks.h"
+#include "TravelTimes.h"
+#include "NameIndex.h"
+#include "SearchContext.h"
+#include "Isochrone.h"
 #include <array>
 
+// Scalars describing the whole graph, stored as a one-element snapshot section
+struct GraphMeta {
+    // smallest edge weight per meter of projected distance; scaling the projected
+    // distance by it gives a consistent, hence admissible, A* heuristic
+    double heuristic_scale;
+    // equirectangular projection around the middle latitude of the graph
+    PlaneProjection projection;
+};
+
 class Graph {
 public:
-    void addNode(const Node& node) {
-        rev_adjList[node];
-        adjList[node];  
+    using node_id = uint32_t;
+    static constexpr node_id npos = std::numeric_limits<node_id>::max();
+
+    // A query point projected onto the closest road segment from - to.
+    struct EdgeSnap {
+        node_id from, to;
+        // position along the segment, 0 at from and 1 at to
+        double fraction;
+        // {lng, lat} of the projected point
+        std::array<double, 2> point;
+        // meters between the query and the projected point
+        double distance;
+    };
+
+    // A new weight for the edge from -> to; infinity closes it.
+    struct WeightChange {
+        Node from, to;
+        double weight;
+    };
+
+    Graph() = default;
+    // views point into this object's own buffers
+    Graph(const Graph &) = delete;
+    Graph &operator=(const Graph &) = delete;
+
+    // Build phase: the loaders stage names here, GraphBuilder hands over the edges in freeze()
+    void addNamePoint(const std::string &name, const std::pair<double, double> &coord) {
+        location_map[name] = coord;
     }
 
-    void addNode2KDTree(const KDNode &node) {
-        kdtree.insert(node);
+    inline bool location_mapContains(const std::string &name) {
+        return location_map.count(name);
     }
 
-    void addDirectedEdge(const Node& src, const Node& dest, double dist) {
-        rev_adjList[dest].insert(src);
-        adjList[src].insert(dest);
-        distances.insert({{src, dest}, dist});
+    // Take over a forward CSR (coords unique, in any order, targets are indices into
+    // coords), derive the reverse CSR and the (lng, lat) lookup order, index the
+    // nodes in the kd-tree and drop the staged names. Edges of infinite weight are
+    // closed to this profile.
+    void freeze(std::vector<Coord> coords, std::vector<uint32_t> offsets,
+                std::vector<node_id> targets, std::vector<double> weights);
+
+    // Another routing profile over base's topology, names and spatial indexes, which
+    // are shared rather than copied: weights has one entry per edge of base, infinity
+    // where this profile may not go. Snapping only lands on nodes and segments the
+    // profile can use.
+    void freezeProfile(const Graph &base, std::vector<double> weights);
+
+    // Time-of-day travel times of this profile, one pattern per edge; see TravelTimes.
+    // Throws std::runtime_error if they cover a different number of edges.
+    void setTravelTimes(TravelTimes times);
+
+    inline bool hasTravelTimes() const {
+        return !travel_times->empty();
     }
 
-    const std::set<Node>& getNeighbors(const Node& node) const {
-        auto it = adjList.find(node);
-        if (it == adjList.end()) {
-            throw std::runtime_error("Node not found in adjList.");
-        }
-        return it->second;
+    // Frozen graph: dense ids in the order freeze() got them, forward and reverse CSR
+    inline size_t nodeCount() const {
+        return coords.size();
     }
 
-    const std::set<Node>& rev_getNeighbors(const Node& node) const {
-        auto it = rev_adjList.find(node);
-        if (it == rev_adjList.end()) {
-            throw std::runtime_error("Node not found in rev_adjList.");
-        }
-        return it->second;
+    inline size_t edgeCount() const {
+        return targets.size();
+    }
+
+    node_id findNode(const Node &node) const;
+
+    inline Node nodeAt(node_id id) const {
+        return Node(coords[id]);
     }
 
     bool containsNode(const Node& node) const {
-        return adjList.count(node);
+        return findNode(node) != npos;
     }
 
-    void serialize(std::ofstream &out) const;    
+    // v has an edge in or out that this profile may use; snapping only lands on those.
+    bool accessible(node_id v) const;
 
-    void deserialize(std::ifstream &in);
+    inline size_t nameCount() const {
+        return names.size();
+    }
 
-    std::pair<double, double> queryByName(const std::string &name) const {
-        auto &[lng, lat] = location_map.at(name); 
-        std::array<double, 2> data = {lng, lat};
-        auto res_kd_node = kdtree.nearest_neighbor(KDNode(data));
-        double llng = res_kd_node.data[0], llat = res_kd_node.data[1];
-        return std::make_pair(llng, llat);
+    inline std::string_view nameAt(size_t i) const {
+        return std::string_view(name_text.data() + names[i].offset, names[i].length);
     }
 
-    std::pair<double, double> queryByArbitrary(const std::pair<double, double> &coord) const {
-        std::array<double, 2> data = {coord.first, coord.second};
-        auto res_kd_node = kdtree.nearest_neighbor(KDNode(data));
-        double llng = res_kd_node.data[0], llat = res_kd_node.data[1];
-        return std::make_pair(llng, llat);
+    // Offline preprocessing for CHQuery; stored in the snapshot alongside the graph.
+    void buildContractionHierarchy();
+
+    inline bool hasContractionHierarchy() const {
+        return !ch.empty();
     }
 
-    void addNamePoint(const std::string &name, const std::pair<double, double> &coord) {
-        location_map[name] = coord;
+    // Offline, metric-independent preprocessing for withWeights, shared by profiles
+    // over one topology (see freezeProfile) and stored in the snapshot once.
+    static void buildCustomizableHierarchy(const std::vector<Graph *> &profiles);
+
+    inline bool hasCustomizableHierarchy() const {
+        return cch && !cch->empty();
     }
 
-    std::vector<std::string> fuzzySearch(const std::string &query, double threshold,  std::multimap<double, std::string>::size_type max_size) const;
+    // This profile with some edge weights replaced, sharing everything else. Its
+    // contraction hierarchy is customized from the customizable one: in full the
+    // first time, then only where the changes reach. The landmarks are kept while
+    // no weight goes down, which keeps their bounds admissible. Adds the number of
+    // recomputed hierarchy arcs to *recomputed. Throws std::runtime_error without a
+    // customizable hierarchy or for an edge the graph does not have.
+    std::shared_ptr<Graph> withWeights(const std::vector<WeightChange> &changes, size_t *recomputed = nullptr) const;
 
-    inline bool location_mapContains(const std::string &name) {
-        return location_map.count(name);
+    // Counts the withWeights steps from the graph that was built or mapped.
+    inline uint32_t metricVersion() const {
+        return metric_version;
+    }
+
+    // Offline preprocessing of the ALT tables used by AStar and BiAStar.
+    void buildLandmarks(size_t count, LandmarkStrategy strategy);
+
+    // Write the frozen graph as a page-aligned snapshot (see Snapshot.h), as profile 0.
+    void writeSnapshot(const std::string &filename) const;
+
+    // Write profiles that share one topology (see freezeProfile) into one snapshot,
+    // profiles[i] as profile i; the topology is stored once.
+    static void writeSnapshot(const std::string &filename, const std::vector<const Graph *> &profiles);
+
+    // Map a snapshot and use one of its profiles in place; throws std::runtime_error
+    // if it is unusable or has no such profile.
+    void mapSnapshot(const std::string &filename, uint32_t profile = 0);
+
+    // Same over an already mapped file, so that every profile shares one mapping.
+    void mapSnapshot(std::shared_ptr<const MappedSnapshot> mapped, uint32_t profile);
+
+    std::pair<double, double> queryByName(const std::string &name) const {
+        const NamePoint &point = findName(name);
+        auto res_kd_node = kdtree->nearest_neighbor(KDNode(Node(point.lng, point.lat)), nodeFilter());
+        return std::make_pair(res_kd_node.coord.getLng(), res_kd_node.coord.getLat());
     }
 
+    std::pair<double, double> queryByArbitrary(const std::pair<double, double> &coord) const {
+        auto res_kd_node = kdtree->nearest_neighbor(KDNode(Node(coord)), nodeFilter());
+        return std::make_pair(res_kd_node.coord.getLng(), res_kd_node.coord.getLat());
+    }
+
+    // The k graph nodes closest to coord, nearest first.
+    std::vector<Node> nearestNodes(const std::pair<double, double> &coord, size_t k) const;
+
+    // Every graph node within radius meters of coord.
+    std::vector<Node> nodesWithin(const std::pair<double, double> &coord, double radius) const;
+
+    // Projection of coord onto the closest road segment; throws if the graph has no edges.
+    EdgeSnap snapToEdge(const std::pair<double, double> &coord) const;
+
+    // Shortest route between two snapped points, from one projected point to the other.
+    // Both are virtual nodes on their edges: the search starts at the edge ends the
+    // start point can drive to, paying the part of the edge left, and finishes at the
+    // ends that lead into the goal point. Uses the contraction hierarchy if use_ch,
+    // A* otherwise; empty if there is no route.
+    std::vector<Node> routeSnapped(const EdgeSnap &start, const EdgeSnap &goal, bool use_ch) const;
+
+    std::vector<std::string> fuzzySearch(const std::string &query, double threshold,  std::multimap<double, std::string>::size_type max_size) const;
+
     std::vector<Node> AStar(const Node &start, const Node &goal) const;
 
     std::vector<Node> BiAStar(const Node &start, const Node &dst) const;
 
-private:
-    std::map<Node, std::set<Node>> adjList;  
+    std::vector<Node> CHQuery(const Node &start, const Node &goal) const;
+
+    // Plain Dijkstra, the reference the faster engines are checked against.
+    std::vector<Node> Dijkstra(const Node &start, const Node &goal) const;
+
+    // Earliest arrival leaving start at departure (seconds since midnight, repeating
+    // daily) under this profile's travel times. A* with the static bound scaled to
+    // the fastest factor, which keeps it consistent. Throws std::runtime_error if the
+    // profile has no travel times.
+    std::vector<Node> TDAStar(const Node &start, const Node &goal, double departure) const;
+
+    // Same search without the heuristic, the reference TDAStar is checked against.
+    std::vector<Node> TDDijkstra(const Node &start, const Node &goal, double departure) const;
+
+    // Seconds along path when leaving at departure; infinity if it is empty or not a path.
+    double travelTime(const std::vector<Node> &path, double departure) const;
 
-    std::map<Node, std::set<Node>> rev_adjList;
+    // Sum of the edge weights along path; infinity if it is empty or not a path.
+    double pathLength(const std::vector<Node> &path) const;
 
-    // weighted distance
-    std::map<std::pair<Node, Node>, double> distances;
+    // Shortest path costs from every source to every target, row-major, infinity
+    // where unreachable. Uses the contraction hierarchy when it has been built,
+    // otherwise one Dijkstra per source.
+    std::vector<double> distanceMatrix(const std::vector<Node> &sources, const std::vector<Node> &targets) const;
 
-    // name to lng & lat
+    // Every node within budget of start. Starts as a bounded Dijkstra and reruns
+    // as delta-stepping on `threads` threads if that settles too many nodes.
+    Reachable reachable(const Node &start, double budget, size_t threads) const;
+
+private:
+    // name to lng & lat, build-time staging, empty once frozen
     std::map<std::string, std::pair<double, double>> location_map;
 
-    KDTree kdtree;
-};
\ No newline at end of file
+    // Frozen arrays. The topology views either `topology` (right after a build) or
+    // `snapshot`, and is shared by every profile built or mapped with it; the
+    // weights view `owned_weights` or `snapshot`.
+
+    // node id -> fixed-point {lng, lat}
+    ArrayRef<Coord> coords;
+    // node ids sorted by {lng, lat}, for findNode's binary search
+    ArrayRef<node_id> coord_order;
+
+    // edges of node u are [offsets[u], offsets[u + 1]) in targets / weights
+    ArrayRef<uint32_t> offsets;
+    ArrayRef<node_id> targets;
+    // weighted distance of this profile, infinity where it may not go
+    ArrayRef<double> weights;
+
+    // incoming edges, same layout as above; rev_edges holds the forward edge of
+    // each, whose weight is weights[rev_edges[e]]
+    ArrayRef<uint32_t> rev_offsets;
+    ArrayRef<node_id> rev_targets;
+    ArrayRef<uint32_t> rev_edges;
+
+    // sorted by name
+    ArrayRef<NamePoint> names;
+    ArrayRef<char> name_text;
+    // bigram postings over names, narrows down fuzzySearch
+    std::shared_ptr<const NameIndex> name_index;
+
+    struct Topology {
+        std::vector<Coord> coords;
+        std::vector<node_id> coord_order;
+        std::vector<uint32_t> offsets;
+        std::vector<node_id> targets;
+        std::vector<uint32_t> rev_offsets;
+        std::vector<node_id> rev_targets;
+        std::vector<uint32_t> rev_edges;
+        std::vector<NamePoint> names;
+        std::vector<char> name_text;
+    };
+
+    std::shared_ptr<const Topology> topology;
+    std::vector<double> owned_weights;
+
+    std::shared_ptr<const MappedSnapshot> snapshot;
+
+    std::shared_ptr<const KDTree> kdtree;
+
+    // points at most segment_spacing meters apart along every road segment, each
+    // tagged with the id of one of the segment's edges
+    std::shared_ptr<const KDTree> segment_index;
+
+    // some edge is closed to this profile, so not every node or segment is usable
+    bool restricted = false;
+
+    ContractionHierarchy ch;
+
+    // shared by every profile and metric over the topology
+    std::shared_ptr<const CustomizableHierarchy> cch;
+    // ch is a customization of cch rather than built or mapped
+    bool customized = false;
+    uint32_t metric_version = 0;
+
+    // shared with withWeights results as long as they stay admissible
+    std::shared_ptr<const Landmarks> landmarks = std::make_shared<const Landmarks>();
+
+    // per profile, shared with withWeights results
+    std::shared_ptr<const TravelTimes> travel_times = std::make_shared<const TravelTimes>();
+
+    GraphMeta meta = {1, {}};
+
+    const NamePoint &findName(const std::string &name) const;
+
+    // Installs this profile's weights and derives what depends on them.
+    void setWeights(std::vector<double> weights);
+
+    // Accepts the nodes this profile can use; empty when it can use them all.
+    KDTree::Filter nodeFilter() const;
+
+    std::vector<Node> toNodes(const std::vector<node_id> &ids) const;
+
+    // Lightest edge from -> to, infinity if there is none.
+    double edgeWeight(node_id from, node_id to) const;
+
+    // Source node of forward edge e.
+    node_id edgeSource(uint32_t e) const;
+
+    // Projects coord onto the segment of edge e.
+    EdgeSnap projectOnEdge(const std::array<double, 2> &coord, uint32_t e) const;
+
+    // A* from several start seeds to several goal seeds, costs included; the path
+    // runs from the chosen start seed to the chosen goal seed.
+    std::vector<node_id> seededAStar(const std::vector<ContractionHierarchy::Seed> &sources,
+                                     const std::vector<ContractionHierarchy::Seed> &goals) const;
+
+    // Shared by TDAStar and TDDijkstra; labels are seconds since departure.
+    std::vector<node_id> timeDependentSearch(node_id s, node_id t, double departure, bool use_heuristic) const;
+
+    // Consistent estimate of d(from, to): the larger of the scaled projected
+    // distance and the landmark bound.
+    double lowerBound(node_id from, node_id to, const Landmarks::Active &active) const;
+};
@@ -0,0 +1,399 @@
+#include "GraphBuilder.h"
+#include "GeoJSONReader.h"
+#include "Parallel.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+
+using std::string;
+using std::vector;
+
+namespace {
+
+using node_id = Graph::node_id;
+
+// features handed to the workers at a time
+const size_t batch_size = 4096;
+
+constexpr double hours(double h) {
+    return h * 3600;
+}
+
+// Free-flow seconds per weight unit. A car weight of one per meter is a trunk road
+// (see priority) at 50 km/h; pedestrians walk 5 km/h.
+const double car_seconds_per_unit = 3.6 / 50;
+const double pedestrian_seconds_per_unit = 3.6 / 5;
+
+// Weekday congestion in Shanghai as factors on the free-flow time, by road class;
+// pattern 0 is free flow all day.
+const vector<TravelTimes::Breakpoints> car_patterns = {
+    {{0, 1.0}},
+    // motorways and trunk roads: the elevated expressways jam hardest at the peaks
+    {{hours(0), 1.0}, {hours(6), 1.0}, {hours(7), 1.4}, {hours(8), 2.0}, {hours(9.5), 1.6}, {hours(10.5), 1.2},
+     {hours(16), 1.3}, {hours(17.5), 2.1}, {hours(19), 1.6}, {hours(20.5), 1.15}, {hours(23), 1.0}},
+    // primary to tertiary: busy through the day, with signals smoothing the peaks
+    {{hours(0), 1.0}, {hours(6.5), 1.05}, {hours(7.5), 1.5}, {hours(8.5), 1.7}, {hours(10), 1.3}, {hours(12), 1.35},
+     {hours(14), 1.3}, {hours(17), 1.6}, {hours(18), 1.8}, {hours(19.5), 1.4}, {hours(22), 1.1}},
+    // minor roads
+    {{hours(0), 1.0}, {hours(7), 1.1}, {hours(8), 1.3}, {hours(9.5), 1.15}, {hours(17), 1.2}, {hours(18), 1.35},
+     {hours(20), 1.1}, {hours(22), 1.0}},
+};
+const vector<TravelTimes::Breakpoints> pedestrian_patterns = {{{0, 1.0}}};
+
+const vector<TravelTimes::Breakpoints> &patterns_of(Profile profile) {
+    return profile == Profile::car ? car_patterns : pedestrian_patterns;
+}
+
+// Index into patterns_of(profile) for a road of the given class.
+uint8_t pattern_of(Profile profile, priority road) {
+    if (profile != Profile::car) {
+        return 0;
+    }
+    switch (road) {
+    case motorway:
+    case trunk:
+        return 1;
+    case primary:
+    case secondary:
+    case tertiary:
+        return 2;
+    case unclassified:
+    case residential:
+    case service:
+        return 3;
+    default:
+        return 0;
+    }
+}
+
+// bits per axis of the grid the Hilbert curve runs through
+const uint32_t hilbert_bits = 16;
+
+// Distance of cell (x, y) along the Hilbert curve through the 2^hilbert_bits grid.
+uint64_t hilbert_index(uint32_t x, uint32_t y) {
+    const uint32_t side = 1u << hilbert_bits;
+    uint64_t d = 0;
+    for (uint32_t s = side / 2; s > 0; s /= 2) {
+        uint32_t rx = (x & s) > 0, ry = (y & s) > 0;
+        d += uint64_t(s) * s * ((3 * rx) ^ ry);
+        // rotate the quadrant so that the curve inside it starts at its origin
+        if (ry == 0) {
+            if (rx == 1) {
+                x = side - 1 - x;
+                y = side - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+/**
+ * New id of every point, numbered along a Hilbert curve over their bounding box.
+ * Points close on the map get close ids, so the CSR rows and labels a search
+ * touches lie mostly next to each other in memory.
+ */
+vector<node_id> hilbert_ids(const vector<Coord> &coords, size_t threads) {
+    size_t n = coords.size();
+    vector<node_id> ids(n);
+    if (n == 0) {
+        return ids;
+    }
+    int64_t min_lng = coords.front().lng, max_lng = coords.back().lng;
+    int64_t min_lat = coords.front().lat, max_lat = min_lat;
+    for (const Coord &point : coords) {
+        min_lat = std::min<int64_t>(min_lat, point.lat);
+        max_lat = std::max<int64_t>(max_lat, point.lat);
+    }
+    const double cells = (1u << hilbert_bits) - 1;
+    double scale_lng = max_lng > min_lng ? cells / (max_lng - min_lng) : 0;
+    double scale_lat = max_lat > min_lat ? cells / (max_lat - min_lat) : 0;
+
+    // (curve position, index); ties keep the (lng, lat) order
+    vector<std::pair<uint64_t, node_id>> keys(n);
+    parallel_for(n, threads, [&](size_t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            auto x = static_cast<uint32_t>((coords[i].lng - min_lng) * scale_lng);
+            auto y = static_cast<uint32_t>((coords[i].lat - min_lat) * scale_lat);
+            keys[i] = {hilbert_index(x, y), static_cast<node_id>(i)};
+        }
+    });
+    parallel_sort(keys.begin(), keys.end(), std::less<std::pair<uint64_t, node_id>>(), threads);
+    for (size_t rank = 0; rank < n; ++rank) {
+        ids[keys[rank].second] = static_cast<node_id>(rank);
+    }
+    return ids;
+}
+
+priority getPriorityFromString(const string &str) {
+    if (str == "motorway_junction") {
+        return motorway;
+    } else if (str == "trunk") {
+        return trunk;
+    } else if (str == "primary") {
+        return primary;
+    } else if (str == "secondary") {
+        return secondary;
+    } else if (str == "tertiary") {
+        return tertiary;
+    } else if (str == "unclassified") {
+        return unclassified;
+    } else if (str == "residential") {
+        return residential;
+    } else if (str == "service") {
+        return service;
+    } else if (str == "track") {
+        return track;
+    } else if (str == "path") {
+        return path;
+    } else if (str == "footway") {
+        return footway;
+    } else if (str == "cycleway") {
+        return cycleway;
+    } else {
+        return unknown;
+    }
+}
+
+inline bool isOneWay(const Json::Value &feature) {
+    if (!feature["properties"]["oneway"].isNull() && feature["properties"]["oneway"].asString() == "yes") {
+        return true;
+    }
+    return false;
+}
+
+inline bool isSideWalk(const Json::Value &feature) {
+    if (!feature["properties"]["sidewalk"].isNull() && feature["properties"]["sidewalk"].asString() == "no") {
+        return false;
+    }
+    return true;
+}
+
+// Concatenates per-thread buffers, copying each one on its own thread.
+template <class T>
+vector<T> concat(const vector<vector<T>> &parts, size_t threads) {
+    vector<size_t> start = {0};
+    for (const auto &part : parts) {
+        start.push_back(start.back() + part.size());
+    }
+    vector<T> result(start.back());
+    parallel_for(parts.size(), threads, [&](size_t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            std::copy(parts[i].begin(), parts[i].end(), result.begin() + start[i]);
+        }
+    });
+    return result;
+}
+
+}
+
+GraphBuilder::GraphBuilder(size_t threads) : threads(threads ? threads : build_threads()) {}
+
+void GraphBuilder::addSegments(const Json::Value &feature, uint64_t index, vector<Segment> &out)
+{
+    if (feature["geometry"]["type"].asString() != "LineString" || feature["properties"]["highway"].isNull()) {
+        return;
+    }
+    const auto &coordinates = feature["geometry"]["coordinates"];
+    priority road = getPriorityFromString(feature["properties"]["highway"].asString());
+    bool one_way = isOneWay(feature);
+    bool sidewalk = isSideWalk(feature);
+    for (Json::ArrayIndex i = 0; i + 1 < coordinates.size(); ++i) {
+        Segment segment;
+        segment.from = Coord::fromDegrees(coordinates[i][0].asDouble(), coordinates[i][1].asDouble());
+        segment.to = Coord::fromDegrees(coordinates[i + 1][0].asDouble(), coordinates[i + 1][1].asDouble());
+        segment.order = index << 32 | static_cast<uint64_t>(i) << 1;
+        segment.road = road;
+        segment.one_way = one_way;
+        segment.sidewalk = sidewalk;
+        out.push_back(segment);
+    }
+}
+
+void GraphBuilder::readHighways(const std::string &filename)
+{
+    auto start = std::chrono::steady_clock::now();
+    GeoJSONReader reader(filename);
+    segments.assign(threads, {});
+
+    vector<string> batch(batch_size);
+    uint64_t first_feature = 0;
+    while (true) {
+        size_t count = 0;
+        while (count < batch_size && reader.nextText(batch[count])) {
+            ++count;
+        }
+        if (count == 0) {
+            break;
+        }
+        parallel_for(count, threads, [&](size_t t, size_t begin, size_t end) {
+            Json::CharReaderBuilder builder;
+            std::unique_ptr<Json::CharReader> parser(builder.newCharReader());
+            Json::Value feature;
+            string errors;
+            for (size_t i = begin; i < end; ++i) {
+                const string &text = batch[i];
+                if (!parser->parse(text.data(), text.data() + text.size(), &feature, &errors)) {
+                    throw std::runtime_error("Malformed GeoJSON feature " + std::to_string(first_feature + i) + ": " + errors);
+                }
+                addSegments(feature, first_feature + i, segments[t]);
+            }
+        });
+        first_feature += count;
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Read " << reader.count() << " features from " << filename << " on " << threads << " threads in "
+              << seconds << " s (" << static_cast<size_t>(reader.count() / std::max(seconds, 1e-9)) << " features/s)"
+              << std::endl;
+}
+
+void GraphBuilder::build(Profile profile, Graph &graph) const
+{
+    build({profile}, {&graph});
+}
+
+void GraphBuilder::build(const std::vector<Profile> &profiles, const std::vector<Graph *> &graphs) const
+{
+    if (profiles.empty() || profiles.size() != graphs.size()) {
+        throw std::runtime_error("GraphBuilder::build needs one graph per profile.");
+    }
+    const double inf = std::numeric_limits<double>::infinity();
+
+    // may the profile travel the segment, from -> to or (reverse) to -> from
+    auto allowed = [](Profile profile, const Segment &segment, bool reverse) {
+        return profile == Profile::car ? !(reverse && segment.one_way) : segment.sidewalk;
+    };
+    auto weight = [](Profile profile, const Segment &segment, bool reverse) {
+        const Coord &a = reverse ? segment.to : segment.from, &b = reverse ? segment.from : segment.to;
+        if (profile == Profile::car) {
+            return calculate_weighted_distance(Node(a, segment.road), Node(b, segment.road));
+        }
+        return calculate_distance(a, b);
+    };
+    auto any_allowed = [&](const Segment &segment, bool reverse) {
+        for (Profile profile : profiles) {
+            if (allowed(profile, segment, reverse)) {
+                return true;
+            }
+        }
+        return false;
+    };
+    auto included = [&](const Segment &segment) {
+        return any_allowed(segment, false) || any_allowed(segment, true);
+    };
+
+    // node id table: every endpoint any profile uses once, sorted by (lng, lat)
+    vector<vector<Coord>> points(segments.size());
+    parallel_for(segments.size(), threads, [&](size_t, size_t begin, size_t end) {
+        for (size_t t = begin; t < end; ++t) {
+            for (const Segment &segment : segments[t]) {
+                if (included(segment)) {
+                    points[t].push_back(segment.from);
+                    points[t].push_back(segment.to);
+                }
+            }
+        }
+    });
+    vector<Coord> coords = concat(points, threads);
+    points.clear();
+    parallel_sort(coords.begin(), coords.end(), std::less<Coord>(), threads);
+    coords.erase(std::unique(coords.begin(), coords.end()), coords.end());
+    vector<node_id> ids = hilbert_ids(coords, threads);
+
+    auto find = [&coords, &ids](const Coord &point) {
+        return ids[std::lower_bound(coords.begin(), coords.end(), point) - coords.begin()];
+    };
+
+    // directed edges any profile may use, with the segment they come from; the low
+    // bit of order tells the reverse direction
+    struct Edge {
+        node_id from, to;
+        uint64_t order;
+        const Segment *segment;
+    };
+    vector<vector<Edge>> parts(segments.size());
+    parallel_for(segments.size(), threads, [&](size_t, size_t begin, size_t end) {
+        for (size_t t = begin; t < end; ++t) {
+            for (const Segment &segment : segments[t]) {
+                if (!included(segment)) {
+                    continue;
+                }
+                node_id u = find(segment.from), v = find(segment.to);
+                if (any_allowed(segment, false)) {
+                    parts[t].push_back({u, v, segment.order, &segment});
+                }
+                if (any_allowed(segment, true)) {
+                    parts[t].push_back({v, u, segment.order | 1, &segment});
+                }
+            }
+        }
+    });
+    vector<Edge> edges = concat(parts, threads);
+    parts.clear();
+    parallel_sort(edges.begin(), edges.end(), [](const Edge &a, const Edge &b) {
+        return std::tie(a.from, a.to, a.order) < std::tie(b.from, b.to, b.order);
+    }, threads);
+
+    // one edge per (from, to); per profile its weight comes from the first segment
+    // in file order that profile may use, infinity if there is none
+    vector<size_t> runs;
+    for (size_t e = 0; e < edges.size(); ++e) {
+        if (e == 0 || edges[e].from != edges[e - 1].from || edges[e].to != edges[e - 1].to) {
+            runs.push_back(e);
+        }
+    }
+    runs.push_back(edges.size());
+    size_t m = runs.size() - 1;
+
+    size_t n = coords.size();
+    vector<uint32_t> offsets(n + 1, 0);
+    vector<node_id> targets(m);
+    vector<vector<double>> weights(profiles.size(), vector<double>(m, inf));
+    vector<vector<uint8_t>> patterns(profiles.size(), vector<uint8_t>(m, 0));
+    parallel_for(m, threads, [&](size_t, size_t begin, size_t end) {
+        for (size_t r = begin; r < end; ++r) {
+            targets[r] = edges[runs[r]].to;
+            for (size_t p = 0; p < profiles.size(); ++p) {
+                for (size_t e = runs[r]; e < runs[r + 1]; ++e) {
+                    bool reverse = edges[e].order & 1;
+                    if (allowed(profiles[p], *edges[e].segment, reverse)) {
+                        weights[p][r] = weight(profiles[p], *edges[e].segment, reverse);
+                        patterns[p][r] = pattern_of(profiles[p], edges[e].segment->road);
+                        break;
+                    }
+                }
+            }
+        }
+    });
+    for (size_t r = 0; r < m; ++r) {
+        ++offsets[edges[runs[r]].from + 1];
+    }
+    for (size_t i = 0; i < n; ++i) {
+        offsets[i + 1] += offsets[i];
+    }
+
+    vector<Coord> ordered(n);
+    for (size_t i = 0; i < n; ++i) {
+        ordered[ids[i]] = coords[i];
+    }
+    graphs[0]->freeze(std::move(ordered), std::move(offsets), std::move(targets), std::move(weights[0]));
+    for (size_t p = 1; p < profiles.size(); ++p) {
+        graphs[p]->freezeProfile(*graphs[0], std::move(weights[p]));
+    }
+    for (size_t p = 0; p < profiles.size(); ++p) {
+        const auto &profile_patterns = patterns_of(profiles[p]);
+        if (profile_patterns.size() == 1) {
+            patterns[p].clear();
+        }
+        double seconds_per_unit = profiles[p] == Profile::car ? car_seconds_per_unit : pedestrian_seconds_per_unit;
+        graphs[p]->setTravelTimes(TravelTimes::build(profile_patterns, std::move(patterns[p]), seconds_per_unit));
+    }
+}
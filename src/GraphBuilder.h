@@ -0,0 +1,64 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <jsoncpp/json/json.h>
+#include "Graph.h"
+#include "Node.h"
+
+enum class Profile {
+    // weighted by road class, one-way streets respected
+    car,
+    // plain distance, both directions, roads tagged sidewalk=no left out
+    pedestrian,
+};
+
+/**
+ * Parallel build pipeline from the highway GeoJSON to frozen graphs.
+ *
+ *   1. the reader cuts the file into batches of raw features; worker threads
+ *      parse them and append the road segments to per-thread buffers
+ *   2. per profile, segment endpoints are sorted and deduplicated in parallel, then
+ *      numbered along a Hilbert curve so that nearby nodes get nearby ids
+ *   3. directed edges look up their ids, then are sorted and deduplicated in parallel;
+ *      per profile an edge's weight and time-of-day pattern come from the first
+ *      segment in file order the profile may use, the weight is infinite if there
+ *      is none
+ *   4. Graph::freeze derives the reverse CSR and builds the kd-tree of the first
+ *      profile, the others share its topology and only add their weights
+ *
+ * The highway file is read once, however many profiles are built from it.
+ */
+class GraphBuilder {
+public:
+    explicit GraphBuilder(size_t threads = 0);
+
+    void readHighways(const std::string &filename);
+
+    // Builds and freezes `graph`; names it already staged with addNamePoint are kept.
+    void build(Profile profile, Graph &graph) const;
+
+    // Builds one topology holding every road any of the profiles may use, and freezes
+    // graphs[i] as profiles[i]'s weights over it. graphs[0] owns the topology and
+    // keeps the names it staged; the others share both (see Graph::freezeProfile).
+    void build(const std::vector<Profile> &profiles, const std::vector<Graph *> &graphs) const;
+
+private:
+    struct Segment {
+        Coord from, to;
+        // feature index << 32 | 2 * position in the feature, so that sorting by
+        // it restores file order
+        uint64_t order;
+        priority road;
+        bool one_way;
+        bool sidewalk;
+    };
+
+    size_t threads;
+    // one buffer per worker thread
+    std::vector<std::vector<Segment>> segments;
+
+    static void addSegments(const Json::Value &feature, uint64_t index, std::vector<Segment> &out);
+};
@@ -0,0 +1,225 @@
+#include "Isochrone.h"
+#include "Parallel.h"
+#include "SearchContext.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <memory>
+
+using std::vector;
+
+namespace {
+
+const double inf = std::numeric_limits<double>::infinity();
+
+// frontiers smaller than this are relaxed on the calling thread, thread start-up
+// would cost more than the work
+const size_t parallel_frontier = 2048;
+
+// delta as a multiple of the mean edge weight
+const double delta_factor = 4;
+
+// bucket indices are clamped here, far below where size_t would overflow
+const size_t max_bucket = size_t(1) << 52;
+
+// upper bound on the slots of the bucket ring; delta is widened to stay below it
+const size_t max_ring = size_t(1) << 20;
+
+// Lowers value to x; true if x was smaller. Costs are never negative, so the
+// loop ends as soon as another thread got there first with something better.
+inline bool atomic_min(std::atomic<double> &value, double x) {
+    double current = value.load(std::memory_order_relaxed);
+    while (x < current) {
+        if (value.compare_exchange_weak(current, x, std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline double cross(const std::array<double, 2> &o, const std::array<double, 2> &a, const std::array<double, 2> &b) {
+    return (a[0] - o[0]) * (b[1] - o[1]) - (a[1] - o[1]) * (b[0] - o[0]);
+}
+
+}
+
+bool bounded_dijkstra(ArrayRef<uint32_t> offsets, ArrayRef<uint32_t> targets, ArrayRef<double> weights,
+                      uint32_t root, double budget, size_t settle_limit, Reachable &out)
+{
+    SearchSpace &queue = SearchContext::local(offsets.size() - 1).forward;
+    out.nodes.clear();
+    out.dist.clear();
+    queue.update(root, 0, 0, SearchSpace::npos);
+    queue.push(0, root);
+    while (!queue.empty()) {
+        auto [d, u] = queue.top();
+        queue.pop();
+        if (d > queue.dist(u)) {
+            continue;
+        }
+        if (out.nodes.size() == settle_limit) {
+            return false;
+        }
+        queue.settle(u);
+        out.nodes.push_back(u);
+        out.dist.push_back(d);
+        for (uint32_t e = offsets[u]; e < offsets[u + 1]; ++e) {
+            double nd = d + weights[e];
+            if (nd <= budget && nd < queue.dist(targets[e])) {
+                queue.update(targets[e], nd, nd, u);
+                queue.push(nd, targets[e]);
+            }
+        }
+    }
+    return true;
+}
+
+void delta_stepping(ArrayRef<uint32_t> offsets, ArrayRef<uint32_t> targets, ArrayRef<double> weights,
+                    uint32_t root, double budget, double delta, size_t threads, Reachable &out)
+{
+    size_t n = offsets.size() - 1;
+    // edges closed to the profile weigh inf and are left out of the mean and the
+    // longest edge; edges longer than the budget are never relaxed
+    double sum = 0, longest = 0;
+    size_t open = 0;
+    for (double w : weights) {
+        if (std::isfinite(w)) {
+            sum += w;
+            longest = std::max(longest, std::min(w, budget));
+            ++open;
+        }
+    }
+    if (delta <= 0) {
+        delta = open == 0 ? 1 : std::max(1e-9, delta_factor * sum / open);
+    }
+    // wide enough that every bucket index of the budget fits and the ring stays small
+    if (std::isfinite(budget)) {
+        delta = std::max(delta, budget / max_bucket);
+    }
+    delta = std::max(delta, longest / (max_ring - 2));
+    threads = std::max<size_t>(1, threads);
+
+    std::unique_ptr<std::atomic<double>[]> dist(new std::atomic<double>[n]);
+    parallel_for(n, threads, [&](size_t, size_t begin, size_t end) {
+        for (size_t v = begin; v < end; ++v) {
+            dist[v].store(inf, std::memory_order_relaxed);
+        }
+    });
+    // frontier membership, so a node queued twice in a bucket is relaxed once per round
+    vector<uint32_t> round_of(n, 0);
+    uint32_t round = 0;
+
+    auto bucketOf = [delta](double d) {
+        double i = d / delta;
+        return i < max_bucket ? static_cast<size_t>(i) : max_bucket;
+    };
+    // Buckets are kept in a ring: relaxing bucket i only reaches buckets up to
+    // i + ceil(longest / delta), so that many slots plus one never collide.
+    vector<vector<uint32_t>> buckets(bucketOf(longest) + 2);
+    auto slot = [&buckets](size_t i) -> vector<uint32_t> & {
+        return buckets[i % buckets.size()];
+    };
+    // entries in the ring, stale ones included
+    size_t queued = 1;
+    dist[root].store(0, std::memory_order_relaxed);
+    slot(0).push_back(root);
+
+    // per thread: nodes whose distance it lowered during one relaxation
+    vector<vector<uint32_t>> improved(threads);
+    auto relax = [&](const vector<uint32_t> &frontier, bool light) {
+        auto work = [&](size_t t, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                uint32_t u = frontier[i];
+                double d = dist[u].load(std::memory_order_relaxed);
+                for (uint32_t e = offsets[u]; e < offsets[u + 1]; ++e) {
+                    // closed edges are neither light nor heavy
+                    if (!std::isfinite(weights[e]) || (weights[e] <= delta) != light) {
+                        continue;
+                    }
+                    double nd = d + weights[e];
+                    if (nd <= budget && atomic_min(dist[targets[e]], nd)) {
+                        improved[t].push_back(targets[e]);
+                    }
+                }
+            }
+        };
+        if (frontier.size() < parallel_frontier) {
+            work(0, 0, frontier.size());
+        } else {
+            parallel_for(frontier.size(), threads, work);
+        }
+        for (auto &nodes : improved) {
+            for (uint32_t v : nodes) {
+                slot(bucketOf(dist[v].load(std::memory_order_relaxed))).push_back(v);
+            }
+            queued += nodes.size();
+            nodes.clear();
+        }
+    };
+
+    vector<uint32_t> frontier, settled;
+    for (size_t i = 0; queued > 0; ++i) {
+        vector<uint32_t> &bucket = slot(i);
+        // heavy edges land in a later bucket unless bucketOf clamped, in which case
+        // the last bucket is simply run again
+        while (!bucket.empty()) {
+            settled.clear();
+            while (!bucket.empty()) {
+                ++round;
+                frontier.clear();
+                for (uint32_t v : bucket) {
+                    // entries left behind when v moved to a lower bucket are stale
+                    if (round_of[v] != round && bucketOf(dist[v].load(std::memory_order_relaxed)) == i) {
+                        round_of[v] = round;
+                        frontier.push_back(v);
+                    }
+                }
+                queued -= bucket.size();
+                bucket.clear();
+                settled.insert(settled.end(), frontier.begin(), frontier.end());
+                relax(frontier, true);
+            }
+            std::sort(settled.begin(), settled.end());
+            settled.erase(std::unique(settled.begin(), settled.end()), settled.end());
+            relax(settled, false);
+        }
+    }
+
+    out.nodes.clear();
+    out.dist.clear();
+    for (uint32_t v = 0; v < n; ++v) {
+        double d = dist[v].load(std::memory_order_relaxed);
+        if (d <= budget) {
+            out.nodes.push_back(v);
+            out.dist.push_back(d);
+        }
+    }
+}
+
+std::vector<std::array<double, 2>> convex_hull(std::vector<std::array<double, 2>> points)
+{
+    std::sort(points.begin(), points.end());
+    points.erase(std::unique(points.begin(), points.end()), points.end());
+    if (points.size() < 3) {
+        return points;
+    }
+    vector<std::array<double, 2>> hull(2 * points.size());
+    size_t k = 0;
+    // lower chain left to right, then upper chain right to left
+    for (size_t i = 0; i < points.size(); ++i) {
+        while (k >= 2 && cross(hull[k - 2], hull[k - 1], points[i]) <= 0) {
+            --k;
+        }
+        hull[k++] = points[i];
+    }
+    for (size_t i = points.size() - 1, lower = k + 1; i-- > 0;) {
+        while (k >= lower && cross(hull[k - 2], hull[k - 1], points[i]) <= 0) {
+            --k;
+        }
+        hull[k++] = points[i];
+    }
+    hull.resize(k);
+    return hull;
+}
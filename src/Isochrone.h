@@ -0,0 +1,37 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <vector>
+#include "ArrayRef.h"
+
+/**
+ * One-to-all searches bounded by a cost budget, for isochrones.
+ *
+ * Small budgets run a plain Dijkstra in the thread's SearchContext. Large ones
+ * use delta-stepping: tentative distances live in atomics, nodes are grouped
+ * into buckets of width delta, and each bucket's frontier is relaxed in
+ * parallel (light edges until the bucket is empty, then heavy edges once).
+ * Buckets live in a ring just long enough for the longest edge, so memory does
+ * not grow with the budget.
+ */
+
+// Reached nodes and their costs, in no particular order.
+struct Reachable {
+    std::vector<uint32_t> nodes;
+    std::vector<double> dist;
+};
+
+// Bounded Dijkstra from root. Gives up and returns false once more than
+// settle_limit nodes are settled; out is then incomplete.
+bool bounded_dijkstra(ArrayRef<uint32_t> offsets, ArrayRef<uint32_t> targets, ArrayRef<double> weights,
+                      uint32_t root, double budget, size_t settle_limit, Reachable &out);
+
+// Delta-stepping from root on up to `threads` threads; delta <= 0 picks one from
+// the mean edge weight.
+void delta_stepping(ArrayRef<uint32_t> offsets, ArrayRef<uint32_t> targets, ArrayRef<double> weights,
+                    uint32_t root, double budget, double delta, size_t threads, Reachable &out);
+
+// Convex hull (Andrew's monotone chain), counter-clockwise and closed: the first
+// point is repeated at the end. Fewer than three distinct points are returned as is.
+std::vector<std::array<double, 2>> convex_hull(std::vector<std::array<double, 2>> points);
@@ -1,210 +1,316 @@
 #include "KDTree.h"
+#include "Distance.h"
+#include "Parallel.h"
 
-double distance(const KDNode &node1, const KDNode &node2) {
-    return calculate_distance(node1.data[0], node1.data[1], node2.data[0], node2.data[1]);
-}
+#include <cmath>
+#include <queue>
+#include <thread>
 
-bool operator==(const KDNode &n1, const KDNode &n2) {
-    return n1.data == n2.data;
-}
+namespace {
 
-KDTree::KDTree(std::vector<node_t> nodes, int depth) : root(nullptr) {
-    
-    build_recursive(root, nodes, depth);
-}
+const double earth_radius = 6371000;
 
-inline void KDTree::build_recursive(node_ptr_t &cur, std::vector<node_t> &nodes, int depth)
-{
-    if (nodes.empty()) {
-        cur = nullptr;
-        return;
-    }
+// subtrees smaller than this are built on the current thread
+const size_t parallel_build_size = 1 << 16;
 
-    size_t axis = depth % 2;
+struct Range {
+    uint32_t lo, hi;
+    int depth;
+    // lower bound in meters from the query to any point in the range
+    double bound;
+};
 
-    size_t median = nodes.size() / 2;
+inline int32_t axis_value(const KDNode &node, int axis) {
+    return axis == 0 ? node.coord.lng : node.coord.lat;
+}
 
-    auto cmp = [axis](const node_t &node1, const node_t &node2) {
-        return node1.data[axis] < node2.data[axis];
-    };
+// Lower bound on the great-circle distance (meters) between the query and any
+// point on the far side of a split line, given the gap along that axis in degrees.
+inline double axis_bound(int axis, double gap, double cos_lat) {
+    double rad = std::abs(gap) * M_PI / 180.0;
+    if (axis == 1) {
+        // latitude: the meridian arc is never longer than the great circle
+        return earth_radius * rad;
+    }
+    // longitude: distance to the splitting meridian is R * asin(cos(lat) * sin(dlng)),
+    // bounded below by dropping the asin and the higher terms of sin
+    return earth_radius * cos_lat * rad * std::max(0.0, 1 - rad * rad / 6);
+}
 
-    std::nth_element(nodes.begin(), nodes.begin() + median, nodes.end(), cmp);
+// Lower bounds of the distance from the query to every point of a leaf, so that the
+// exact distance is only computed for points that can still matter.
+inline void leaf_bounds(const DistanceBound &bound, ArrayRef<KDNode> points, uint32_t lo, uint32_t hi, double *out) {
+    Coord leaf[KDTree::bucket_size];
+    for (uint32_t i = lo; i < hi; ++i) {
+        leaf[i - lo] = points[i].coord;
+    }
+    bound.batch(leaf, hi - lo, out);
+}
 
-    cur = std::make_shared<KDNode>(nodes[median]);
+}
 
-    std::vector<node_t> leftNodes(nodes.begin(), nodes.begin() + median);
-    std::vector<node_t> rightNodes(nodes.begin() + median + 1, nodes.end());
+double distance(const KDNode &node1, const KDNode &node2) {
+    return calculate_distance(node1.coord, node2.coord);
+}
 
-    build_recursive(cur->left, leftNodes, depth + 1);
-    build_recursive(cur->left, rightNodes, depth + 1);
+bool operator==(const KDNode &n1, const KDNode &n2) {
+    return n1.coord == n2.coord;
 }
 
-inline void KDTree::insert_recursive(node_ptr_t &cur, const node_t &node, int depth)
-{
-    if (cur == nullptr) {
-        cur = std::make_shared<node_t>(node);
-        return;
-    }
-    size_t axis = depth % 2;        
-    auto cmp = [axis](const node_t &node1, const node_t &node2) {
-        return node1.data[axis] < node2.data[axis];
+KDTree::KDTree(std::vector<node_t> nodes) : owned(std::move(nodes)) {
+    auto by_coord = [](const node_t &node1, const node_t &node2) {
+        return node1.coord < node2.coord || (node1.coord == node2.coord && node1.id < node2.id);
     };
-    if (cmp(node, *cur)) {
-        // node < cur
-        insert_recursive(cur->left, node, depth + 1);
-    } else {
-        insert_recursive(cur->right, node, depth + 1);
+    // the segment index has samples of different edges at one point; all are kept
+    auto same_point = [](const node_t &node1, const node_t &node2) {
+        return node1.coord == node2.coord && node1.id == node2.id;
+    };
+    std::sort(owned.begin(), owned.end(), by_coord);
+    owned.erase(std::unique(owned.begin(), owned.end(), same_point), owned.end());
+    owned.shrink_to_fit();
+    // one thread per subtree down to about build_threads() subtrees
+    int spawn_levels = 0;
+    while ((size_t(1) << spawn_levels) < build_threads()) {
+        ++spawn_levels;
     }
+    build(0, owned.size(), 0, spawn_levels);
+    points = owned;
 }
 
-KDTree::node_t KDTree::search_recursive(const node_ptr_t &cur, const node_t &node, int depth) const
-{
-    if (cur == nullptr) {
-        return node_t();
-    }
-    
-    if (*cur == node) {
-        return *cur;
-    }
-    size_t axis = depth % 2;        
-    auto cmp = [axis](const node_t &node1, const node_t &node2) {
-        return node1.data[axis] < node2.data[axis];
-    };
-    if (cmp(node, *cur)) {
-        // node < cur
-        return search_recursive(cur->left, node, depth + 1);
-    } else {
-        return search_recursive(cur->right, node, depth + 1);
+KDTree::KDTree(const KDTree &other) : owned(other.owned), points(other.points) {
+    if (!owned.empty()) {
+        points = owned;
     }
 }
 
-inline void KDTree::nearest_neighbor_recursive(const node_ptr_t &cur, const node_t &node, int depth, node_t &nn, double &nn_dis) const
+KDTree &KDTree::operator=(const KDTree &other) {
+    owned = other.owned;
+    points = owned.empty() ? other.points : ArrayRef<node_t>(owned);
+    return *this;
+}
+
+KDTree KDTree::fromFlat(ArrayRef<node_t> points) {
+    KDTree tree;
+    tree.points = points;
+    return tree;
+}
+
+void KDTree::build(size_t lo, size_t hi, int depth, int spawn_levels)
 {
-    if (cur == nullptr) {
-        // Reaches the leaf node
+    if (hi - lo <= bucket_size) {
         return;
     }
 
-    size_t axis = depth % 2;        
+    int axis = depth % 2;
+    size_t median = lo + (hi - lo) / 2;
+
     auto cmp = [axis](const node_t &node1, const node_t &node2) {
-        return node1.data[axis] < node2.data[axis];
+        return axis_value(node1, axis) < axis_value(node2, axis);
     };
 
-    node_ptr_t next, other;    
-    if (cmp(node, *cur)) {
-        // node < *cur
-        next = cur->left;
-        other = cur->right;
-    } else {
-        next = cur->right;
-        other = cur->left;
-    }
-    nearest_neighbor_recursive(next, node, depth + 1, nn, nn_dis);
+    std::nth_element(owned.begin() + lo, owned.begin() + median, owned.begin() + hi, cmp);
 
-    double t_dis = distance(node, *cur);
-    if (t_dis < nn_dis) {
-        nn = *cur;
-        nn_dis = t_dis;
-    }
-
-    // Check if radius is large enough to reach the other region
-    if (nn_dis > std::abs(cur->data[axis] - nn.data[axis])) {
-        nearest_neighbor_recursive(other, node, depth + 1, nn, nn_dis);
+    if (spawn_levels > 0 && hi - lo >= parallel_build_size) {
+        std::thread left([this, lo, median, depth, spawn_levels]() {
+            build(lo, median, depth + 1, spawn_levels - 1);
+        });
+        build(median + 1, hi, depth + 1, spawn_levels - 1);
+        left.join();
+    } else {
+        build(lo, median, depth + 1, 0);
+        build(median + 1, hi, depth + 1, 0);
     }
-
-}
-
-void KDTree::insert(const node_t &node) {
-    insert_recursive(root, node, 0);    
 }
 
 KDTree::node_t KDTree::search(const node_t &node) const
 {
-    return search_recursive(root, node, 0);
+    // equal split values may sit on both sides, so keep a stack like nearest_neighbor
+    Range stack[64];
+    int top = 0;
+    if (!points.empty()) {
+        stack[top++] = {0, static_cast<uint32_t>(points.size()), 0, 0};
+    }
+    while (top > 0) {
+        Range cur = stack[--top];
+        if (cur.hi - cur.lo <= bucket_size) {
+            for (uint32_t i = cur.lo; i < cur.hi; ++i) {
+                if (points[i] == node) {
+                    return points[i];
+                }
+            }
+            continue;
+        }
+        int axis = cur.depth % 2;
+        uint32_t median = cur.lo + (cur.hi - cur.lo) / 2;
+        if (points[median] == node) {
+            return points[median];
+        }
+        int32_t split = axis_value(points[median], axis);
+        if (axis_value(node, axis) <= split) {
+            stack[top++] = {cur.lo, median, cur.depth + 1, 0};
+        }
+        if (axis_value(node, axis) >= split) {
+            stack[top++] = {median + 1, cur.hi, cur.depth + 1, 0};
+        }
+    }
+    return node_t();
 }
 
 KDTree::node_t KDTree::nearest_neighbor(const node_t &node) const
 {
     double nn_dis = std::numeric_limits<double>::infinity();
     node_t nn;
-    nearest_neighbor_recursive(root, node, 0, nn, nn_dis);
-    return nn;
-}
-
-void KDTree::serialize(std::ofstream &out) const {
-    if (!out.is_open()) {
-        throw std::runtime_error("Failed to open file for writing");
+    if (points.empty()) {
+        return nn;
+    }
+    double cos_lat = std::cos(node.coord.getLat() * M_PI / 180.0);
+    DistanceBound bound(node.coord);
+    double bounds[bucket_size];
+
+    // depth-first, near side first; a far side is pushed below its near side
+    // together with the lower bound of its distance and skipped once nn beats it
+    Range stack[64];
+    int top = 0;
+    stack[top++] = {0, static_cast<uint32_t>(points.size()), 0, 0};
+    while (top > 0) {
+        Range cur = stack[--top];
+        if (cur.bound >= nn_dis) {
+            continue;
+        }
+        if (cur.hi - cur.lo <= bucket_size) {
+            leaf_bounds(bound, points, cur.lo, cur.hi, bounds);
+            for (uint32_t i = cur.lo; i < cur.hi; ++i) {
+                if (bounds[i - cur.lo] >= nn_dis) {
+                    continue;
+                }
+                double t_dis = distance(node, points[i]);
+                if (t_dis < nn_dis) {
+                    nn = points[i];
+                    nn_dis = t_dis;
+                }
+            }
+            continue;
+        }
+
+        int axis = cur.depth % 2;
+        uint32_t median = cur.lo + (cur.hi - cur.lo) / 2;
+        if (bound(points[median].coord) < nn_dis) {
+            double t_dis = distance(node, points[median]);
+            if (t_dis < nn_dis) {
+                nn = points[median];
+                nn_dis = t_dis;
+            }
+        }
+
+        double gap = (axis_value(node, axis) - int64_t(axis_value(points[median], axis))) / Coord::scale;
+        double far_bound = std::max(cur.bound, axis_bound(axis, gap, cos_lat));
+        if (gap < 0) {
+            stack[top++] = {median + 1, cur.hi, cur.depth + 1, far_bound};
+            stack[top++] = {cur.lo, median, cur.depth + 1, cur.bound};
+        } else {
+            stack[top++] = {cur.lo, median, cur.depth + 1, far_bound};
+            stack[top++] = {median + 1, cur.hi, cur.depth + 1, cur.bound};
+        }
     }
-    serialize_recursive(root, out);
+    return nn;
 }
 
-void KDTree::serialize_recursive(const node_ptr_t &cur, std::ofstream &out) const {
-    if (!cur) {
-        // 用标志表示空节点
-        bool is_null = true;
-        out.write(reinterpret_cast<const char*>(&is_null), sizeof(is_null));
+template <class Visit>
+void KDTree::visit_within(const node_t &node, double &limit, Visit visit) const
+{
+    if (points.empty()) {
         return;
     }
-
-    // 写入当前节点的存在标志
-    bool is_null = false;
-    out.write(reinterpret_cast<const char*>(&is_null), sizeof(is_null));
-
-    // 写入节点数据
-    out.write(reinterpret_cast<const char*>(&cur->data[0]), sizeof(cur->data[0]));
-    out.write(reinterpret_cast<const char*>(&cur->data[1]), sizeof(cur->data[1]));
-
-    // 递归写入左右子节点
-    serialize_recursive(cur->left, out);
-    serialize_recursive(cur->right, out);
+    double cos_lat = std::cos(node.coord.getLat() * M_PI / 180.0);
+    DistanceBound bound(node.coord);
+    double bounds[bucket_size];
+
+    // same walk as nearest_neighbor, pruning against limit instead of the best so far
+    Range stack[64];
+    int top = 0;
+    stack[top++] = {0, static_cast<uint32_t>(points.size()), 0, 0};
+    while (top > 0) {
+        Range cur = stack[--top];
+        if (cur.bound > limit) {
+            continue;
+        }
+        if (cur.hi - cur.lo <= bucket_size) {
+            leaf_bounds(bound, points, cur.lo, cur.hi, bounds);
+            for (uint32_t i = cur.lo; i < cur.hi; ++i) {
+                if (bounds[i - cur.lo] <= limit) {
+                    visit(points[i], distance(node, points[i]));
+                }
+            }
+            continue;
+        }
+
+        int axis = cur.depth % 2;
+        uint32_t median = cur.lo + (cur.hi - cur.lo) / 2;
+        if (bound(points[median].coord) <= limit) {
+            visit(points[median], distance(node, points[median]));
+        }
+
+        double gap = (axis_value(node, axis) - int64_t(axis_value(points[median], axis))) / Coord::scale;
+        double far_bound = std::max(cur.bound, axis_bound(axis, gap, cos_lat));
+        if (gap < 0) {
+            stack[top++] = {median + 1, cur.hi, cur.depth + 1, far_bound};
+            stack[top++] = {cur.lo, median, cur.depth + 1, cur.bound};
+        } else {
+            stack[top++] = {cur.lo, median, cur.depth + 1, far_bound};
+            stack[top++] = {median + 1, cur.hi, cur.depth + 1, cur.bound};
+        }
+    }
 }
 
-void KDTree::deserialize(std::ifstream &in) {
-    if (!in.is_open()) {
-        throw std::runtime_error("Failed to open file for reading");
+KDTree::node_t KDTree::nearest_neighbor(const node_t &node, const Filter &accept) const
+{
+    if (!accept) {
+        return nearest_neighbor(node);
     }
-    deserialize_recursive(root, in);
+    std::vector<node_t> nearest = k_nearest(node, 1, accept);
+    return nearest.empty() ? node_t() : nearest.front();
 }
 
-void KDTree::deserialize_recursive(node_ptr_t &cur, std::ifstream &in) {
-    // 读取当前节点的存在标志
-    bool is_null;
-    in.read(reinterpret_cast<char*>(&is_null), sizeof(is_null));
-
-    if (is_null) {
-        // 空节点
-        cur = nullptr;
-        return;
+std::vector<KDTree::node_t> KDTree::k_nearest(const node_t &node, size_t k, const Filter &accept) const
+{
+    if (k == 0) {
+        return {};
     }
-
-    // 创建新节点
-    cur = std::make_shared<KDNode>();
-
-    // 读取节点数据
-    in.read(reinterpret_cast<char*>(&cur->data[0]), sizeof(cur->data[0]));
-    in.read(reinterpret_cast<char*>(&cur->data[1]), sizeof(cur->data[1]));
-
-    // 递归读取左右子节点
-    deserialize_recursive(cur->left, in);
-    deserialize_recursive(cur->right, in);
+    // max-heap of the best k so far, its top is the one to beat
+    std::priority_queue<std::pair<double, uint32_t>> best;
+    double limit = std::numeric_limits<double>::infinity();
+    visit_within(node, limit, [&](const node_t &point, double dis) {
+        if (accept && (dis >= limit || !accept(point.id))) {
+            return;
+        }
+        if (best.size() < k) {
+            best.push({dis, static_cast<uint32_t>(&point - points.data())});
+        } else if (dis < best.top().first) {
+            best.pop();
+            best.push({dis, static_cast<uint32_t>(&point - points.data())});
+        } else {
+            return;
+        }
+        if (best.size() == k) {
+            limit = best.top().first;
+        }
+    });
+
+    std::vector<node_t> result(best.size());
+    for (size_t i = result.size(); i-- > 0;) {
+        result[i] = points[best.top().second];
+        best.pop();
+    }
+    return result;
 }
 
-// void KDNode::serialize(std::ofstream &out)
-// {
-//     out.write(reinterpret_cast<const char*>(&data[0]), sizeof(data[0]));
-//     out.write(reinterpret_cast<const char*>(&data[1]), sizeof(data[1]));
-
-//     out.write(reinterpret_cast<const char*>(&left), sizeof(left));
-//     out.write(reinterpret_cast<const char*>(&right), sizeof(right));
-
-// }
-
-// void KDNode::deserialize(std::ifstream &in)
-// {
-//     in.read(reinterpret_cast<char *>(&data[0]), sizeof(data[0]));
-//     in.read(reinterpret_cast<char *>(&data[1]), sizeof(data[1]));
-
-//     in.read(reinterpret_cast<char *>(&left), sizeof(left));
-//     in.read(reinterpret_cast<char *>(&right), sizeof(right));
-
-// }
+std::vector<KDTree::node_t> KDTree::within_radius(const node_t &node, double radius, const Filter &accept) const
+{
+    std::vector<node_t> result;
+    visit_within(node, radius, [&](const node_t &point, double dis) {
+        if (dis <= radius && (!accept || accept(point.id))) {
+            result.push_back(point);
+        }
+    });
+    return result;
+}
@@ -3,76 +3,85 @@
 #include <algorithm>
 #include <vector>
 #include <array>
+#include <cstdint>
+#include <functional>
 #include "Node.h"
-#include <memory>
+#include "ArrayRef.h"
 #include <limits>
-#include <fstream>
 
 class KDNode {
     friend bool operator==(const KDNode &n1, const KDNode &n2);
-
-    using node_t = KDNode;
-    using node_ptr_t = std::shared_ptr<node_t>;
 public:
-    std::array<double, 2> data;
-    node_ptr_t left;
-    node_ptr_t right;
-
-    KDNode() : left(nullptr), right(nullptr) {}
-    KDNode(const std::array<double, 2> &_data) : data(_data), left(nullptr), right(nullptr) {} 
-    KDNode(const Node &node) : left(nullptr), right(nullptr) {
-        data[0] = node.getLng();
-        data[1] = node.getLat();
-    }
-    void swap(KDNode &other) {
-        std::swap(data, other.data);
-        std::swap(left, other.left);
-        std::swap(right, other.right);
-    }
+    Coord coord;
+    // graph node id of the point
+    uint32_t id;
 
-    // void serialize(std::ofstream &out);
-
-    // void deserialize(std::ifstream &in);
+    KDNode() : coord{0, 0}, id(0) {}
+    KDNode(const Coord &_coord, uint32_t _id = 0) : coord(_coord), id(_id) {}
+    KDNode(const Node &node, uint32_t _id = 0) : coord(node.getCoord()), id(_id) {}
 };
 
-// namespace std {
-//     template <>
-//     void swap(KDNode& a, KDNode& b) noexcept {
-//         a.swap(b);
-//     }
-// }
+static_assert(sizeof(KDNode) == 12, "KDNode is stored in snapshots as is and must be tightly packed");
 
+/**
+ * Implicit kd-tree over a flat array of points.
+ *
+ * The subtree covering [lo, hi) at depth d splits at mid = lo + (hi - lo) / 2 on
+ * axis d % 2: points[mid] is the median, [lo, mid) lies on or below it and
+ * [mid + 1, hi) on or above it. Ranges of at most bucket_size points are leaves.
+ * There are no child pointers, so the array itself is the serialized form.
+ */
 class KDTree {
     using node_t = KDNode;
-    using node_ptr_t = std::shared_ptr<node_t>;
 public:
-    KDTree() : root(nullptr) {}
-    KDTree(std::vector<node_t> nodes, int depth = 0);
+    static const size_t bucket_size = 8;
 
-    void insert(const node_t &node);
+    KDTree() = default;
 
-    node_t search(const node_t &node) const;
+    // Bulk build; points with identical coordinates and ids are kept once.
+    explicit KDTree(std::vector<node_t> nodes);
 
-    node_t nearest_neighbor(const node_t &node) const;
+    KDTree(const KDTree &other);
+    KDTree &operator=(const KDTree &other);
+    KDTree(KDTree &&other) = default;
+    KDTree &operator=(KDTree &&other) = default;
 
-    void serialize(std::ofstream &out) const;
+    // Use an already built array, e.g. one mapped from a snapshot, without copying it.
+    static KDTree fromFlat(ArrayRef<node_t> points);
 
-    void deserialize(std::ifstream &in);
+    node_t search(const node_t &node) const;
 
-private:
-    node_ptr_t root;
+    // Takes a point's id; points it rejects are skipped. Empty accepts every point.
+    using Filter = std::function<bool(uint32_t)>;
 
-    void build_recursive(node_ptr_t &cur, std::vector<node_t> &nodes, int depth);
+    node_t nearest_neighbor(const node_t &node) const;
 
-    void insert_recursive(node_ptr_t &cur, const node_t &node, int depth);
+    // Closest point that passes accept; a default node_t if none does.
+    node_t nearest_neighbor(const node_t &node, const Filter &accept) const;
 
-    node_t search_recursive(const node_ptr_t &cur, const node_t &node, int depth) const;
+    // The k points closest to node, nearest first.
+    std::vector<node_t> k_nearest(const node_t &node, size_t k, const Filter &accept = nullptr) const;
 
-    void nearest_neighbor_recursive(const node_ptr_t &cur, const node_t &node, int depth, node_t &nn, double &nn_dis) const;
+    // Every point within radius meters of node, in no particular order.
+    std::vector<node_t> within_radius(const node_t &node, double radius, const Filter &accept = nullptr) const;
 
-    void serialize_recursive(const node_ptr_t &cur, std::ofstream &out) const;
+    inline ArrayRef<node_t> flat() const {
+        return points;
+    }
 
-    void deserialize_recursive(node_ptr_t &cur, std::ifstream &out);
+    inline size_t size() const {
+        return points.size();
+    }
+
+private:
+    std::vector<node_t> owned;
+    ArrayRef<node_t> points;
 
+    // the top spawn_levels levels build their left subtree on a new thread
+    void build(size_t lo, size_t hi, int depth, int spawn_levels);
 
+    // Calls visit(point, meters) for every point that may lie within `limit` meters
+    // of node; visit may lower limit as it goes, pruning the rest of the walk.
+    template <class Visit>
+    void visit_within(const node_t &node, double &limit, Visit visit) const;
 };
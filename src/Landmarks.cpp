@@ -0,0 +1,288 @@
+#include "Landmarks.h"
+
+#include <algorithm>
+#include <cmath>
+#include <queue>
+#include <random>
+#include <stdexcept>
+
+using std::vector;
+
+namespace {
+
+using node_id = Landmarks::node_id;
+const double inf = std::numeric_limits<double>::infinity();
+
+// relative error of a double rounded to float, with some slack
+const double float_error = 1.5e-7;
+
+/**
+ * Plain Dijkstra over one CSR direction. Fills dist, and optionally the shortest
+ * path tree parents and the settle order.
+ */
+void dijkstra(ArrayRef<uint32_t> offsets, ArrayRef<node_id> targets, ArrayRef<double> weights, node_id source,
+              vector<double> &dist, vector<node_id> *parent = nullptr, vector<node_id> *order = nullptr)
+{
+    size_t n = offsets.size() - 1;
+    dist.assign(n, inf);
+    if (parent) {
+        parent->assign(n, std::numeric_limits<node_id>::max());
+    }
+    if (order) {
+        order->clear();
+    }
+
+    using QueueItem = std::pair<double, node_id>;
+    std::priority_queue<QueueItem, vector<QueueItem>, std::greater<QueueItem>> queue;
+    dist[source] = 0;
+    queue.push({0, source});
+    while (!queue.empty()) {
+        auto [d, u] = queue.top();
+        queue.pop();
+        if (d > dist[u]) {
+            continue;
+        }
+        if (order) {
+            order->push_back(u);
+        }
+        for (uint32_t e = offsets[u]; e < offsets[u + 1]; ++e) {
+            double t = d + weights[e];
+            if (t < dist[targets[e]]) {
+                dist[targets[e]] = t;
+                if (parent) {
+                    (*parent)[targets[e]] = u;
+                }
+                queue.push({t, targets[e]});
+            }
+        }
+    }
+}
+
+node_id farthest(const vector<double> &score) {
+    node_id best = 0;
+    for (node_id v = 0; v < score.size(); ++v) {
+        if (std::isfinite(score[v]) && (!std::isfinite(score[best]) || score[v] > score[best])) {
+            best = v;
+        }
+    }
+    return best;
+}
+
+}
+
+Landmarks Landmarks::build(ArrayRef<uint32_t> offsets, ArrayRef<node_id> targets, ArrayRef<double> weights,
+                           ArrayRef<uint32_t> rev_offsets, ArrayRef<node_id> rev_targets, ArrayRef<double> rev_weights,
+                           size_t count, LandmarkStrategy strategy)
+{
+    size_t n = offsets.size() - 1;
+    Landmarks result;
+    if (n == 0 || count == 0) {
+        return result;
+    }
+    count = std::min(count, n);
+
+    // fixed seed so rebuilding the cache gives the same landmarks
+    std::mt19937 rng(20241217);
+    vector<vector<double>> from, to;
+    vector<double> dist;
+    vector<node_id> chosen;
+
+    auto add_landmark = [&](node_id l) {
+        chosen.push_back(l);
+        from.emplace_back();
+        dijkstra(offsets, targets, weights, l, from.back());
+        to.emplace_back();
+        dijkstra(rev_offsets, rev_targets, rev_weights, l, to.back());
+    };
+
+    // first landmark: far away from a random node
+    dijkstra(offsets, targets, weights, rng() % n, dist);
+    add_landmark(farthest(dist));
+
+    vector<node_id> parent, order;
+    vector<double> size(n);
+    vector<char> has_landmark(n);
+    while (chosen.size() < count) {
+        node_id next;
+        if (strategy == LandmarkStrategy::farthest) {
+            // maximise the round-trip distance to the nearest chosen landmark
+            vector<double> score(n, inf);
+            for (size_t i = 0; i < chosen.size(); ++i) {
+                for (node_id v = 0; v < n; ++v) {
+                    score[v] = std::min(score[v], from[i][v] + to[i][v]);
+                }
+            }
+            for (node_id l : chosen) {
+                score[l] = -inf;
+            }
+            next = farthest(score);
+        } else {
+            node_id root = rng() % n;
+            dijkstra(offsets, targets, weights, root, dist, &parent, &order);
+            std::fill(has_landmark.begin(), has_landmark.end(), 0);
+            for (node_id l : chosen) {
+                has_landmark[l] = 1;
+            }
+            // weight of v: how much the current landmarks underestimate d(root, v)
+            for (node_id v : order) {
+                double best = 0;
+                for (size_t i = 0; i < chosen.size(); ++i) {
+                    double a = from[i][v] - from[i][root], b = to[i][root] - to[i][v];
+                    if (std::isfinite(a)) {
+                        best = std::max(best, a);
+                    }
+                    if (std::isfinite(b)) {
+                        best = std::max(best, b);
+                    }
+                }
+                size[v] = dist[v] - best;
+            }
+            // subtree sizes bottom-up; subtrees holding a landmark count as covered
+            for (auto it = order.rbegin(); it != order.rend(); ++it) {
+                node_id v = *it;
+                node_id p = parent[v];
+                if (has_landmark[v]) {
+                    size[v] = 0;
+                }
+                if (p != std::numeric_limits<node_id>::max()) {
+                    has_landmark[p] |= has_landmark[v];
+                    size[p] += size[v];
+                }
+            }
+            for (node_id v : order) {
+                if (has_landmark[v]) {
+                    size[v] = 0;
+                }
+            }
+            node_id w = root;
+            for (node_id v : order) {
+                if (size[v] > size[w]) {
+                    w = v;
+                }
+            }
+            // walk down to a leaf through the largest child
+            bool descended = true;
+            while (descended) {
+                descended = false;
+                node_id best_child = w;
+                for (uint32_t e = offsets[w]; e < offsets[w + 1]; ++e) {
+                    node_id c = targets[e];
+                    if (parent[c] == w && (best_child == w || size[c] > size[best_child])) {
+                        best_child = c;
+                    }
+                }
+                if (best_child != w) {
+                    w = best_child;
+                    descended = true;
+                }
+            }
+            next = w;
+        }
+        if (std::find(chosen.begin(), chosen.end(), next) != chosen.end()) {
+            // graph too small or too disconnected for more distinct landmarks
+            break;
+        }
+        add_landmark(next);
+    }
+
+    size_t k = chosen.size();
+    result.owned.landmarks = chosen;
+    result.owned.dist_from.resize(n * k);
+    result.owned.dist_to.resize(n * k);
+    for (node_id v = 0; v < n; ++v) {
+        for (size_t i = 0; i < k; ++i) {
+            result.owned.dist_from[v * k + i] = static_cast<float>(from[i][v]);
+            result.owned.dist_to[v * k + i] = static_cast<float>(to[i][v]);
+        }
+    }
+    result.landmarks = result.owned.landmarks;
+    result.dist_from = result.owned.dist_from;
+    result.dist_to = result.owned.dist_to;
+    result.computeSlack();
+    return result;
+}
+
+Landmarks Landmarks::fromSnapshot(const MappedSnapshot &snapshot, uint32_t layer)
+{
+    Landmarks result;
+    if (!snapshot.has(SectionId::alt_landmarks, layer)) {
+        return result;
+    }
+    result.landmarks = snapshot.get<node_id>(SectionId::alt_landmarks, layer);
+    result.dist_from = snapshot.get<float>(SectionId::alt_dist_from, layer);
+    result.dist_to = snapshot.get<float>(SectionId::alt_dist_to, layer);
+    if (result.landmarks.empty() || result.dist_from.size() % result.landmarks.size() != 0
+        || result.dist_to.size() != result.dist_from.size()) {
+        throw std::runtime_error("Snapshot has inconsistent landmark sections.");
+    }
+    result.computeSlack();
+    return result;
+}
+
+void Landmarks::addSections(SnapshotWriter &writer, uint32_t layer) const
+{
+    if (empty()) {
+        return;
+    }
+    writer.add(SectionId::alt_landmarks, landmarks, layer);
+    writer.add(SectionId::alt_dist_from, dist_from, layer);
+    writer.add(SectionId::alt_dist_to, dist_to, layer);
+}
+
+void Landmarks::computeSlack()
+{
+    // The slack keeps the bounds admissible. Being the same for every node it cancels
+    // in reduced edge costs, so it does not make the potential consistent: rounding
+    // the tables leaves every bound within slack of a consistent one, which callers
+    // allow for through rounding().
+    float largest = 0;
+    for (ArrayRef<float> table : {dist_from, dist_to}) {
+        for (float d : table) {
+            if (std::isfinite(d)) {
+                largest = std::max(largest, d);
+            }
+        }
+    }
+    slack = float_error * largest;
+}
+
+double Landmarks::bound(node_id from, node_id to, size_t i) const
+{
+    size_t k = landmarks.size();
+    double best = 0;
+    // d(from, to) >= d(L, to) - d(L, from)
+    double l_to = dist_from[to * k + i], l_from = dist_from[from * k + i];
+    if (std::isfinite(l_to) && std::isfinite(l_from)) {
+        best = std::max(best, l_to - l_from - slack);
+    }
+    // d(from, to) >= d(from, L) - d(to, L)
+    double from_l = dist_to[from * k + i], to_l = dist_to[to * k + i];
+    if (std::isfinite(from_l) && std::isfinite(to_l)) {
+        best = std::max(best, from_l - to_l - slack);
+    }
+    return best;
+}
+
+Landmarks::Active Landmarks::select(node_id s, node_id t) const
+{
+    Active active;
+    vector<std::pair<double, uint32_t>> ranked;
+    for (uint32_t i = 0; i < landmarks.size(); ++i) {
+        ranked.push_back({bound(s, t, i), i});
+    }
+    std::sort(ranked.rbegin(), ranked.rend());
+    active.count = std::min(max_active, ranked.size());
+    for (size_t j = 0; j < active.count; ++j) {
+        active.index[j] = ranked[j].second;
+    }
+    return active;
+}
+
+double Landmarks::lowerBound(node_id from, node_id to, const Active &active) const
+{
+    double best = 0;
+    for (size_t j = 0; j < active.count; ++j) {
+        best = std::max(best, bound(from, to, active.index[j]));
+    }
+    return best;
+}
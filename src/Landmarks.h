@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include "ArrayRef.h"
+#include "Snapshot.h"
+
+enum class LandmarkStrategy {
+    // each new landmark is the node farthest from the ones already chosen
+    farthest,
+    // Goldberg & Werneck: grow a shortest path tree from a random root and walk down
+    // to the leaf of the subtree whose distances are covered worst by the current set
+    avoid,
+};
+
+/**
+ * ALT (A*, landmarks, triangle inequality) lower bounds.
+ *
+ * For every landmark L and node v the tables hold d(L, v) and d(v, L), node-major
+ * so the values of one node share a cache line. Distances are stored as float and
+ * every bound is lowered by the same slack, the rounding error of the largest
+ * stored distance, so they stay admissible. They are not exactly consistent: each
+ * lies within rounding() of a consistent potential.
+ */
+class Landmarks {
+public:
+    using node_id = uint32_t;
+    // how many landmarks a single query uses
+    static const size_t max_active = 4;
+
+    struct Active {
+        uint32_t index[max_active];
+        size_t count = 0;
+    };
+
+    Landmarks() = default;
+    Landmarks(const Landmarks &) = delete;
+    Landmarks &operator=(const Landmarks &) = delete;
+    Landmarks(Landmarks &&) = default;
+    Landmarks &operator=(Landmarks &&) = default;
+
+    static Landmarks build(ArrayRef<uint32_t> offsets, ArrayRef<node_id> targets, ArrayRef<double> weights,
+                           ArrayRef<uint32_t> rev_offsets, ArrayRef<node_id> rev_targets, ArrayRef<double> rev_weights,
+                           size_t count, LandmarkStrategy strategy);
+
+    // Views the sections of one layer of a mapped snapshot; returns an empty set if it has none.
+    static Landmarks fromSnapshot(const MappedSnapshot &snapshot, uint32_t layer = 0);
+
+    void addSections(SnapshotWriter &writer, uint32_t layer = 0) const;
+
+    inline bool empty() const {
+        return landmarks.empty();
+    }
+
+    inline size_t size() const {
+        return landmarks.size();
+    }
+
+    inline size_t nodeCount() const {
+        return landmarks.empty() ? 0 : dist_from.size() / landmarks.size();
+    }
+
+    inline node_id landmark(size_t i) const {
+        return landmarks[i];
+    }
+
+    // The landmarks giving the tightest bound on d(s, t).
+    Active select(node_id s, node_id t) const;
+
+    // Lower bound on d(from, to) using the active landmarks.
+    double lowerBound(node_id from, node_id to, const Active &active) const;
+
+    // How far any lowerBound may be from a consistent potential.
+    inline double rounding() const {
+        return slack;
+    }
+
+private:
+    ArrayRef<node_id> landmarks;
+    // dist_from[v * size() + i] = d(landmark i, v), dist_to[v * size() + i] = d(v, landmark i)
+    ArrayRef<float> dist_from;
+    ArrayRef<float> dist_to;
+    // float_error * the largest finite distance in the tables
+    double slack = 0;
+
+    struct Buffers {
+        std::vector<node_id> landmarks;
+        std::vector<float> dist_from;
+        std::vector<float> dist_to;
+    } owned;
+
+    double bound(node_id from, node_id to, size_t i) const;
+
+    void computeSlack();
+};
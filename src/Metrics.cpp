@@ -0,0 +1,321 @@
+#include "Metrics.h"
+#include "SearchContext.h"
+
+#include <memory>
+#include <mutex>
+#include <sstream>
+
+using std::string;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Only the owning thread writes, so a plain load and store is enough and stays
+// a single instruction each; readers may see a slightly stale value.
+inline void bump(std::atomic<uint64_t> &value, uint64_t by) {
+    value.store(value.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+}
+
+inline void raise(std::atomic<uint64_t> &value, uint64_t to) {
+    if (to > value.load(std::memory_order_relaxed)) {
+        value.store(to, std::memory_order_relaxed);
+    }
+}
+
+inline uint64_t read(const std::atomic<uint64_t> &value) {
+    return value.load(std::memory_order_relaxed);
+}
+
+struct AtomicHistogram {
+    std::atomic<uint64_t> buckets[LatencyHistogram::bucket_count] = {};
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> max{0};
+
+    void record(uint64_t micros) {
+        bump(buckets[LatencyHistogram::bucketOf(micros)], 1);
+        bump(count, 1);
+        bump(sum, micros);
+        raise(max, micros);
+    }
+
+    void addTo(LatencyHistogram &histogram) const {
+        for (size_t i = 0; i < LatencyHistogram::bucket_count; ++i) {
+            histogram.buckets[i] += read(buckets[i]);
+        }
+        histogram.count += read(count);
+        histogram.sum += read(sum);
+        histogram.max = std::max(histogram.max, read(max));
+    }
+};
+
+struct Shard {
+    AtomicHistogram stages[Metrics::type_count][Metrics::stage_count];
+    std::atomic<uint64_t> queries[Metrics::type_count] = {};
+    std::atomic<uint64_t> errors[Metrics::type_count] = {};
+    std::atomic<uint64_t> settled[Metrics::type_count] = {};
+    std::atomic<uint64_t> relaxed[Metrics::type_count] = {};
+    std::atomic<uint64_t> heap_peak_sum[Metrics::type_count] = {};
+    std::atomic<uint64_t> heap_peak_max[Metrics::type_count] = {};
+    std::atomic<uint64_t> cache[Metrics::type_count][Metrics::cache_event_count] = {};
+};
+
+// Shards live until exit, so totals survive threads that finish.
+std::mutex shards_mutex;
+std::vector<std::unique_ptr<Shard>> shards;
+
+Shard &local_shard() {
+    thread_local Shard *shard = [] {
+        std::lock_guard<std::mutex> lock(shards_mutex);
+        shards.push_back(std::make_unique<Shard>());
+        return shards.back().get();
+    }();
+    return *shard;
+}
+
+thread_local QueryScope *current_query = nullptr;
+
+const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+}
+
+size_t LatencyHistogram::bucketOf(uint64_t micros)
+{
+    micros = std::min<uint64_t>(micros, (uint64_t(1) << max_bits) - 1);
+    if (micros < (uint64_t(1) << sub_bits)) {
+        return micros;
+    }
+    int shift = 63 - __builtin_clzll(micros) - (sub_bits - 1);
+    return (size_t(shift) << (sub_bits - 1)) + (micros >> shift);
+}
+
+uint64_t LatencyHistogram::bucketUpper(size_t bucket)
+{
+    if (bucket < (size_t(1) << sub_bits)) {
+        return bucket;
+    }
+    size_t half = size_t(1) << (sub_bits - 1);
+    int shift = bucket / half - 1;
+    uint64_t base = uint64_t(bucket % half + half) << shift;
+    return base + (uint64_t(1) << shift) - 1;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other)
+{
+    for (size_t i = 0; i < bucket_count; ++i) {
+        buckets[i] += other.buckets[i];
+    }
+    count += other.count;
+    sum += other.sum;
+    max = std::max(max, other.max);
+}
+
+uint64_t LatencyHistogram::quantile(double q) const
+{
+    uint64_t total = 0;
+    for (uint64_t n : buckets) {
+        total += n;
+    }
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(q * total + 0.5)), seen = 0;
+    for (size_t i = 0; i < bucket_count; ++i) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            return std::min(bucketUpper(i), max);
+        }
+    }
+    return max;
+}
+
+const char *Metrics::typeName(QueryType type)
+{
+    switch (type) {
+    case QueryType::path:
+        return "path";
+    case QueryType::ped_path:
+        return "ped_path";
+    case QueryType::fuzzy:
+        return "fuzzy";
+    case QueryType::arbitrary:
+        return "arbitrary";
+    case QueryType::matrix:
+        return "matrix";
+    case QueryType::isochrone:
+        return "isochrone";
+    case QueryType::update_weights:
+        return "update_weights";
+    default:
+        return "other";
+    }
+}
+
+const char *Metrics::stageName(Stage stage)
+{
+    switch (stage) {
+    case Stage::total:
+        return "total";
+    case Stage::snap:
+        return "snap";
+    case Stage::search:
+        return "search";
+    default:
+        return "serialize";
+    }
+}
+
+void Metrics::recordStage(QueryType type, Stage stage, Clock::duration elapsed)
+{
+    uint64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    local_shard().stages[size_t(type)][size_t(stage)].record(micros);
+}
+
+void Metrics::recordSearch(QueryType type, uint64_t settled, uint64_t relaxed, uint64_t heap_peak)
+{
+    Shard &shard = local_shard();
+    bump(shard.settled[size_t(type)], settled);
+    bump(shard.relaxed[size_t(type)], relaxed);
+    bump(shard.heap_peak_sum[size_t(type)], heap_peak);
+    raise(shard.heap_peak_max[size_t(type)], heap_peak);
+}
+
+void Metrics::recordQuery(QueryType type, bool failed)
+{
+    Shard &shard = local_shard();
+    bump(shard.queries[size_t(type)], 1);
+    if (failed) {
+        bump(shard.errors[size_t(type)], 1);
+    }
+}
+
+void Metrics::recordCache(CacheEvent event)
+{
+    size_t type = current_query ? size_t(current_query->type) : size_t(QueryType::other);
+    bump(local_shard().cache[type][size_t(event)], 1);
+}
+
+std::array<Metrics::Summary, Metrics::type_count> Metrics::collect()
+{
+    std::array<Summary, type_count> result;
+    std::lock_guard<std::mutex> lock(shards_mutex);
+    for (const auto &shard : shards) {
+        for (size_t t = 0; t < type_count; ++t) {
+            Summary &summary = result[t];
+            summary.queries += read(shard->queries[t]);
+            summary.errors += read(shard->errors[t]);
+            summary.settled += read(shard->settled[t]);
+            summary.relaxed += read(shard->relaxed[t]);
+            summary.heap_peak_sum += read(shard->heap_peak_sum[t]);
+            summary.heap_peak_max = std::max(summary.heap_peak_max, read(shard->heap_peak_max[t]));
+            for (size_t e = 0; e < cache_event_count; ++e) {
+                summary.cache[e] += read(shard->cache[t][e]);
+            }
+            for (size_t s = 0; s < stage_count; ++s) {
+                shard->stages[t][s].addTo(summary.stages[s]);
+            }
+        }
+    }
+    return result;
+}
+
+std::string Metrics::renderText()
+{
+    auto summaries = collect();
+    std::ostringstream out;
+    auto counter = [&](const char *name, const char *help, const char *kind, auto value) {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << kind << "\n";
+        for (size_t t = 0; t < type_count; ++t) {
+            out << name << "{type=\"" << typeName(QueryType(t)) << "\"} " << value(summaries[t]) << "\n";
+        }
+    };
+    counter("map_queries_total", "Requests handled.", "counter", [](const Summary &s) { return s.queries; });
+    counter("map_query_errors_total", "Requests answered with an error.", "counter", [](const Summary &s) { return s.errors; });
+    counter("map_search_settled_total", "Nodes settled by route searches.", "counter", [](const Summary &s) { return s.settled; });
+    counter("map_search_relaxed_total", "Labels improved by edge relaxations.", "counter", [](const Summary &s) { return s.relaxed; });
+    counter("map_search_heap_peak_sum", "Sum over requests of the largest search heap.", "counter",
+            [](const Summary &s) { return s.heap_peak_sum; });
+    counter("map_search_heap_peak_max", "Largest search heap of any request.", "gauge",
+            [](const Summary &s) { return s.heap_peak_max; });
+    counter("map_route_cache_hits_total", "Routes answered from the cache.", "counter",
+            [](const Summary &s) { return s.cache[size_t(CacheEvent::hit)]; });
+    counter("map_route_cache_misses_total", "Route cache lookups that had to search.", "counter",
+            [](const Summary &s) { return s.cache[size_t(CacheEvent::miss)]; });
+    counter("map_route_cache_evictions_total", "Routes dropped from the cache to stay within its budget.", "counter",
+            [](const Summary &s) { return s.cache[size_t(CacheEvent::eviction)]; });
+
+    const char *latency = "map_stage_latency_seconds";
+    out << "# HELP " << latency << " Time spent per request stage.\n# TYPE " << latency << " summary\n";
+    for (size_t t = 0; t < type_count; ++t) {
+        for (size_t s = 0; s < stage_count; ++s) {
+            const LatencyHistogram &histogram = summaries[t].stages[s];
+            string labels = string("type=\"") + typeName(QueryType(t)) + "\",stage=\"" + stageName(Stage(s)) + "\"";
+            for (double q : quantiles) {
+                out << latency << "{" << labels << ",quantile=\"" << q << "\"} " << histogram.quantile(q) / 1e6 << "\n";
+            }
+            out << latency << "_sum{" << labels << "} " << histogram.sum / 1e6 << "\n";
+            out << latency << "_count{" << labels << "} " << histogram.count << "\n";
+        }
+    }
+    return out.str();
+}
+
+Json::Value Metrics::toJson()
+{
+    auto summaries = collect();
+    Json::Value result(Json::objectValue);
+    for (size_t t = 0; t < type_count; ++t) {
+        const Summary &summary = summaries[t];
+        Json::Value entry;
+        entry["queries"] = Json::UInt64(summary.queries);
+        entry["errors"] = Json::UInt64(summary.errors);
+        double n = std::max<uint64_t>(1, summary.queries);
+        entry["settled_avg"] = summary.settled / n;
+        entry["relaxed_avg"] = summary.relaxed / n;
+        entry["heap_peak_avg"] = summary.heap_peak_sum / n;
+        entry["heap_peak_max"] = Json::UInt64(summary.heap_peak_max);
+        entry["cache"]["hits"] = Json::UInt64(summary.cache[size_t(CacheEvent::hit)]);
+        entry["cache"]["misses"] = Json::UInt64(summary.cache[size_t(CacheEvent::miss)]);
+        entry["cache"]["evictions"] = Json::UInt64(summary.cache[size_t(CacheEvent::eviction)]);
+        for (size_t s = 0; s < stage_count; ++s) {
+            const LatencyHistogram &histogram = summary.stages[s];
+            Json::Value stage;
+            stage["count"] = Json::UInt64(histogram.count);
+            stage["mean_ms"] = histogram.count ? histogram.sum / 1e3 / histogram.count : 0.0;
+            stage["p50_ms"] = histogram.quantile(0.5) / 1e3;
+            stage["p90_ms"] = histogram.quantile(0.9) / 1e3;
+            stage["p99_ms"] = histogram.quantile(0.99) / 1e3;
+            stage["p999_ms"] = histogram.quantile(0.999) / 1e3;
+            stage["max_ms"] = histogram.max / 1e3;
+            entry["stages"][stageName(Stage(s))] = stage;
+        }
+        result[typeName(QueryType(t))] = entry;
+    }
+    return result;
+}
+
+QueryScope::QueryScope(QueryType type) : type(type), outer(current_query), start(Clock::now())
+{
+    SearchContext::resetHeapPeak();
+    SearchSpace::Stats stats = SearchContext::stats();
+    settled = stats.settled;
+    relaxed = stats.relaxed;
+    current_query = this;
+}
+
+QueryScope::~QueryScope()
+{
+    SearchSpace::Stats stats = SearchContext::stats();
+    Metrics::recordSearch(type, stats.settled - settled, stats.relaxed - relaxed, stats.heap_peak);
+    Metrics::recordStage(type, Stage::total, Clock::now() - start);
+    Metrics::recordQuery(type, failed);
+    current_query = outer;
+}
+
+StageTimer::~StageTimer()
+{
+    if (current_query) {
+        Metrics::recordStage(current_query->type, stage, Clock::now() - start);
+    }
+}
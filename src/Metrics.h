@@ -0,0 +1,151 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <jsoncpp/json/json.h>
+
+enum class QueryType {
+    path,
+    ped_path,
+    fuzzy,
+    arbitrary,
+    matrix,
+    isochrone,
+    update_weights,
+    other,
+};
+
+enum class Stage {
+    // whole request on the worker, from dispatch to reply
+    total,
+    // name / coordinate to graph node
+    snap,
+    // route, fuzzy, matrix or isochrone search
+    search,
+    // building the response text
+    serialize,
+};
+
+enum class CacheEvent {
+    hit,
+    miss,
+    eviction,
+};
+
+/**
+ * Log-linear latency histogram in microseconds, in the style of HdrHistogram:
+ * values below 2^sub_bits get a bucket each, above that every power of two is
+ * split into 2^(sub_bits - 1) equal buckets, so any recorded value is known to
+ * within about 3%.
+ */
+class LatencyHistogram {
+public:
+    static const int sub_bits = 6;
+    // values are clamped to 2^max_bits - 1 microseconds, about 9.5 hours
+    static const int max_bits = 35;
+    static const size_t bucket_count = (max_bits - sub_bits + 2) << (sub_bits - 1);
+
+    static size_t bucketOf(uint64_t micros);
+
+    // Largest value that falls into the bucket.
+    static uint64_t bucketUpper(size_t bucket);
+
+    std::array<uint64_t, bucket_count> buckets = {};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+
+    void merge(const LatencyHistogram &other);
+
+    // Upper end of the bucket holding the q-quantile, 0 if nothing was recorded.
+    uint64_t quantile(double q) const;
+};
+
+/**
+ * Per query type counters and stage histograms.
+ *
+ * Every thread records into its own shard with relaxed atomic stores (a single
+ * writer needs no read-modify-write), so recording never blocks or contends; a
+ * reader sums the shards on demand.
+ */
+class Metrics {
+public:
+    static const size_t type_count = 8;
+    static const size_t stage_count = 4;
+    static const size_t cache_event_count = 3;
+
+    struct Summary {
+        uint64_t queries = 0;
+        uint64_t errors = 0;
+        uint64_t settled = 0;
+        uint64_t relaxed = 0;
+        uint64_t heap_peak_sum = 0;
+        uint64_t heap_peak_max = 0;
+        // route cache hits / misses / evictions
+        uint64_t cache[cache_event_count] = {};
+        LatencyHistogram stages[stage_count];
+    };
+
+    static const char *typeName(QueryType type);
+    static const char *stageName(Stage stage);
+
+    static void recordStage(QueryType type, Stage stage, std::chrono::steady_clock::duration elapsed);
+    static void recordSearch(QueryType type, uint64_t settled, uint64_t relaxed, uint64_t heap_peak);
+    static void recordQuery(QueryType type, bool failed);
+    // Counted against the current query's type, or "other" outside a query.
+    static void recordCache(CacheEvent event);
+
+    // Sum over all threads' shards.
+    static std::array<Summary, type_count> collect();
+
+    // Prometheus-style text exposition.
+    static std::string renderText();
+
+    static Json::Value toJson();
+};
+
+/**
+ * Times one request on the calling thread. Stage timers opened while it is
+ * alive are attributed to its query type; the destructor records the total and
+ * the search statistics.
+ */
+class QueryScope {
+public:
+    explicit QueryScope(QueryType type);
+    ~QueryScope();
+
+    QueryScope(const QueryScope &) = delete;
+    QueryScope &operator=(const QueryScope &) = delete;
+
+    inline void fail() {
+        failed = true;
+    }
+
+private:
+    QueryType type;
+    QueryScope *outer;
+    std::chrono::steady_clock::time_point start;
+    uint64_t settled, relaxed;
+    bool failed = false;
+
+    friend class Metrics;
+    friend class StageTimer;
+};
+
+// Adds the time until it goes out of scope to a stage of the current query, if any.
+class StageTimer {
+public:
+    explicit StageTimer(Stage stage) : stage(stage), start(std::chrono::steady_clock::now()) {}
+    ~StageTimer();
+
+    StageTimer(const StageTimer &) = delete;
+    StageTimer &operator=(const StageTimer &) = delete;
+
+private:
+    Stage stage;
+    std::chrono::steady_clock::time_point start;
+};
@@ -0,0 +1,160 @@
+#include "NameIndex.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+using std::vector;
+
+namespace {
+
+/*
+ * Bounds for a name scoring at least 100 r against a query of b bytes.
+ *
+ * Align the query with the name (ratio) or with a window of it no longer than the
+ * query (partial_ratio); let L be the length of their longest common subsequence
+ * and m the other side's length. A score of 100 r needs 2L >= r (b + m), which
+ * with L <= min(b, m) gives L >= r b / (2 - r) and b + m >= 2 b / (2 - r).
+ *
+ * Bigrams: every unmatched query byte breaks at most two query bigrams and every
+ * unmatched byte on the other side separates at most one matched pair, so at
+ * least 3L - b - m - 1 >= (1.5 r - 1) 2 b / (2 - r) - 1 of them survive intact.
+ *
+ * Bytes: L is at most the multiset intersection of the query's and the name's bytes.
+ */
+long min_shared_bigrams(size_t length, double r) {
+    if (r <= 2.0 / 3) {
+        return 0;
+    }
+    return static_cast<long>(std::ceil((1.5 * r - 1) * 2 * length / (2 - r) - 1 - 1e-9));
+}
+
+long min_common_bytes(size_t length, double r) {
+    return static_cast<long>(std::ceil(r * length / (2 - r) - 1e-9));
+}
+
+}
+
+NameIndex NameIndex::build(ArrayRef<NamePoint> names, ArrayRef<char> name_text)
+{
+    NameIndex index;
+    auto &offsets = index.owned.offsets;
+    auto &postings = index.owned.postings;
+    offsets.assign(key_count + 1, 0);
+
+    // counting sort: names are visited in order, so every list comes out ascending
+    vector<uint32_t> keys;
+    auto distinct_keys = [&](const NamePoint &point) {
+        std::string_view name(name_text.data() + point.offset, point.length);
+        keys.clear();
+        for (size_t i = 0; i + 1 < name.size(); ++i) {
+            keys.push_back(key(name[i], name[i + 1]));
+        }
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    };
+    for (const NamePoint &name : names) {
+        distinct_keys(name);
+        for (uint32_t k : keys) {
+            ++offsets[k + 1];
+        }
+    }
+    for (size_t k = 0; k < key_count; ++k) {
+        offsets[k + 1] += offsets[k];
+    }
+    postings.resize(offsets.back());
+    vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+    for (uint32_t i = 0; i < names.size(); ++i) {
+        distinct_keys(names[i]);
+        for (uint32_t k : keys) {
+            postings[fill[k]++] = i;
+        }
+    }
+
+    index.offsets = offsets;
+    index.postings = postings;
+    return index;
+}
+
+NameIndex NameIndex::fromSnapshot(const MappedSnapshot &snapshot)
+{
+    NameIndex index;
+    index.offsets = snapshot.get<uint32_t>(SectionId::name_gram_offsets);
+    index.postings = snapshot.get<uint32_t>(SectionId::name_gram_postings);
+    if (index.offsets.size() != key_count + 1 || index.offsets[key_count] != index.postings.size()) {
+        throw std::runtime_error("Snapshot has inconsistent name index sections.");
+    }
+    return index;
+}
+
+void NameIndex::addSections(SnapshotWriter &writer) const
+{
+    writer.add(SectionId::name_gram_offsets, offsets);
+    writer.add(SectionId::name_gram_postings, postings);
+}
+
+bool NameIndex::candidates(std::string_view query, double threshold, ArrayRef<NamePoint> names, ArrayRef<char> name_text,
+                           std::vector<uint32_t> &out) const
+{
+    out.clear();
+    double r = threshold / 100;
+    long min_count = min_shared_bigrams(query.size(), r);
+    long min_common = min_common_bytes(query.size(), r);
+    if (min_common <= 0 || offsets.empty()) {
+        return false;
+    }
+
+    // per-thread counters, reset through the touched list
+    thread_local vector<uint32_t> counts;
+    thread_local vector<uint32_t> touched;
+    if (counts.size() < names.size()) {
+        counts.resize(names.size(), 0);
+    }
+
+    if (min_count > 0) {
+        // repeated query bigrams count once per position, matching the bound
+        for (size_t i = 0; i + 1 < query.size(); ++i) {
+            uint32_t k = key(query[i], query[i + 1]);
+            for (uint32_t p = offsets[k]; p < offsets[k + 1]; ++p) {
+                uint32_t name = postings[p];
+                if (counts[name]++ == 0) {
+                    touched.push_back(name);
+                }
+            }
+        }
+    } else {
+        // too short for the bigram bound, only the byte check below applies
+        for (uint32_t name = 0; name < names.size(); ++name) {
+            touched.push_back(name);
+        }
+    }
+
+    // UTF-8 CJK names share most lead bytes, so the bigram count alone lets many
+    // through; the byte intersection is cheap and far more selective for them
+    uint32_t query_bytes[256] = {};
+    for (char c : query) {
+        ++query_bytes[static_cast<unsigned char>(c)];
+    }
+    uint32_t used[256];
+    for (uint32_t name : touched) {
+        if (counts[name] >= static_cast<unsigned long>(std::max(min_count, 0L))) {
+            std::copy(std::begin(query_bytes), std::end(query_bytes), std::begin(used));
+            long common = 0;
+            const NamePoint &point = names[name];
+            for (uint32_t i = 0; i < point.length && common < min_common; ++i) {
+                uint32_t &left = used[static_cast<unsigned char>(name_text[point.offset + i])];
+                if (left > 0) {
+                    --left;
+                    ++common;
+                }
+            }
+            if (common >= min_common) {
+                out.push_back(name);
+            }
+        }
+        counts[name] = 0;
+    }
+    touched.clear();
+    std::sort(out.begin(), out.end());
+    return true;
+}
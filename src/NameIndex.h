@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+#include "ArrayRef.h"
+#include "Snapshot.h"
+
+// Named place as stored in the snapshot; the name lives in name_text[offset, offset + length)
+struct NamePoint {
+    uint32_t offset;
+    uint32_t length;
+    double lng;
+    double lat;
+};
+
+/**
+ * Inverted index from byte bigrams to the place names containing them, used to
+ * narrow down the names fuzzySearch has to score.
+ *
+ * rapidfuzz compares the UTF-8 names byte by byte, so the index does too: a CJK
+ * character contributes the bigrams inside its three bytes and the two it forms
+ * with its neighbours. Bigram (b1, b2) has key b1 << 8 | b2, so its posting list
+ * is postings[offsets[key], offsets[key + 1]) without any hashing.
+ */
+class NameIndex {
+public:
+    static const size_t key_count = 1 << 16;
+
+    NameIndex() = default;
+    NameIndex(const NameIndex &) = delete;
+    NameIndex &operator=(const NameIndex &) = delete;
+    NameIndex(NameIndex &&) = default;
+    NameIndex &operator=(NameIndex &&) = default;
+
+    static NameIndex build(ArrayRef<NamePoint> names, ArrayRef<char> name_text);
+
+    // Views the sections of a mapped snapshot.
+    static NameIndex fromSnapshot(const MappedSnapshot &snapshot);
+
+    void addSections(SnapshotWriter &writer) const;
+
+    /**
+     * Fills `out` with the ascending indices of every name whose ratio or
+     * partial_ratio against `query` can reach `threshold`. Returns false when the
+     * threshold is too low to rule anything out, in which case every name is a
+     * candidate and `out` is left empty.
+     */
+    bool candidates(std::string_view query, double threshold, ArrayRef<NamePoint> names, ArrayRef<char> name_text,
+                    std::vector<uint32_t> &out) const;
+
+private:
+    ArrayRef<uint32_t> offsets;
+    ArrayRef<uint32_t> postings;
+
+    struct Buffers {
+        std::vector<uint32_t> offsets;
+        std::vector<uint32_t> postings;
+    } owned;
+
+    static inline uint32_t key(char first, char second) {
+        return static_cast<uint32_t>(static_cast<unsigned char>(first)) << 8 | static_cast<unsigned char>(second);
+    }
+};
@@ -18,14 +18,17 @@ double calculate_distance(double lng1, double lat1, double lng2, double lat2)
     double radLat2 = rad(lat2);
     double a = radLat1 - radLat2;
     double b = rad(lng1) - rad(lng2);
-    double s = 2 * std::asin(std::sqrt(std::pow(std::sin(a / 2), 2) + std::cos(radLat1) * std::cos(radLat2) * std::pow(std::sin(b / 2), 2)));
-    s = s * R;
-    s = std::round(s * 10000) / 10000;
-    return s;
+    double sin_a = std::sin(a / 2), sin_b = std::sin(b / 2);
+    double s = 2 * std::asin(std::min(1.0, std::sqrt(sin_a * sin_a + std::cos(radLat1) * std::cos(radLat2) * sin_b * sin_b)));
+    return s * R;
+}
+
+double calculate_distance(const Coord &coord1, const Coord &coord2) {
+    return calculate_distance(coord1.getLng(), coord1.getLat(), coord2.getLng(), coord2.getLat());
 }
 
 double calculate_distance(const Node& node1, const Node &node2) {
-    return calculate_distance(node1.lng, node1.lat, node2.lng, node2.lat);
+    return calculate_distance(node1.coord, node2.coord);
 }
 
 double calculate_weighted_distance(const Node& node1, const Node &node2) {
@@ -41,23 +44,21 @@ double calculate_weighted_distance(const Node& node1, const Node &node2) {
             w *= punish;
         }
     }
-    return calculate_distance(node1.lng, node1.lat, node2.lng, node2.lat) * w;
+    return calculate_distance(node1.coord, node2.coord) * w;
 }
 
 bool operator==(const Node &n1, const Node &n2) {
-    return n1.lat == n2.lat && n1.lng == n2.lng ;
+    return n1.coord == n2.coord;
 }
 
 void Node::serialize(std::ofstream &out) const
 {
-    out.write(reinterpret_cast<const char*>(&lng), sizeof(lng));
-    out.write(reinterpret_cast<const char*>(&lat), sizeof(lat));
+    out.write(reinterpret_cast<const char*>(&coord), sizeof(coord));
     out.write(reinterpret_cast<const char*>(&weight), sizeof(weight));
 }
 
 void Node::deserialize(std::ifstream &in)
 {
-    in.read(reinterpret_cast<char *>(&lng), sizeof(lng));
-    in.read(reinterpret_cast<char *>(&lat), sizeof(lat));
+    in.read(reinterpret_cast<char *>(&coord), sizeof(coord));
     in.read(reinterpret_cast<char *>(&weight), sizeof(weight));
 }
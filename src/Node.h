@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cmath>
+#include <cstdint>
 #include <fstream>
 #include <string>
 #include <tuple>
@@ -36,6 +38,48 @@ enum priority {
 //     footway = 100,
 // };
 
+/**
+ * Fixed-point position: lng and lat in units of 1e-7 degrees (about 1 cm), the
+ * precision OpenStreetMap stores coordinates with, so GeoJSON input round-trips
+ * exactly. Eight bytes, and equal positions compare equal bit for bit.
+ */
+struct Coord {
+    static constexpr double scale = 1e7;
+
+    int32_t lng, lat;
+
+    static inline int32_t toFixed(double degrees) {
+        return static_cast<int32_t>(std::lround(degrees * scale));
+    }
+
+    static inline Coord fromDegrees(double lng, double lat) {
+        return {toFixed(lng), toFixed(lat)};
+    }
+
+    inline double getLng() const {
+        return lng / scale;
+    }
+
+    inline double getLat() const {
+        return lat / scale;
+    }
+
+    // by lng, then lat
+    inline bool operator<(const Coord &other) const {
+        return std::tie(lng, lat) < std::tie(other.lng, other.lat);
+    }
+
+    inline bool operator==(const Coord &other) const {
+        return lng == other.lng && lat == other.lat;
+    }
+
+    inline bool operator!=(const Coord &other) const {
+        return !(*this == other);
+    }
+};
+
+static_assert(sizeof(Coord) == 8, "Coord is stored in snapshots as is and must be tightly packed");
+
 class Node
 {
     friend double calculate_distance(const Node& node1, const Node &node2); 
@@ -43,23 +87,27 @@ class Node
     friend bool operator==(const Node &n1, const Node &n2);
 public:
     Node() = default;
-    Node(double _lng, double _lat) : lng(_lng), lat(_lat), weight(unknown) {}
+    // degrees are rounded to the fixed-point grid of Coord
+    Node(double _lng, double _lat) : coord(Coord::fromDegrees(_lng, _lat)), weight(unknown) {}
     Node(const std::pair<double, double> &coord) : Node(coord.first, coord.second) {}
-    Node(double _lng, double _lat, priority w) : lng(_lng), lat(_lat), weight(w) {}
-    Node(const std::pair<double, double> &coord, priority w) : lng(coord.first), lat(coord.second), weight(w) {}
-    
+    Node(double _lng, double _lat, priority w) : coord(Coord::fromDegrees(_lng, _lat)), weight(w) {}
+    Node(const std::pair<double, double> &coord, priority w) : Node(coord.first, coord.second, w) {}
+    Node(const Coord &_coord, priority w = unknown) : coord(_coord), weight(w) {}
+
     inline double getLng() const {
-        return lng;
+        return coord.getLng();
     }
-    
+
     inline double getLat() const {
-        return lat;
+        return coord.getLat();
+    }
+
+    inline const Coord &getCoord() const {
+        return coord;
     }
 
-    // TODO: change to hashmap or a better comparison method
     bool operator<(const Node &other) const{
-        // return ((this->lat * 114) + (this->lng)) < (other.lat * 114 + other.lng);
-        return std::tie(lng, lat) < std::tie(other.lng, other.lat);
+        return coord < other.coord;
     }
 
     void serialize(std::ofstream &out) const;
@@ -67,11 +115,12 @@ public:
     void deserialize(std::ifstream &in);
 
 private:
-    double lng, lat;
+    Coord coord;
     priority weight;
 };
 
 bool operator==(const Node &n1, const Node &n2);
 double calculate_distance(const Node& node1, const Node &node2); 
 double calculate_distance(double lng1, double lat1, double lng2, double lat2);
+double calculate_distance(const Coord &coord1, const Coord &coord2);
 double calculate_weighted_distance(const Node& node1, const Node &node2);
\ No newline at end of file
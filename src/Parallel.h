@@ -0,0 +1,86 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <iterator>
+#include <thread>
+#include <vector>
+
+// Threads used by the offline build steps.
+inline size_t build_threads() {
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+/**
+ * Splits [0, n) into one contiguous slice per thread and runs
+ * f(thread, begin, end) on each; returns once all slices are done. The first
+ * exception thrown by a slice is rethrown on the calling thread.
+ */
+template <class F>
+void parallel_for(size_t n, size_t threads, F f) {
+    threads = std::max<size_t>(1, std::min(threads, n));
+    if (threads == 1) {
+        f(0, 0, n);
+        return;
+    }
+    std::vector<std::thread> pool;
+    std::vector<std::exception_ptr> errors(threads);
+    for (size_t t = 0; t < threads; ++t) {
+        size_t begin = n * t / threads, end = n * (t + 1) / threads;
+        pool.emplace_back([&f, &errors, t, begin, end]() {
+            try {
+                f(t, begin, end);
+            } catch (...) {
+                errors[t] = std::current_exception();
+            }
+        });
+    }
+    for (auto &thread : pool) {
+        thread.join();
+    }
+    for (auto &error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+/**
+ * Sorts chunks on separate threads, then merges neighbouring runs pairwise,
+ * each round in parallel.
+ */
+template <class It, class Cmp>
+void parallel_sort(It first, It last, Cmp cmp, size_t threads = build_threads()) {
+    size_t n = std::distance(first, last);
+    // below this a single std::sort is faster than spawning threads
+    if (threads <= 1 || n < (1u << 16)) {
+        std::sort(first, last, cmp);
+        return;
+    }
+    std::vector<size_t> bounds;
+    for (size_t t = 0; t <= threads; ++t) {
+        bounds.push_back(n * t / threads);
+    }
+    parallel_for(threads, threads, [&](size_t, size_t begin, size_t end) {
+        for (size_t t = begin; t < end; ++t) {
+            std::sort(first + bounds[t], first + bounds[t + 1], cmp);
+        }
+    });
+    while (bounds.size() > 2) {
+        std::vector<size_t> merged;
+        size_t pairs = (bounds.size() - 1) / 2;
+        parallel_for(pairs, threads, [&](size_t, size_t begin, size_t end) {
+            for (size_t p = begin; p < end; ++p) {
+                std::inplace_merge(first + bounds[2 * p], first + bounds[2 * p + 1], first + bounds[2 * p + 2], cmp);
+            }
+        });
+        for (size_t i = 0; i < bounds.size(); i += 2) {
+            merged.push_back(bounds[i]);
+        }
+        if (merged.back() != bounds.back()) {
+            merged.push_back(bounds.back());
+        }
+        bounds.swap(merged);
+    }
+}
@@ -0,0 +1,176 @@
+#include "PriorityQueue.h"
+
+#include <cmath>
+
+void IndexedDaryHeap::resize(size_t n)
+{
+    if (position.size() < n) {
+        position.resize(n, npos);
+    }
+}
+
+void IndexedDaryHeap::clear()
+{
+    for (const auto &item : heap) {
+        position[item.second] = npos;
+    }
+    heap.clear();
+}
+
+void IndexedDaryHeap::push(double key, uint32_t v)
+{
+    uint32_t i = position[v];
+    if (i == npos) {
+        i = heap.size();
+        heap.push_back({key, v});
+        position[v] = i;
+    } else if (key < heap[i].first) {
+        heap[i].first = key;
+    } else {
+        return;
+    }
+    siftUp(i);
+}
+
+void IndexedDaryHeap::pop()
+{
+    position[heap.front().second] = npos;
+    if (heap.size() > 1) {
+        heap.front() = heap.back();
+        position[heap.front().second] = 0;
+        heap.pop_back();
+        siftDown(0);
+    } else {
+        heap.pop_back();
+    }
+}
+
+void IndexedDaryHeap::siftUp(size_t i)
+{
+    QueueItem item = heap[i];
+    while (i > 0) {
+        size_t parent = (i - 1) / arity;
+        if (!(item < heap[parent])) {
+            break;
+        }
+        heap[i] = heap[parent];
+        position[heap[i].second] = i;
+        i = parent;
+    }
+    heap[i] = item;
+    position[item.second] = i;
+}
+
+void IndexedDaryHeap::siftDown(size_t i)
+{
+    QueueItem item = heap[i];
+    size_t n = heap.size();
+    while (true) {
+        size_t first = i * arity + 1;
+        if (first >= n) {
+            break;
+        }
+        size_t best = first;
+        for (size_t c = first + 1; c < std::min(first + arity, n); ++c) {
+            if (heap[c] < heap[best]) {
+                best = c;
+            }
+        }
+        if (!(heap[best] < item)) {
+            break;
+        }
+        heap[i] = heap[best];
+        position[heap[i].second] = i;
+        i = best;
+    }
+    heap[i] = item;
+    position[item.second] = i;
+}
+
+uint64_t RadixHeap::radixOf(double key)
+{
+    // clamped so that llround stays defined
+    double scaled = std::max(-9e18, std::min(9e18, key * scale));
+    return static_cast<uint64_t>(std::llround(scaled)) ^ (uint64_t(1) << 63);
+}
+
+void RadixHeap::resize(size_t n)
+{
+    if (position.size() < n) {
+        position.resize(n, npos);
+        bucket.resize(n, 0);
+    }
+}
+
+void RadixHeap::clear()
+{
+    for (auto &entries : buckets) {
+        for (const auto &entry : entries) {
+            position[entry.item.second] = npos;
+        }
+        entries.clear();
+    }
+    last = 0;
+    count = 0;
+}
+
+void RadixHeap::insert(const Entry &entry)
+{
+    size_t b = bucketOf(entry.radix);
+    position[entry.item.second] = buckets[b].size();
+    bucket[entry.item.second] = static_cast<uint8_t>(b);
+    buckets[b].push_back(entry);
+}
+
+void RadixHeap::remove(uint32_t v)
+{
+    std::vector<Entry> &entries = buckets[bucket[v]];
+    uint32_t i = position[v];
+    entries[i] = entries.back();
+    position[entries[i].item.second] = i;
+    entries.pop_back();
+    position[v] = npos;
+}
+
+void RadixHeap::push(double key, uint32_t v)
+{
+    uint64_t radix = std::max(radixOf(key), last);
+    if (position[v] != npos) {
+        const Entry &queued = buckets[bucket[v]][position[v]];
+        if (!(key < queued.item.first)) {
+            return;
+        }
+        remove(v);
+        --count;
+    }
+    insert({{key, v}, radix});
+    ++count;
+}
+
+void RadixHeap::pop()
+{
+    if (buckets[0].empty()) {
+        refill();
+    }
+    position[buckets[0].back().item.second] = npos;
+    buckets[0].pop_back();
+    --count;
+}
+
+void RadixHeap::refill()
+{
+    size_t b = 1;
+    while (buckets[b].empty()) {
+        ++b;
+    }
+    std::vector<Entry> &entries = buckets[b];
+    last = entries.front().radix;
+    for (const auto &entry : entries) {
+        last = std::min(last, entry.radix);
+    }
+    // every entry of bucket b now differs from last in a lower bit
+    for (const auto &entry : entries) {
+        insert(entry);
+    }
+    entries.clear();
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <utility>
+#include <vector>
+
+/**
+ * Min-priority queues of (key, node id) used by SearchSpace.
+ *
+ * All of them share one interface:
+ *
+ *   resize(n)        make room for node ids below n
+ *   clear()          drop every entry, keeping the memory
+ *   push(key, v)     insert v, or lower its key if it is already queued
+ *   top(), pop()     smallest key first
+ *
+ * The indexed queues keep a position per node id, so an improved label moves its
+ * entry instead of adding a second one and nothing stale is ever popped. Which one
+ * SearchSpace uses is chosen at compile time, see SearchQueue below.
+ */
+
+using QueueItem = std::pair<double, uint32_t>;
+
+// Binary heap with lazy deletion: every push adds an entry and outdated ones are
+// skipped by the caller when they come out.
+class LazyBinaryHeap {
+public:
+    static constexpr const char *name = "binary heap (lazy)";
+
+    inline void resize(size_t) {}
+
+    inline void clear() {
+        heap.clear();
+    }
+
+    inline bool empty() const {
+        return heap.empty();
+    }
+
+    inline size_t size() const {
+        return heap.size();
+    }
+
+    inline const QueueItem &top() {
+        return heap.front();
+    }
+
+    inline void push(double key, uint32_t v) {
+        heap.push_back({key, v});
+        std::push_heap(heap.begin(), heap.end(), std::greater<QueueItem>());
+    }
+
+    inline void pop() {
+        std::pop_heap(heap.begin(), heap.end(), std::greater<QueueItem>());
+        heap.pop_back();
+    }
+
+private:
+    std::vector<QueueItem> heap;
+};
+
+// 4-ary heap with decrease-key. Four children share a cache line of the array,
+// and the tree is half as deep as a binary one.
+class IndexedDaryHeap {
+public:
+    static constexpr const char *name = "4-ary heap (indexed)";
+
+    void resize(size_t n);
+
+    void clear();
+
+    inline bool empty() const {
+        return heap.empty();
+    }
+
+    inline size_t size() const {
+        return heap.size();
+    }
+
+    inline const QueueItem &top() {
+        return heap.front();
+    }
+
+    // A key no smaller than the queued one is ignored.
+    void push(double key, uint32_t v);
+
+    void pop();
+
+private:
+    static constexpr size_t arity = 4;
+    static constexpr uint32_t npos = std::numeric_limits<uint32_t>::max();
+
+    void siftUp(size_t i);
+    void siftDown(size_t i);
+
+    std::vector<QueueItem> heap;
+    // node id -> index in heap, npos when not queued
+    std::vector<uint32_t> position;
+};
+
+/**
+ * Radix heap over keys scaled to integers (1/1000 of a cost unit), with
+ * decrease-key. Entries sit in buckets by the highest bit in which their key
+ * differs from the last key popped; only the lowest non-empty bucket is ever
+ * sorted out, so each entry moves O(log C) times in total.
+ *
+ * It relies on keys never going below the last one popped, which holds for
+ * Dijkstra, CH and A* with a consistent heuristic. A smaller key (an inflated
+ * A* heuristic) is treated as equal to the last one and popped next. Keys that
+ * differ by less than the scale may come out in either order.
+ */
+class RadixHeap {
+public:
+    static constexpr const char *name = "radix heap (indexed)";
+
+    void resize(size_t n);
+
+    void clear();
+
+    inline bool empty() const {
+        return count == 0;
+    }
+
+    inline size_t size() const {
+        return count;
+    }
+
+    inline const QueueItem &top() {
+        if (buckets[0].empty()) {
+            refill();
+        }
+        return buckets[0].back().item;
+    }
+
+    // A key no smaller than the queued one is ignored.
+    void push(double key, uint32_t v);
+
+    void pop();
+
+private:
+    static constexpr double scale = 1000;
+    static constexpr uint32_t npos = std::numeric_limits<uint32_t>::max();
+
+    struct Entry {
+        QueueItem item;
+        uint64_t radix;
+    };
+
+    // order-preserving map of the scaled key to an unsigned integer
+    static uint64_t radixOf(double key);
+
+    inline size_t bucketOf(uint64_t radix) const {
+        uint64_t diff = radix ^ last;
+        return diff == 0 ? 0 : 64 - __builtin_clzll(diff);
+    }
+
+    void insert(const Entry &entry);
+    void remove(uint32_t v);
+    // moves the smallest keys into bucket 0
+    void refill();
+
+    std::array<std::vector<Entry>, 65> buckets;
+    uint64_t last = 0;
+    size_t count = 0;
+    // node id -> bucket and index in it, npos when not queued
+    std::vector<uint32_t> position;
+    std::vector<uint8_t> bucket;
+};
+
+// -DMAP_SEARCH_QUEUE_BINARY or -DMAP_SEARCH_QUEUE_RADIX pick another queue for
+// every search; the indexed 4-ary heap is the default.
+#if defined(MAP_SEARCH_QUEUE_BINARY)
+using SearchQueue = LazyBinaryHeap;
+#elif defined(MAP_SEARCH_QUEUE_RADIX)
+using SearchQueue = RadixHeap;
+#else
+using SearchQueue = IndexedDaryHeap;
+#endif
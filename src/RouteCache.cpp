@@ -0,0 +1,81 @@
+#include "RouteCache.h"
+#include "Metrics.h"
+
+#include <algorithm>
+
+namespace {
+
+// Rough per-entry bookkeeping on top of the text: list node, map node, string header.
+const size_t entry_overhead = 128;
+
+}
+
+RouteCache::RouteCache(size_t capacity_bytes, size_t shard_count)
+    : shard_capacity(capacity_bytes / std::max<size_t>(1, shard_count))
+{
+    for (size_t i = 0; i < std::max<size_t>(1, shard_count); ++i) {
+        shards.push_back(std::make_unique<Shard>());
+    }
+}
+
+RouteCache::Shard &RouteCache::shardOf(const Key &key)
+{
+    // the low bits feed the bucket choice inside the shard, use the high ones here
+    return *shards[(KeyHash()(key) >> 40) % shards.size()];
+}
+
+RouteCache::Value RouteCache::get(const Key &key)
+{
+    if (!enabled()) {
+        return nullptr;
+    }
+    Shard &shard = shardOf(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(key);
+    if (it == shard.index.end()) {
+        Metrics::recordCache(CacheEvent::miss);
+        return nullptr;
+    }
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    Metrics::recordCache(CacheEvent::hit);
+    return it->second->value;
+}
+
+void RouteCache::put(const Key &key, std::string response)
+{
+    size_t size = response.size() + entry_overhead;
+    if (size > shard_capacity) {
+        return;
+    }
+    Value value = std::make_shared<const std::string>(std::move(response));
+
+    Shard &shard = shardOf(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(key);
+    if (it != shard.index.end()) {
+        // another worker computed the same route meanwhile
+        shard.bytes -= it->second->value->size() + entry_overhead;
+        shard.lru.erase(it->second);
+        shard.index.erase(it);
+    }
+    while (shard.bytes + size > shard_capacity) {
+        const Entry &victim = shard.lru.back();
+        shard.bytes -= victim.value->size() + entry_overhead;
+        shard.index.erase(victim.key);
+        shard.lru.pop_back();
+        Metrics::recordCache(CacheEvent::eviction);
+    }
+    shard.lru.push_front(Entry{key, std::move(value)});
+    shard.index.emplace(key, shard.lru.begin());
+    shard.bytes += size;
+}
+
+void RouteCache::clear()
+{
+    for (auto &shard : shards) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        shard->lru.clear();
+        shard->index.clear();
+        shard->bytes = 0;
+    }
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Bounded LRU cache of serialized route responses.
+ *
+ * Keyed by the snapped start and goal node ids, the routing profile, the
+ * response encoding and the metric version of the graph (Graph::metricVersion),
+ * so different names that snap to the same nodes share an entry and a route
+ * computed before a weight update is never served after it. The budget is
+ * in bytes of response text and split evenly over independently locked
+ * shards, so concurrent workers rarely wait on each other.
+ *
+ * Node ids are only meaningful for one build of a graph: call clear() whenever
+ * a graph is loaded. A weight update needs no clear(): entries of the old metric
+ * version are no longer hit and age out of the LRU.
+ */
+class RouteCache {
+public:
+    struct Key {
+        uint32_t start;
+        uint32_t goal;
+        uint32_t profile;
+        // RouteEncoding::key()
+        uint32_t format = 0;
+        uint32_t metric = 0;
+
+        bool operator==(const Key &other) const {
+            return start == other.start && goal == other.goal && profile == other.profile && format == other.format
+                && metric == other.metric;
+        }
+    };
+
+    using Value = std::shared_ptr<const std::string>;
+
+    // A capacity of 0 disables the cache.
+    explicit RouteCache(size_t capacity_bytes, size_t shard_count = 16);
+
+    // Counts a hit or a miss; null on a miss.
+    Value get(const Key &key);
+
+    void put(const Key &key, std::string response);
+
+    void clear();
+
+    inline bool enabled() const {
+        return shard_capacity > 0;
+    }
+
+private:
+    struct KeyHash {
+        size_t operator()(const Key &key) const {
+            uint64_t h = (uint64_t(key.start) << 32 | key.goal) * 0x9e3779b97f4a7c15ull;
+            return size_t(h ^ (h >> 29) ^ key.profile ^ (uint64_t(key.format) << 8) ^ (uint64_t(key.metric) << 16));
+        }
+    };
+
+    struct Entry {
+        Key key;
+        Value value;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        // most recently used first
+        std::list<Entry> lru;
+        std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index;
+        size_t bytes = 0;
+    };
+
+    Shard &shardOf(const Key &key);
+
+    size_t shard_capacity;
+    std::vector<std::unique_ptr<Shard>> shards;
+};
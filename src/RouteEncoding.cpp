@@ -0,0 +1,160 @@
+#include "RouteEncoding.h"
+
+#include <charconv>
+#include <stdexcept>
+
+namespace {
+
+const uint8_t binary_version = 1;
+
+// Fixed-point degrees as decimal text, trailing zeros dropped; the same digits the
+// GeoJSON input had, without a detour through double.
+void append_fixed(int32_t value, std::string &out) {
+    int64_t v = value;
+    if (v < 0) {
+        out.push_back('-');
+        v = -v;
+    }
+    int64_t unit = static_cast<int64_t>(Coord::scale);
+    char buffer[32];
+    auto result = std::to_chars(buffer, buffer + sizeof(buffer), v / unit);
+    out.append(buffer, result.ptr);
+    int64_t fraction = v % unit;
+    if (fraction == 0) {
+        return;
+    }
+    char digits[8];
+    for (int i = 6; i >= 0; --i) {
+        digits[i] = static_cast<char>('0' + fraction % 10);
+        fraction /= 10;
+    }
+    int length = 7;
+    while (digits[length - 1] == '0') {
+        --length;
+    }
+    out.push_back('.');
+    out.append(digits, length);
+}
+
+// value / divisor rounded half away from zero, like llround
+inline int64_t round_div(int64_t value, int64_t divisor) {
+    return (value >= 0 ? value + divisor / 2 : value - divisor / 2) / divisor;
+}
+
+void append_varint(uint64_t value, std::string &out) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+inline uint64_t zigzag(int64_t value) {
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+void append_polyline_value(int64_t delta, std::string &out) {
+    uint64_t value = zigzag(delta);
+    while (value >= 0x20) {
+        char c = static_cast<char>((0x20 | (value & 0x1F)) + 63);
+        // the only character of the alphabet that needs escaping in a JSON string
+        if (c == '\\') {
+            out.push_back('\\');
+        }
+        out.push_back(c);
+        value >>= 5;
+    }
+    char c = static_cast<char>(value + 63);
+    if (c == '\\') {
+        out.push_back('\\');
+    }
+    out.push_back(c);
+}
+
+}
+
+RouteEncoding parse_route_encoding(const std::string &format, int precision)
+{
+    RouteEncoding encoding;
+    if (format.empty() || format == "geojson") {
+        encoding.format = RouteFormat::geojson;
+    } else if (format == "polyline") {
+        encoding.format = RouteFormat::polyline;
+    } else if (format == "binary") {
+        encoding.format = RouteFormat::binary;
+    } else {
+        throw std::runtime_error("Unknown route format: " + format);
+    }
+    if (precision < 1 || precision > 7) {
+        throw std::runtime_error("Polyline precision must be between 1 and 7.");
+    }
+    // only the polyline uses it, keep the others on one cache key
+    encoding.precision = encoding.format == RouteFormat::polyline ? precision : 0;
+    return encoding;
+}
+
+void write_route_geojson(const std::vector<Node> &path, std::string &out)
+{
+    out += "{\"type\":\"FeatureCollection\",\"features\":[{\"type\":\"Feature\",\"properties\":{},"
+           "\"geometry\":{\"type\":\"LineString\",\"coordinates\":[";
+    for (size_t i = 0; i < path.size(); ++i) {
+        out += i == 0 ? "[" : ",[";
+        append_fixed(path[i].getCoord().lng, out);
+        out += ',';
+        append_fixed(path[i].getCoord().lat, out);
+        out += ']';
+    }
+    out += "]}}]}";
+}
+
+void write_route_polyline(const std::vector<Node> &path, int precision, std::string &out)
+{
+    // fixed-point units per polyline unit
+    int64_t divisor = 1;
+    for (int i = precision; i < 7; ++i) {
+        divisor *= 10;
+    }
+    out += "{\"format\":\"polyline\",\"precision\":";
+    out += std::to_string(precision);
+    out += ",\"points\":";
+    out += std::to_string(path.size());
+    out += ",\"polyline\":\"";
+    int64_t last_lat = 0, last_lng = 0;
+    for (const Node &node : path) {
+        int64_t lat = round_div(node.getCoord().lat, divisor), lng = round_div(node.getCoord().lng, divisor);
+        append_polyline_value(lat - last_lat, out);
+        append_polyline_value(lng - last_lng, out);
+        last_lat = lat;
+        last_lng = lng;
+    }
+    out += "\"}";
+}
+
+void write_route_binary(const std::vector<Node> &path, std::string &out)
+{
+    out.push_back(static_cast<char>(binary_version));
+    append_varint(path.size(), out);
+    int64_t last_lng = 0, last_lat = 0;
+    for (const Node &node : path) {
+        int64_t lng = node.getCoord().lng, lat = node.getCoord().lat;
+        append_varint(zigzag(lng - last_lng), out);
+        append_varint(zigzag(lat - last_lat), out);
+        last_lng = lng;
+        last_lat = lat;
+    }
+}
+
+void write_route(const std::vector<Node> &path, const RouteEncoding &encoding, std::string &out)
+{
+    switch (encoding.format) {
+    case RouteFormat::polyline:
+        write_route_polyline(path, encoding.precision, out);
+        break;
+    case RouteFormat::binary:
+        write_route_binary(path, out);
+        break;
+    default:
+        write_route_geojson(path, out);
+        break;
+    }
+}
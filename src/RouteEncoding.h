@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "Node.h"
+
+enum class RouteFormat {
+    // {"type": "FeatureCollection", ...} with one LineString feature
+    geojson,
+    // {"format": "polyline", "precision": p, "points": n, "polyline": "..."}
+    polyline,
+    // delta-encoded frame, see write_route_binary
+    binary,
+};
+
+// How a route reply is encoded, negotiated per request.
+struct RouteEncoding {
+    RouteFormat format = RouteFormat::geojson;
+    // decimal digits kept by the polyline encoding
+    int precision = 5;
+
+    // Distinct per format and precision, for cache keys.
+    inline uint32_t key() const {
+        return static_cast<uint32_t>(format) << 8 | static_cast<uint32_t>(precision);
+    }
+};
+
+// Parses "geojson", "polyline" or "binary"; throws std::runtime_error for anything
+// else or a precision outside [1, 7].
+RouteEncoding parse_route_encoding(const std::string &format, int precision);
+
+// The writers append to out without clearing it, so callers can reuse one buffer.
+
+void write_route_geojson(const std::vector<Node> &path, std::string &out);
+
+// Google's encoded polyline algorithm (lat before lng) wrapped in a JSON object.
+void write_route_polyline(const std::vector<Node> &path, int precision, std::string &out);
+
+/**
+ * Binary route body, little-endian:
+ *   uint8   format version (1)
+ *   varint  point count
+ *   per point: zigzag varint delta of lng, then of lat, in units of 1e-7 degrees,
+ *   relative to the previous point (the first to 0, 0)
+ */
+void write_route_binary(const std::vector<Node> &path, std::string &out);
+
+void write_route(const std::vector<Node> &path, const RouteEncoding &encoding, std::string &out);
@@ -0,0 +1,66 @@
+#include "SearchContext.h"
+
+void SearchSpace::reset(size_t n)
+{
+    queue.clear();
+    queue.resize(n);
+    if (labels.size() < n) {
+        labels.resize(n);
+        stamp.resize(n, generation);
+        settled_stamp.resize(n, generation);
+    }
+    if (++generation == 0) {
+        // counter wrapped: old stamps could look current again
+        std::fill(stamp.begin(), stamp.end(), 0);
+        std::fill(settled_stamp.begin(), settled_stamp.end(), 0);
+        generation = 1;
+    }
+}
+
+std::vector<SearchSpace::node_id> SearchSpace::walkParents(node_id v) const
+{
+    std::vector<node_id> path;
+    while (v != npos) {
+        path.push_back(v);
+        v = parent(v);
+    }
+    return path;
+}
+
+namespace {
+
+SearchContext &thread_context()
+{
+    thread_local SearchContext context;
+    return context;
+}
+
+}
+
+SearchContext &SearchContext::local(size_t n)
+{
+    SearchContext &context = thread_context();
+    context.forward.reset(n);
+    context.backward.reset(n);
+    return context;
+}
+
+SearchSpace::Stats SearchContext::stats()
+{
+    const SearchContext &context = thread_context();
+    SearchSpace::Stats total = context.forward.stats();
+    const SearchSpace::Stats &backward = context.backward.stats();
+    total.settled += backward.settled;
+    total.relaxed += backward.relaxed;
+    total.pushes += backward.pushes;
+    total.pops += backward.pops;
+    total.heap_peak = std::max(total.heap_peak, backward.heap_peak);
+    return total;
+}
+
+void SearchContext::resetHeapPeak()
+{
+    SearchContext &context = thread_context();
+    context.forward.resetHeapPeak();
+    context.backward.resetHeapPeak();
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <utility>
+#include <vector>
+#include "PriorityQueue.h"
+
+/**
+ * Labels and queue of one search direction.
+ *
+ * Arrays are indexed by node id and only ever grow. A label is valid while its
+ * stamp equals the current generation, so starting a new query bumps a counter
+ * instead of refilling O(V) entries. The queue keeps its capacity across queries;
+ * with an indexed one (the default) pushing an already queued node lowers its key
+ * rather than adding an entry.
+ */
+class SearchSpace {
+public:
+    using node_id = uint32_t;
+    static constexpr node_id npos = std::numeric_limits<node_id>::max();
+    using QueueItem = ::QueueItem;
+
+    // the SearchQueue implementation this build uses
+    static constexpr const char *queue_name = SearchQueue::name;
+
+    // Running totals of this thread's searches in this direction, never reset,
+    // except heap_peak: the largest heap since the last resetHeapPeak().
+    struct Stats {
+        uint64_t settled = 0;
+        // labels improved by an edge relaxation
+        uint64_t relaxed = 0;
+        uint64_t pushes = 0;
+        uint64_t pops = 0;
+        uint64_t heap_peak = 0;
+    };
+
+    void reset(size_t n);
+
+    inline const Stats &stats() const {
+        return counters;
+    }
+
+    inline void resetHeapPeak() {
+        counters.heap_peak = 0;
+    }
+
+    inline double dist(node_id v) const {
+        return stamp[v] == generation ? labels[v].dist : std::numeric_limits<double>::infinity();
+    }
+
+    // queue key the label was last pushed with, for skipping stale heap entries
+    inline double key(node_id v) const {
+        return stamp[v] == generation ? labels[v].key : std::numeric_limits<double>::infinity();
+    }
+
+    inline node_id parent(node_id v) const {
+        return stamp[v] == generation ? labels[v].parent : npos;
+    }
+
+    // edge used to reach v, as an index into whatever edge arrays the search walks
+    inline uint32_t edge(node_id v) const {
+        return labels[v].edge;
+    }
+
+    inline void update(node_id v, double dist, double key, node_id parent, uint32_t edge = 0) {
+        stamp[v] = generation;
+        labels[v] = {dist, key, parent, edge};
+        ++counters.relaxed;
+    }
+
+    inline bool settled(node_id v) const {
+        return settled_stamp[v] == generation;
+    }
+
+    inline void settle(node_id v) {
+        settled_stamp[v] = generation;
+        ++counters.settled;
+    }
+
+    inline bool empty() const {
+        return queue.empty();
+    }
+
+    // not const: a radix heap sorts out its lowest bucket on demand
+    inline const QueueItem &top() {
+        return queue.top();
+    }
+
+    inline void push(double key, node_id v) {
+        queue.push(key, v);
+        ++counters.pushes;
+        counters.heap_peak = std::max<uint64_t>(counters.heap_peak, queue.size());
+    }
+
+    inline void pop() {
+        ++counters.pops;
+        queue.pop();
+    }
+
+    // Node ids from v back to the root of the search.
+    std::vector<node_id> walkParents(node_id v) const;
+
+private:
+    struct Label {
+        double dist;
+        double key;
+        node_id parent;
+        uint32_t edge;
+    };
+
+    std::vector<Label> labels;
+    std::vector<uint32_t> stamp;
+    std::vector<uint32_t> settled_stamp;
+    uint32_t generation = 0;
+    SearchQueue queue;
+    Stats counters;
+};
+
+/**
+ * Search workspace owned by one thread, shared by every query that thread runs
+ * (A*, bidirectional A*, CH), so memory is allocated once per worker.
+ */
+class SearchContext {
+public:
+    SearchSpace forward;
+    SearchSpace backward;
+
+    // The calling thread's context, reset for a graph of n nodes.
+    static SearchContext &local(size_t n);
+
+    // Totals of both directions over every search the calling thread ran; the heap
+    // peak is the larger of the two.
+    static SearchSpace::Stats stats();
+
+    static void resetHeapPeak();
+};
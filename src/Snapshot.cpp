@@ -0,0 +1,160 @@
+#include "Snapshot.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const char snapshot_magic[8] = {'D', 'S', 'P', 'J', 'S', 'N', 'A', 'P'};
+
+const uint64_t page_size = 4096;
+
+uint64_t align_up(uint64_t offset) {
+    return (offset + page_size - 1) / page_size * page_size;
+}
+
+}
+
+// FNV-1a over 64-bit words, then the tail bytes
+uint64_t snapshot_checksum(const void *data, size_t size)
+{
+    const uint64_t prime = 0x100000001b3ULL;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    const char *bytes = static_cast<const char *>(data);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, bytes + i, sizeof(word));
+        hash = (hash ^ word) * prime;
+    }
+    for (; i < size; ++i) {
+        hash = (hash ^ static_cast<unsigned char>(bytes[i])) * prime;
+    }
+    return hash;
+}
+
+void SnapshotWriter::addRaw(SectionId id, const void *data, size_t size, uint32_t layer)
+{
+    sections.push_back({id, layer, data, size});
+}
+
+void SnapshotWriter::write(const std::string &filename) const
+{
+    SnapshotHeader header;
+    std::memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+    header.version = MappedSnapshot::version;
+    header.section_count = sections.size();
+
+    std::vector<SnapshotSection> table;
+    uint64_t offset = align_up(sizeof(SnapshotHeader) + sizeof(SnapshotSection) * sections.size());
+    for (const auto &pending : sections) {
+        SnapshotSection section;
+        section.id = static_cast<uint32_t>(pending.id);
+        section.layer = pending.layer;
+        section.offset = offset;
+        section.size = pending.size;
+        section.checksum = snapshot_checksum(pending.data, pending.size);
+        table.push_back(section);
+        offset = align_up(offset + pending.size);
+    }
+    header.file_size = offset;
+    header.table_checksum = snapshot_checksum(table.data(), sizeof(SnapshotSection) * table.size());
+
+    std::string tmp_filename = filename + ".tmp";
+    std::ofstream out(tmp_filename, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        throw std::runtime_error("Failed to open " + tmp_filename + " for writing");
+    }
+
+    const char zeros[page_size] = {};
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(table.data()), sizeof(SnapshotSection) * table.size());
+    uint64_t written = sizeof(header) + sizeof(SnapshotSection) * table.size();
+    for (size_t i = 0; i < sections.size(); ++i) {
+        out.write(zeros, table[i].offset - written);
+        out.write(static_cast<const char *>(sections[i].data), sections[i].size);
+        written = table[i].offset + sections[i].size;
+    }
+    out.write(zeros, header.file_size - written);
+    out.close();
+    if (!out) {
+        throw std::runtime_error("Failed to write " + tmp_filename);
+    }
+
+    if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+        throw std::runtime_error("Failed to move snapshot into place at " + filename);
+    }
+}
+
+std::shared_ptr<const MappedSnapshot> MappedSnapshot::open(const std::string &filename, bool verify)
+{
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open " + filename);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(SnapshotHeader)) {
+        ::close(fd);
+        throw std::runtime_error("Snapshot " + filename + " is truncated.");
+    }
+    void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        throw std::runtime_error("Failed to map " + filename);
+    }
+
+    std::shared_ptr<MappedSnapshot> snapshot(new MappedSnapshot());
+    snapshot->base = static_cast<const char *>(addr);
+    snapshot->length = st.st_size;
+
+    const SnapshotHeader *header = reinterpret_cast<const SnapshotHeader *>(snapshot->base);
+    if (std::memcmp(header->magic, snapshot_magic, sizeof(header->magic)) != 0) {
+        throw std::runtime_error(filename + " is not a graph snapshot.");
+    }
+    if (header->version != version) {
+        throw std::runtime_error("Snapshot " + filename + " has version " + std::to_string(header->version)
+            + ", expected " + std::to_string(version) + ".");
+    }
+    size_t table_size = sizeof(SnapshotSection) * header->section_count;
+    if (header->file_size != snapshot->length || sizeof(SnapshotHeader) + table_size > snapshot->length) {
+        throw std::runtime_error("Snapshot " + filename + " is truncated.");
+    }
+    snapshot->table = ArrayRef<SnapshotSection>(
+        reinterpret_cast<const SnapshotSection *>(snapshot->base + sizeof(SnapshotHeader)), header->section_count);
+    if (snapshot_checksum(snapshot->table.data(), table_size) != header->table_checksum) {
+        throw std::runtime_error("Snapshot " + filename + " has a corrupt section table.");
+    }
+
+    for (const auto &section : snapshot->table) {
+        if (section.offset % page_size != 0 || section.offset + section.size > snapshot->length) {
+            throw std::runtime_error("Snapshot " + filename + " has a section out of bounds.");
+        }
+        if (verify && snapshot_checksum(snapshot->base + section.offset, section.size) != section.checksum) {
+            throw std::runtime_error("Snapshot " + filename + " failed checksum on section " + std::to_string(section.id) + ".");
+        }
+    }
+    return snapshot;
+}
+
+MappedSnapshot::~MappedSnapshot()
+{
+    if (base != nullptr) {
+        munmap(const_cast<char *>(base), length);
+    }
+}
+
+const SnapshotSection *MappedSnapshot::find(SectionId id, uint32_t layer) const
+{
+    for (const auto &section : table) {
+        if (section.id == static_cast<uint32_t>(id) && section.layer == layer) {
+            return &section;
+        }
+    }
+    return nullptr;
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "ArrayRef.h"
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "Graph snapshots store little-endian fields and are mapped in place."
+#endif
+
+/**
+ * Snapshot file layout (all fields little-endian, fixed width):
+ *
+ *   page 0      SnapshotHeader, then section_count SnapshotSection entries
+ *   page k...   each section's payload, starting on a page boundary
+ *
+ * Sections hold flat arrays addressed by offsets only, so a mapped file can be
+ * used in place and shared between processes through the page cache.
+ *
+ * One file holds the topology shared by every routing profile once (layer 0) and
+ * each profile's weights and preprocessing under the profile's own layer number;
+ * a section is identified by its id and layer together.
+ */
+enum class SectionId : uint32_t {
+    coords = 1,
+    offsets = 2,
+    targets = 3,
+    weights = 4,
+    rev_offsets = 5,
+    rev_targets = 6,
+    rev_edges = 7,
+    names = 8,
+    name_text = 9,
+    spatial_index = 10,
+    ch_rank = 11,
+    ch_up_offsets = 12,
+    ch_up_targets = 13,
+    ch_up_weights = 14,
+    ch_up_middle = 15,
+    ch_down_offsets = 16,
+    ch_down_targets = 17,
+    ch_down_weights = 18,
+    ch_down_middle = 19,
+    alt_landmarks = 20,
+    alt_dist_from = 21,
+    alt_dist_to = 22,
+    graph_meta = 23,
+    name_gram_offsets = 24,
+    name_gram_postings = 25,
+    segment_index = 26,
+    coord_order = 27,
+    cch_rank = 28,
+    cch_order = 29,
+    cch_up_offsets = 30,
+    cch_up_targets = 31,
+    cch_lower_offsets = 32,
+    cch_lower_sources = 33,
+    cch_lower_arcs = 34,
+    td_factors = 35,
+    td_edge_pattern = 36,
+    td_meta = 37,
+};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t section_count;
+    uint64_t file_size;
+    // checksum of the section table
+    uint64_t table_checksum;
+};
+
+struct SnapshotSection {
+    uint32_t id;
+    uint32_t layer;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t checksum;
+};
+
+static_assert(sizeof(SnapshotHeader) == 32, "SnapshotHeader must be tightly packed");
+static_assert(sizeof(SnapshotSection) == 32, "SnapshotSection must be tightly packed");
+
+uint64_t snapshot_checksum(const void *data, size_t size);
+
+class SnapshotWriter {
+public:
+    // The data must stay alive until write() returns.
+    template <typename T>
+    void add(SectionId id, ArrayRef<T> data, uint32_t layer = 0) {
+        addRaw(id, data.data(), data.size() * sizeof(T), layer);
+    }
+
+    void addRaw(SectionId id, const void *data, size_t size, uint32_t layer = 0);
+
+    // Writes to a temporary file and renames it, so readers never map a partial snapshot.
+    void write(const std::string &filename) const;
+
+private:
+    struct PendingSection {
+        SectionId id;
+        uint32_t layer;
+        const void *data;
+        size_t size;
+    };
+
+    std::vector<PendingSection> sections;
+};
+
+class MappedSnapshot {
+public:
+    static const uint32_t version = 12;
+
+    // Throws std::runtime_error if the file is missing, truncated, of another version or corrupt.
+    static std::shared_ptr<const MappedSnapshot> open(const std::string &filename, bool verify = true);
+
+    MappedSnapshot(const MappedSnapshot &) = delete;
+    MappedSnapshot &operator=(const MappedSnapshot &) = delete;
+    ~MappedSnapshot();
+
+    bool has(SectionId id, uint32_t layer = 0) const {
+        return find(id, layer) != nullptr;
+    }
+
+    template <typename T>
+    ArrayRef<T> get(SectionId id, uint32_t layer = 0) const {
+        const SnapshotSection *section = find(id, layer);
+        if (section == nullptr) {
+            throw std::runtime_error("Snapshot section " + std::to_string(static_cast<uint32_t>(id)) + " of layer "
+                + std::to_string(layer) + " is missing.");
+        }
+        if (section->size % sizeof(T) != 0) {
+            throw std::runtime_error("Snapshot section " + std::to_string(static_cast<uint32_t>(id)) + " has a bad size.");
+        }
+        return ArrayRef<T>(reinterpret_cast<const T *>(base + section->offset), section->size / sizeof(T));
+    }
+
+private:
+    MappedSnapshot() = default;
+
+    const SnapshotSection *find(SectionId id, uint32_t layer) const;
+
+    const char *base = nullptr;
+    size_t length = 0;
+    ArrayRef<SnapshotSection> table;
+};
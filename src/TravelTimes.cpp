@@ -0,0 +1,139 @@
+#include "TravelTimes.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+using std::vector;
+
+namespace {
+
+const double inf = std::numeric_limits<double>::infinity();
+
+// Value of a daily piecewise-linear pattern at t in [0, day).
+double interpolate(const TravelTimes::Breakpoints &points, double t)
+{
+    auto next = std::upper_bound(points.begin(), points.end(), t, [](double t, const std::pair<double, double> &point) {
+        return t < point.first;
+    });
+    // the segment around t may wrap over midnight
+    const auto &after = next == points.end() ? points.front() : *next;
+    const auto &before = next == points.begin() ? points.back() : *(next - 1);
+    double from = before.first <= t ? before.first : before.first - TravelTimes::day;
+    double to = after.first > t ? after.first : after.first + TravelTimes::day;
+    if (to <= from) {
+        return before.second;
+    }
+    return before.second + (t - from) / (to - from) * (after.second - before.second);
+}
+
+}
+
+TravelTimes TravelTimes::build(const std::vector<Breakpoints> &patterns, std::vector<uint8_t> edge_pattern, double seconds_per_unit)
+{
+    if (patterns.empty() || patterns.size() > 256) {
+        throw std::runtime_error("Travel times need between 1 and 256 patterns.");
+    }
+    if (!(seconds_per_unit > 0) || !std::isfinite(seconds_per_unit)) {
+        throw std::runtime_error("Travel times need a positive number of seconds per weight unit.");
+    }
+    TravelTimes times;
+    times.meta.seconds_per_unit = seconds_per_unit;
+    for (const Breakpoints &points : patterns) {
+        if (points.empty()) {
+            throw std::runtime_error("Travel time pattern without breakpoints.");
+        }
+        for (size_t i = 0; i < points.size(); ++i) {
+            if (!(points[i].first >= 0 && points[i].first < day) || (i > 0 && !(points[i - 1].first < points[i].first))) {
+                throw std::runtime_error("Travel time pattern breakpoints must increase within one day.");
+            }
+            if (!(points[i].second > 0) || !std::isfinite(points[i].second)) {
+                throw std::runtime_error("Travel time pattern factors must be positive.");
+            }
+        }
+        for (size_t i = 0; i < slots; ++i) {
+            times.owned.factors.push_back(static_cast<float>(interpolate(points, i * slot)));
+        }
+        times.owned.factors.push_back(times.owned.factors[times.owned.factors.size() - slots]);
+    }
+    for (uint8_t pattern : edge_pattern) {
+        if (pattern >= patterns.size()) {
+            throw std::runtime_error("Edge refers to an unknown travel time pattern.");
+        }
+    }
+    times.owned.edge_pattern = std::move(edge_pattern);
+    times.factors = times.owned.factors;
+    times.edge_pattern = times.owned.edge_pattern;
+    times.derive();
+    return times;
+}
+
+void TravelTimes::derive()
+{
+    fifo_limit.assign(patternCount(), inf);
+    min_factor = inf;
+    for (size_t p = 0; p < patternCount(); ++p) {
+        const float *f = factors.data() + p * (slots + 1);
+        // t + seconds * factor(t) never decreases while seconds * drop per second <= 1
+        double drop = 0;
+        for (size_t i = 0; i < slots; ++i) {
+            drop = std::max(drop, (double(f[i]) - f[i + 1]) / slot);
+            min_factor = std::min(min_factor, double(f[i]));
+        }
+        if (drop > 0) {
+            fifo_limit[p] = 1 / drop;
+        }
+    }
+}
+
+double TravelTimes::waitingArrival(uint32_t pattern, double seconds, double t) const
+{
+    if (!std::isfinite(seconds)) {
+        return inf;
+    }
+    // arrival is linear between slot boundaries, and a day later it is a day later,
+    // so the best departure is t itself or one of the boundaries in the day after it
+    double best = t + seconds * factor(pattern, t);
+    double boundary = (std::floor(t / slot) + 1) * slot;
+    for (size_t i = 0; i < slots; ++i, boundary += slot) {
+        best = std::min(best, boundary + seconds * factor(pattern, boundary));
+    }
+    return best;
+}
+
+TravelTimes TravelTimes::fromSnapshot(const MappedSnapshot &snapshot, uint32_t layer)
+{
+    TravelTimes times;
+    if (!snapshot.has(SectionId::td_factors, layer)) {
+        return times;
+    }
+    times.factors = snapshot.get<float>(SectionId::td_factors, layer);
+    times.edge_pattern = snapshot.get<uint8_t>(SectionId::td_edge_pattern, layer);
+    ArrayRef<Meta> meta = snapshot.get<Meta>(SectionId::td_meta, layer);
+    if (times.factors.empty() || times.factors.size() % (slots + 1) != 0 || times.patternCount() > 256 || meta.size() != 1
+        || !(meta[0].seconds_per_unit > 0) || !std::isfinite(meta[0].seconds_per_unit)) {
+        throw std::runtime_error("Snapshot has inconsistent travel time sections.");
+    }
+    for (float f : times.factors) {
+        if (!(f > 0) || !std::isfinite(f)) {
+            throw std::runtime_error("Snapshot has a travel time pattern with a bad factor.");
+        }
+    }
+    for (uint8_t pattern : times.edge_pattern) {
+        if (pattern >= times.patternCount()) {
+            throw std::runtime_error("Snapshot has an edge with an unknown travel time pattern.");
+        }
+    }
+    times.meta = meta[0];
+    times.derive();
+    return times;
+}
+
+void TravelTimes::addSections(SnapshotWriter &writer, uint32_t layer) const
+{
+    if (empty()) {
+        return;
+    }
+    writer.add(SectionId::td_factors, factors, layer);
+    writer.add(SectionId::td_edge_pattern, edge_pattern, layer);
+    writer.add(SectionId::td_meta, ArrayRef<Meta>(&meta, 1), layer);
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+#include "ArrayRef.h"
+#include "Snapshot.h"
+
+/**
+ * Time-of-day travel times of one routing profile.
+ *
+ * Entering edge e at time t takes weight * seconds per unit * factor(t) seconds,
+ * where the factor is a daily, piecewise-linear pattern shared by every edge of
+ * the same road class: an edge costs one byte on top of its weight. Patterns are
+ * sampled every `slot` seconds, so evaluating one is a table lookup and one linear
+ * interpolation.
+ *
+ * Travel is FIFO: entering an edge later never means leaving it earlier. Where a
+ * pattern falls faster than an edge can be crossed, the edge takes as long as
+ * waiting at its start for the best later departure.
+ */
+class TravelTimes {
+public:
+    static constexpr double day = 86400;
+    static constexpr double slot = 900;
+    static constexpr size_t slots = 96;
+
+    // (seconds since midnight, factor) with strictly increasing times in [0, day)
+    // and positive factors, interpolated linearly and repeated daily.
+    using Breakpoints = std::vector<std::pair<double, double>>;
+
+    TravelTimes() = default;
+    TravelTimes(const TravelTimes &) = delete;
+    TravelTimes &operator=(const TravelTimes &) = delete;
+    TravelTimes(TravelTimes &&) = default;
+    TravelTimes &operator=(TravelTimes &&) = default;
+
+    // Patterns are sampled on the slot grid, so breakpoints between its points are
+    // smoothed over the two slots around them. edge_pattern[e] is the pattern of
+    // edge e, or empty when every edge uses patterns[0]. Throws std::runtime_error
+    // for malformed patterns.
+    static TravelTimes build(const std::vector<Breakpoints> &patterns, std::vector<uint8_t> edge_pattern, double seconds_per_unit);
+
+    // Views the sections of one layer of a mapped snapshot; returns an empty set if it has none.
+    static TravelTimes fromSnapshot(const MappedSnapshot &snapshot, uint32_t layer = 0);
+
+    void addSections(SnapshotWriter &writer, uint32_t layer = 0) const;
+
+    inline bool empty() const {
+        return factors.empty();
+    }
+
+    inline size_t patternCount() const {
+        return factors.size() / (slots + 1);
+    }
+
+    // edges the per-edge patterns cover, 0 if every edge uses the first one
+    inline size_t edgeCount() const {
+        return edge_pattern.size();
+    }
+
+    inline double secondsPerUnit() const {
+        return meta.seconds_per_unit;
+    }
+
+    // Smallest factor of any pattern: weight * secondsPerUnit() * minFactor() is a
+    // lower bound of every travel time of the edge.
+    inline double minFactor() const {
+        return min_factor;
+    }
+
+    inline double factor(uint32_t pattern, double t) const {
+        double x = (t - std::floor(t / day) * day) / slot;
+        size_t i = std::min(static_cast<size_t>(x), slots - 1);
+        const float *f = factors.data() + pattern * (slots + 1);
+        return f[i] + (x - i) * (f[i + 1] - f[i]);
+    }
+
+    // Time of leaving edge e of the given weight when entering it at t.
+    inline double arrival(uint32_t e, double weight, double t) const {
+        uint32_t pattern = edge_pattern.empty() ? 0 : edge_pattern[e];
+        double seconds = weight * meta.seconds_per_unit;
+        if (seconds > fifo_limit[pattern]) {
+            return waitingArrival(pattern, seconds, t);
+        }
+        return t + seconds * factor(pattern, t);
+    }
+
+private:
+    struct Meta {
+        double seconds_per_unit = 1;
+    };
+
+    // patternCount() x (slots + 1) factors, the last of each row repeating the first
+    ArrayRef<float> factors;
+    ArrayRef<uint8_t> edge_pattern;
+    // a member, not a view: the snapshot writer keeps a pointer to it
+    Meta meta;
+
+    // derived from factors: longest free-flow seconds each pattern is FIFO for
+    std::vector<double> fifo_limit;
+    double min_factor = 1;
+
+    struct Buffers {
+        std::vector<float> factors;
+        std::vector<uint8_t> edge_pattern;
+    } owned;
+
+    void derive();
+
+    // Earliest arrival over departures from t on, for edges too long for the direct formula.
+    double waitingArrival(uint32_t pattern, double seconds, double t) const;
+};
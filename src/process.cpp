@@ -1,5 +1,11 @@
 #include "Graph.h"
 #include "Node.h"
+#include "GeoJSONReader.h"
+#include "GraphBuilder.h"
+#include "Metrics.h"
+#include "RouteCache.h"
+#include "RouteEncoding.h"
+#include "Parallel.h"
 #include <jsoncpp/json/json.h>
 #include <fstream>
 #include <sstream>
@@ -8,10 +14,24 @@
 #include <unordered_map>
 #include <vector>
 #include <cmath>
+#include <cstdio>
 #include <string>
 #include <queue>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/read_until.hpp>
+#include <boost/asio/streambuf.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/system/system_error.hpp>
 #include <websocketpp/config/asio_no_tls.hpp>
 #include <websocketpp/server.hpp>
 
@@ -26,181 +46,175 @@ using std::endl;
 
 typedef websocketpp::server<websocketpp::config::asio> server;
 
+/**
+ * Sends one response back to the client that asked; safe to call from any thread.
+ *
+ * Text payloads go out as text frames, wrapped in {"id": ..., "result"/"error": ...}
+ * when the request was tagged. Binary bodies go out as binary frames; tagged ones
+ * are prefixed with the tag's length (uint32, little-endian) and the tag JSON.
+ */
+class Reply {
+public:
+    // (frame, binary opcode)
+    using Send = std::function<void(const std::string &, bool)>;
+
+    explicit Reply(Send send, string tag = "") : send(std::move(send)), tag(std::move(tag)) {}
+
+    void operator()(const std::string &payload) const {
+        if (tag.empty()) {
+            send(payload, false);
+            return;
+        }
+        size_t first = payload.find_first_not_of(" \t\r\n");
+        if (first != string::npos && (payload[first] == '{' || payload[first] == '[')) {
+            send("{" + tag + ",\"result\":" + payload + "}", false);
+        } else {
+            send("{" + tag + ",\"error\":" + Json::valueToQuotedString(payload.c_str()) + "}", false);
+        }
+    }
+
+    void binary(const std::string &body) const {
+        if (tag.empty()) {
+            send(body, true);
+            return;
+        }
+        string header = "{" + tag + "}";
+        string frame;
+        frame.reserve(4 + header.size() + body.size());
+        for (int shift = 0; shift < 32; shift += 8) {
+            frame.push_back(static_cast<char>(header.size() >> shift & 0xFF));
+        }
+        frame += header;
+        frame += body;
+        send(frame, true);
+    }
+
+    // Same connection, different tag.
+    Reply tagged(string tag) const {
+        return Reply(send, std::move(tag));
+    }
+
+private:
+    Send send;
+    // "\"id\":...[,\"index\":...]" without braces, empty for untagged requests
+    string tag;
+};
+
 const string working_path = "/home/sean/DS-PJ-Map";
 const string highway_file = working_path + "/data/shanghai-highway.geojson";
 const string point_file = working_path + "/data/shanghai.geojson";
 
-void saveGraph(const Graph &graph, const string &filename) {
-    std::ofstream out(filename, std::ios::binary);
-    graph.serialize(out);
-    out.close();
+// Car and pedestrian graphs share one snapshot; each profile's weights are its layer.
+uint32_t layer_of(Profile profile) {
+    return static_cast<uint32_t>(profile);
 }
 
-bool loadGraph(Graph &graph, const string &filename) {
-    std::ifstream in(filename, std::ios::binary);
-    if (!in) {
-        return false;
+/**
+ * The graph of one profile as queries see it. A weight update builds a new graph
+ * next to the current one and publishes it atomically; every query takes the
+ * current graph when it starts and keeps it alive until it is done, so it never
+ * sees half an update and is never held up by one.
+ */
+class LiveGraph {
+public:
+    // startup stays owned by the caller and outlives this object
+    explicit LiveGraph(const Graph &startup)
+        : startup(startup), current(std::shared_ptr<const Graph>(&startup, [](const Graph *) {})) {}
+
+    std::shared_ptr<const Graph> get() const {
+        return std::atomic_load(&current);
     }
-    graph.deserialize(in);
-    in.close();
-    return true;
-}
 
-priority getPriorityFromString(const string &str) {
-    if (str == "motorway_junction") {
-        return motorway;
-    } else if (str == "trunk") {
-        return trunk;
-    } else if (str == "primary") {
-        return primary;
-    } else if (str == "secondary") {
-        return secondary;
-    } else if (str == "tertiary") {
-        return tertiary;
-    } else if (str == "unclassified") {
-        return unclassified;
-    } else if (str == "residential") {
-        return residential;
-    } else if (str == "service") {
-        return service;
-    } else if (str == "track") {
-        return track;
-    } else if (str == "path") {
-        return path;
-    } else if (str == "footway") {
-        return footway;
-    } else if (str == "cycleway") {
-        return cycleway;
-    } else {
-        return unknown;
+    // The graph as loaded, before any update.
+    const Graph &initial() const {
+        return startup;
     }
-}
 
-inline bool isOneWay(const Json::Value &feature) {
-    if (!feature["properties"]["oneway"].isNull() && feature["properties"]["oneway"].asString() == "yes") {
-        return true;
+    // Applies changes on top of the current weights; updates run one at a time.
+    // Returns the published graph and adds the recomputed hierarchy arcs to *recomputed.
+    std::shared_ptr<const Graph> update(const std::vector<Graph::WeightChange> &changes, size_t *recomputed) {
+        std::lock_guard<std::mutex> lock(update_mutex);
+        std::shared_ptr<const Graph> next = get()->withWeights(changes, recomputed);
+        std::atomic_store(&current, next);
+        return next;
     }
-    return false;
-}
 
-inline bool isSideWalk(const Json::Value &feature) {
-    if (!feature["properties"]["sidewalk"].isNull() && feature["properties"]["sidewalk"].asString() == "no") {
+private:
+    const Graph &startup;
+    std::shared_ptr<const Graph> current;
+    std::mutex update_mutex;
+};
+
+bool loadGraphs(Graph &graph, Graph &ped_graph, const string &filename) {
+    try {
+        auto mapped = MappedSnapshot::open(filename);
+        graph.mapSnapshot(mapped, layer_of(Profile::car));
+        ped_graph.mapSnapshot(mapped, layer_of(Profile::pedestrian));
+    } catch (const std::exception &e) {
+        cout << "Ignoring graph cache " << filename << ": " << e.what() << endl;
         return false;
     }
     return true;
 }
 
-// add highway to graph
-void load_highway(const std::string &filename, Graph &graph)
-{
-    std::ifstream file(filename);
-    Json::Value geojson;
-    file >> geojson;
-
-    for (const auto &feature : geojson["features"])
-    {
-        if (feature["geometry"]["type"].asString() == "LineString" && !feature["properties"]["highway"].isNull())
-        {
-            const auto &coordinates = feature["geometry"]["coordinates"];
-            const string road_cat = feature["properties"]["highway"].asString();
-            bool is_one_way = isOneWay(feature);
-            for (Json::ArrayIndex i = 0; i < coordinates.size() - 1; ++i)
-            {
-                double lng1 = coordinates[i][0].asDouble();
-                double lat1 = coordinates[i][1].asDouble();
-                double lng2 = coordinates[i + 1][0].asDouble();
-                double lat2 = coordinates[i + 1][1].asDouble();
-
-                Node n1(lng1, lat1, getPriorityFromString(road_cat)), n2(lng2, lat2, getPriorityFromString(road_cat));
-
-                graph.addNode(n1);
-                graph.addNode2KDTree(n1);
-                graph.addNode(n2);
-                graph.addNode2KDTree(n2);
-
-                if (!graph.getNeighbors(n1).count(n2))
-                {
-                    double distance = calculate_weighted_distance(n1, n2);
-                    graph.addDirectedEdge(n1, n2, distance);
-                }
-                if (!is_one_way && !graph.getNeighbors(n2).count(n1)) {
-                    double distance = calculate_weighted_distance(n2, n1);
-                    graph.addDirectedEdge(n2, n1, distance);
-                }
-            }
-        } 
+void add_point(const Json::Value &feature, Graph &graph) {
+    if (feature["geometry"]["type"].asString() == "Point" && !feature["properties"]["name"].asString().empty()) {
+        double lng = feature["geometry"]["coordinates"][0].asDouble();
+        double lat = feature["geometry"]["coordinates"][1].asDouble();
+        string name = feature["properties"]["name"].asString();
+        graph.addNamePoint(name, {lng, lat});
+    } else if (feature["geometry"]["type"].asString() == "MultiPolygon"
+     && !feature["properties"]["name"].asString().empty()
+     && !graph.location_mapContains(feature["properties"]["name"].asString())) {
+        double lng = feature["geometry"]["coordinates"][0][0][0][0].asDouble();
+        double lat = feature["geometry"]["coordinates"][0][0][0][1].asDouble();
+        string name = feature["properties"]["name"].asString();
+        graph.addNamePoint(name, {lng, lat});
     }
 }
 
-void ped_load_highway(const std::string &filename, Graph &graph)
-{
-    std::ifstream file(filename);
-    Json::Value geojson;
-    file >> geojson;
+/**
+ * Read the GeoJSON files once and build both graphs over one shared topology.
+ */
+void load_geojson(const string &highway_filename, const string &point_filename, Graph &graph, Graph &ped_graph) {
+    // names live in the topology, which the pedestrian graph shares
+    read_features(point_filename, [&](const Json::Value &feature) {
+        add_point(feature, graph);
+    });
+    GraphBuilder builder;
+    builder.readHighways(highway_filename);
+    builder.build({Profile::car, Profile::pedestrian}, {&graph, &ped_graph});
+}
 
-    for (const auto &feature : geojson["features"])
-    {
-        if (feature["geometry"]["type"].asString() == "LineString" && !feature["properties"]["highway"].isNull())
-        {
-            const auto &coordinates = feature["geometry"]["coordinates"];
-            const string road_cat = feature["properties"]["highway"].asString();
-            bool is_one_way = false;
-            bool is_sidewalk = isSideWalk(feature);
-            if (!is_sidewalk) {
-                continue;
-            }
-            for (Json::ArrayIndex i = 0; i < coordinates.size() - 1; ++i)
-            {
-                double lng1 = coordinates[i][0].asDouble();
-                double lat1 = coordinates[i][1].asDouble();
-                double lng2 = coordinates[i + 1][0].asDouble();
-                double lat2 = coordinates[i + 1][1].asDouble();
-
-                Node n1(lng1, lat1), n2(lng2, lat2);
-
-                graph.addNode(n1);
-                graph.addNode2KDTree(n1);
-                graph.addNode(n2);
-                graph.addNode2KDTree(n2);
-
-                if (!graph.getNeighbors(n1).count(n2))
-                {
-                    double distance = calculate_distance(n1, n2);
-                    graph.addDirectedEdge(n1, n2, distance);
-                }
-                if (!is_one_way && !graph.getNeighbors(n2).count(n1)) {
-                    double distance = calculate_distance(n2, n1);
-                    graph.addDirectedEdge(n2, n1, distance);
-                }
-            }
-        } 
-    }
+void export_path_to_geojson_string(const std::vector<Node> &path, std::string &output_string) {
+    output_string.clear();
+    write_route_geojson(path, output_string);
 }
 
-void load_point(const string &filename, Graph &graph) {
-    std::ifstream file(filename);
-    Json::Value geojson;
-    file >> geojson;
-
-    for (const auto &feature : geojson["features"]) {
-        if (feature["geometry"]["type"].asString() == "Point" && !feature["properties"]["name"].asString().empty()) {
-            double lng = feature["geometry"]["coordinates"][0].asDouble();
-            double lat = feature["geometry"]["coordinates"][1].asDouble();
-            string name = feature["properties"]["name"].asString();
-            graph.addNamePoint(name, {lng, lat});
-        } else if (feature["geometry"]["type"].asString() == "MultiPolygon"
-         && !feature["properties"]["name"].asString().empty()
-         && !graph.location_mapContains(feature["properties"]["name"].asString())) {
-            double lng = feature["geometry"]["coordinates"][0][0][0][0].asDouble();
-            double lat = feature["geometry"]["coordinates"][0][0][0][1].asDouble();
-            string name = feature["properties"]["name"].asString();
-            graph.addNamePoint(name, {lng, lat});
-        }
+// Encodes path into a per-thread buffer that keeps its capacity between queries.
+const string &encode_route(const std::vector<Node> &path, const RouteEncoding &encoding) {
+    thread_local string buffer;
+    buffer.clear();
+    write_route(path, encoding, buffer);
+    return buffer;
+}
+
+// Text routes are sent as is, binary ones as a binary frame.
+void send_route(const string &route, const RouteEncoding &encoding, const Reply &reply) {
+    if (encoding.format == RouteFormat::binary) {
+        reply.binary(route);
+    } else {
+        reply(route);
     }
 }
 
+// "format": "geojson" (default), "polyline" or "binary"; "precision" for polylines.
+RouteEncoding route_encoding_of(const Json::Value &jsonData) {
+    return parse_route_encoding(jsonData.get("format", "geojson").asString(), jsonData.get("precision", 5).asInt());
+}
 
-void export_path_to_geojson_string(const std::vector<Node> &path, std::string &output_string) {
+void export_path_to_geojson(const std::vector<Node> &path, const std::string &output_filename)
+{
     Json::Value geojson;
     geojson["type"] = "FeatureCollection";
     Json::Value feature;
@@ -225,41 +239,77 @@ void export_path_to_geojson_string(const std::vector<Node> &path, std::string &o
 
     geojson["features"].append(feature);
 
-    std::ostringstream out;
-    out << geojson;
-
-    output_string = out.str();
+    std::ofstream file(output_filename);
+    file << geojson;
+    file.close();
 }
 
-void export_path_to_geojson(const std::vector<Node> &path, const std::string &output_filename)
-{
-    Json::Value geojson;
-    geojson["type"] = "FeatureCollection";
-    Json::Value feature;
-    feature["type"] = "Feature";
-    feature["geometry"]["type"] = "LineString";
+/**
+ * Run the search engine chosen by the request: "astar" (default), "biastar" or "ch".
+ */
+bool is_known_algorithm(const string &algorithm) {
+    return algorithm.empty() || algorithm == "astar" || algorithm == "biastar" || algorithm == "ch";
+}
 
-    for (const auto &node : path)
-    {
-        Json::Value coord;
-        coord.append(node.getLng());
-        coord.append(node.getLat());
+std::vector<Node> find_path(const Graph &graph, const Node &start, const Node &goal, const string &algorithm) {
+    if (algorithm.empty() || algorithm == "astar") {
+        return graph.AStar(start, goal);
+    } else if (algorithm == "biastar") {
+        return graph.BiAStar(start, goal);
+    } else if (algorithm == "ch") {
+        return graph.CHQuery(start, goal);
+    }
+    throw std::runtime_error("Unknown algorithm: " + algorithm);
+}
 
-        // Json::Value point;
-        // point["type"] = "Feature";
-        // point["geometry"]["type"] = "Point";
-        // point["geometry"]["coordinates"] = coord;
-        // point["properties"]["popupContent"] = "coord";
-        // geojson["features"].append(point);
+// Routes without a departure time use the static weights.
+const double no_departure = -1;
 
-        feature["geometry"]["coordinates"].append(coord);
+/**
+ * "departureTime" of a route request: seconds since midnight, or "HH:MM" / "HH:MM:SS".
+ * Returns no_departure if the request has none.
+ */
+double departure_of(const Json::Value &jsonData) {
+    const Json::Value &value = jsonData["departureTime"];
+    if (value.isNull()) {
+        return no_departure;
     }
+    double seconds = -1;
+    if (value.isNumeric()) {
+        seconds = value.asDouble();
+    } else if (value.isString()) {
+        int h = 0, m = 0, sec = 0;
+        char rest = 0;
+        int n = std::sscanf(value.asCString(), "%d:%d:%d%c", &h, &m, &sec, &rest);
+        if ((n == 2 || n == 3) && h >= 0 && h < 24 && m >= 0 && m < 60 && sec >= 0 && sec < 60) {
+            seconds = h * 3600.0 + m * 60.0 + sec;
+        }
+    }
+    if (!(seconds >= 0 && seconds < TravelTimes::day)) {
+        throw std::runtime_error("departureTime must be seconds since midnight or HH:MM[:SS].");
+    }
+    return seconds;
+}
 
-    geojson["features"].append(feature);
+// Only A* has a time-dependent variant, and it routes between nodes.
+void check_departure(const string &algorithm, bool edgeSnap, double departure) {
+    if (departure == no_departure) {
+        return;
+    }
+    if (!algorithm.empty() && algorithm != "astar") {
+        throw std::runtime_error("departureTime is only supported by the astar algorithm, not " + algorithm + ".");
+    }
+    if (edgeSnap) {
+        throw std::runtime_error("departureTime needs \"snap\": \"node\".");
+    }
+}
 
-    std::ofstream file(output_filename);
-    file << geojson;
-    file.close();
+// With a departure time the request has passed check_departure and runs the time-dependent A*.
+std::vector<Node> find_path(const Graph &graph, const Node &start, const Node &goal, const string &algorithm, double departure) {
+    if (departure == no_departure) {
+        return find_path(graph, start, goal, algorithm);
+    }
+    return graph.TDAStar(start, goal, departure);
 }
 
 void calculate_shortest_path_by_name(const Graph &graph, const string &start_name, const string &goal_name) {
@@ -280,11 +330,22 @@ void calculate_shortest_path_by_name(const Graph &graph, const string &start_nam
 }
 
 /**
- * Return the geojson result to output_string for websocket transmission.
+ * Return the geojson result for websocket transmission, empty if there is no path.
+ * Every engine returns a shortest path, so the cache is shared between algorithms;
+ * time-dependent routes depend on the departure and bypass it.
  */
-void calculate_shortest_path_by_name_to_string(const Graph &graph, const string &start_name, const string &goal_name, string &output_string) {
-    auto start_coord = graph.queryByName(start_name);
-    auto goal_coord = graph.queryByName(goal_name);
+RouteCache::Value calculate_shortest_path_by_name_to_string(const Graph &graph, const string &start_name, const string &goal_name, const string &algorithm, double departure, Profile profile, const RouteEncoding &encoding, RouteCache &cache) {
+    if (!is_known_algorithm(algorithm)) {
+        throw std::runtime_error("Unknown algorithm: " + algorithm);
+    }
+    check_departure(algorithm, false, departure);
+
+    std::pair<double, double> start_coord, goal_coord;
+    {
+        StageTimer timer(Stage::snap);
+        start_coord = graph.queryByName(start_name);
+        goal_coord = graph.queryByName(goal_name);
+    }
 
     Node start(start_coord);
     Node goal(goal_coord);
@@ -292,30 +353,55 @@ void calculate_shortest_path_by_name_to_string(const Graph &graph, const string
     cout << start_name << ":" << start.getLat() << "," << start.getLng() << endl;
     cout << goal_name << ":" << goal.getLat() << "," << goal.getLng() << endl;
 
-    auto path = graph.AStar(start, goal);
+    bool cacheable = departure == no_departure;
+    RouteCache::Key key{graph.findNode(start), graph.findNode(goal), static_cast<uint32_t>(profile), encoding.key(), graph.metricVersion()};
+    if (cacheable) {
+        if (auto cached = cache.get(key)) {
+            return cached;
+        }
+    }
 
-    export_path_to_geojson_string(path, output_string);
+    std::vector<Node> path;
+    {
+        StageTimer timer(Stage::search);
+        path = find_path(graph, start, goal, algorithm, departure);
+    }
+
+    string output_string;
+    {
+        StageTimer timer(Stage::serialize);
+        output_string = encode_route(path, encoding);
+    }
+    if (cacheable) {
+        cache.put(key, output_string);
+    }
+    return std::make_shared<const string>(std::move(output_string));
 }
 
 
 
-void calculateAndRespond(const std::string& startLocation, const std::string& endLocation, websocketpp::connection_hdl hdl, server& wsServer, const Graph &graph) {
-    string result;
-    calculate_shortest_path_by_name_to_string(graph, startLocation, endLocation, result);
-    // std::cout << result << std::endl;
-    if (result.empty()) {
-        wsServer.send(hdl, "Cannot find path!", websocketpp::frame::opcode::text);
+void calculateAndRespond(const std::string& startLocation, const std::string& endLocation, const std::string &algorithm, double departure, const RouteEncoding &encoding, const Reply &reply, const Graph &graph, Profile profile, RouteCache &cache) {
+    auto result = calculate_shortest_path_by_name_to_string(graph, startLocation, endLocation, algorithm, departure, profile, encoding, cache);
+    // std::cout << *result << std::endl;
+    if (result->empty()) {
+        reply("Cannot find path!");
         return;
     }
 
     // 发送结果
-    wsServer.send(hdl, result, websocketpp::frame::opcode::text);
+    send_route(*result, encoding, reply);
 }
 
 
 
-void performFuzzyQuery(const std::string& locationName, websocketpp::connection_hdl hdl, server& wsServer, const Graph &graph) {
-    auto locations = graph.fuzzySearch(locationName, 75.0, 20);
+void performFuzzyQuery(const std::string& locationName, const Reply &reply, const Graph &graph) {
+    std::vector<std::string> locations;
+    {
+        StageTimer timer(Stage::search);
+        locations = graph.fuzzySearch(locationName, 75.0, 20);
+    }
+
+    StageTimer timer(Stage::serialize);
     Json::Value result(Json::arrayValue);
 
     for (const auto &location : locations) {
@@ -325,112 +411,651 @@ void performFuzzyQuery(const std::string& locationName, websocketpp::connection_
     Json::FastWriter writer;
     std::string response = writer.write(result);
 
-    wsServer.send(hdl, response, websocketpp::frame::opcode::text);
+    reply(response);
 }
 
-void performArbitrary(double startLat, double startLng, double endLat, double endLng, websocketpp::connection_hdl hdl, server& wsServer, const Graph &graph) {
-    auto start_coord = graph.queryByArbitrary({startLng, startLat});
-    auto end_coord = graph.queryByArbitrary({endLng, endLat});
+/**
+ * Route between two clicked points. With edgeSnap each point is projected onto its
+ * closest road segment and the route starts and ends at the projections; otherwise
+ * both are moved to their nearest graph node. Time-dependent routes only snap
+ * to nodes.
+ */
+void performArbitrary(double startLat, double startLng, double endLat, double endLng, const std::string &algorithm, bool edgeSnap, double departure, const RouteEncoding &encoding, const Reply &reply, const Graph &graph) {
+    if (!is_known_algorithm(algorithm)) {
+        throw std::runtime_error("Unknown algorithm: " + algorithm);
+    }
+    check_departure(algorithm, edgeSnap, departure);
 
-    Node start(start_coord);
-    Node end(end_coord);
+    std::vector<Node> path;
+    if (edgeSnap) {
+        Graph::EdgeSnap start, end;
+        {
+            StageTimer timer(Stage::snap);
+            start = graph.snapToEdge({startLng, startLat});
+            end = graph.snapToEdge({endLng, endLat});
+        }
+
+        cout << start.point[1] << "," << start.point[0] << " (" << start.distance << " m off)" << endl;
+        cout << end.point[1] << "," << end.point[0] << " (" << end.distance << " m off)" << endl;
+
+        StageTimer timer(Stage::search);
+        path = graph.routeSnapped(start, end, algorithm == "ch");
+    } else {
+        std::pair<double, double> start_coord, end_coord;
+        {
+            StageTimer timer(Stage::snap);
+            start_coord = graph.queryByArbitrary({startLng, startLat});
+            end_coord = graph.queryByArbitrary({endLng, endLat});
+        }
 
-    cout << start.getLat() << "," << start.getLng() << endl;
-    cout << end.getLat() << "," << end.getLng() << endl;
+        Node start(start_coord);
+        Node end(end_coord);
 
-    auto path = graph.AStar(start, end);
+        cout << start.getLat() << "," << start.getLng() << endl;
+        cout << end.getLat() << "," << end.getLng() << endl;
+
+        StageTimer timer(Stage::search);
+        path = find_path(graph, start, end, algorithm, departure);
+    }
 
-    string result;
-    export_path_to_geojson_string(path, result);
-    wsServer.send(hdl, result, websocketpp::frame::opcode::text);
+    StageTimer timer(Stage::serialize);
+    send_route(encode_route(path, encoding), encoding, reply);
 }
 
-void loadData(Graph &graph) {
+// Upper bound on sources x targets of one matrix query.
+const size_t max_matrix_cells = 250000;
+
+// Matrix endpoints are either place names or {"lat", "lng"} objects.
+std::vector<Node> snap_matrix_points(const Graph &graph, const Json::Value &points) {
+    if (!points.isArray() || points.empty()) {
+        throw std::runtime_error("Matrix sources and targets must be non-empty arrays.");
+    }
+    std::vector<Node> nodes;
+    nodes.reserve(points.size());
+    for (const auto &point : points) {
+        if (point.isString()) {
+            nodes.emplace_back(graph.queryByName(point.asString()));
+        } else {
+            nodes.emplace_back(graph.queryByArbitrary({point["lng"].asDouble(), point["lat"].asDouble()}));
+        }
+    }
+    return nodes;
+}
+
+/**
+ * Reply with {"sources": n, "targets": m, "costs": [...]}: the n x m cost matrix
+ * row-major, rounded to whole cost units, with null for unreachable pairs.
+ */
+void performMatrix(const Json::Value &sourcePoints, const Json::Value &targetPoints, const Reply &reply, const Graph &graph) {
+    // checked before snapping, which costs a lookup per point
+    if (size_t(sourcePoints.size()) * targetPoints.size() > max_matrix_cells) {
+        throw std::runtime_error("Matrix too large: " + std::to_string(sourcePoints.size()) + "x" + std::to_string(targetPoints.size()));
+    }
+    std::vector<Node> sources, targets;
+    {
+        StageTimer timer(Stage::snap);
+        sources = snap_matrix_points(graph, sourcePoints);
+        targets = snap_matrix_points(graph, targetPoints);
+    }
+
+    std::vector<double> costs;
+    {
+        StageTimer timer(Stage::search);
+        costs = graph.distanceMatrix(sources, targets);
+    }
+
+    StageTimer timer(Stage::serialize);
+    Json::Value result;
+    result["sources"] = Json::UInt64(sources.size());
+    result["targets"] = Json::UInt64(targets.size());
+    Json::Value &values = result["costs"] = Json::Value(Json::arrayValue);
+    for (double cost : costs) {
+        values.append(std::isinf(cost) ? Json::Value() : Json::Value(Json::Int64(std::llround(cost))));
+    }
+    Json::FastWriter writer;
+    reply(writer.write(result));
+}
+
+// Upper bound on the budgets of one isochrone query.
+const size_t max_isochrone_budgets = 16;
+
+// Largest isochrone budget in edge cost units, well past anything reachable in the city.
+const double max_isochrone_budget = 1e7;
+
+/**
+ * Extra threads that the parallel searches of concurrent queries share, on top of
+ * the worker each query already runs on. A query that finds the budget used up
+ * runs on its worker alone, so several large isochrones at once start no more
+ * than one extra set of threads between them.
+ */
+class SearchThreads {
+public:
+    explicit SearchThreads(size_t spare) : spare(spare) {}
+
+    // Threads a query may use, its own worker included, until the lease ends.
+    class Lease {
+    public:
+        Lease(SearchThreads &owner, size_t extra) : owner(owner), extra(extra) {}
+        Lease(const Lease &) = delete;
+        Lease &operator=(const Lease &) = delete;
+
+        ~Lease() {
+            owner.spare.fetch_add(extra);
+        }
+
+        size_t threads() const {
+            return 1 + extra;
+        }
+
+    private:
+        SearchThreads &owner;
+        size_t extra;
+    };
+
+    // Takes up to wanted - 1 extra threads.
+    Lease take(size_t wanted) {
+        size_t available = spare.load();
+        size_t extra;
+        do {
+            extra = std::min(available, wanted > 0 ? wanted - 1 : 0);
+        } while (!spare.compare_exchange_weak(available, available - extra));
+        return Lease(*this, extra);
+    }
+
+private:
+    std::atomic<size_t> spare;
+};
+
+SearchThreads &search_threads() {
+    static SearchThreads threads(build_threads() - 1);
+    return threads;
+}
+
+/**
+ * Reply with a GeoJSON FeatureCollection holding, per budget in ascending order,
+ * the convex hull of every node within it as a Polygon (null geometry if fewer
+ * than three distinct nodes) and, if withNodes, a MultiPoint of the nodes newly
+ * reached since the previous budget. Budgets are in edge cost units, from 0 to
+ * max_isochrone_budget.
+ */
+void performIsochrone(double lat, double lng, std::vector<double> budgets, bool withNodes, const Reply &reply, const Graph &graph) {
+    if (budgets.empty() || budgets.size() > max_isochrone_budgets) {
+        throw std::runtime_error("Isochrone needs 1 to " + std::to_string(max_isochrone_budgets) + " budgets.");
+    }
+    for (double budget : budgets) {
+        if (!(budget >= 0 && budget <= max_isochrone_budget)) {
+            throw std::runtime_error("Isochrone budgets must be numbers from 0 to " + std::to_string(static_cast<long long>(max_isochrone_budget)) + ".");
+        }
+    }
+    std::sort(budgets.begin(), budgets.end());
+
+    Node start;
+    {
+        StageTimer timer(Stage::snap);
+        start = Node(graph.queryByArbitrary({lng, lat}));
+    }
+
+    Reachable reached;
+    {
+        StageTimer timer(Stage::search);
+        SearchThreads::Lease lease = search_threads().take(build_threads());
+        reached = graph.reachable(start, budgets.back(), lease.threads());
+    }
+
+    StageTimer timer(Stage::serialize);
+    std::vector<size_t> order(reached.nodes.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&reached](size_t a, size_t b) {
+        return reached.dist[a] < reached.dist[b];
+    });
+
+    Json::Value collection;
+    collection["type"] = "FeatureCollection";
+    Json::Value &features = collection["features"] = Json::Value(Json::arrayValue);
+    std::vector<std::array<double, 2>> points;
+    size_t next = 0;
+    for (double budget : budgets) {
+        size_t first = next;
+        for (; next < order.size() && reached.dist[order[next]] <= budget; ++next) {
+            Node node = graph.nodeAt(reached.nodes[order[next]]);
+            points.push_back({node.getLng(), node.getLat()});
+        }
+
+        Json::Value outline;
+        outline["type"] = "Feature";
+        outline["properties"]["budget"] = budget;
+        outline["properties"]["nodes"] = Json::UInt64(next);
+        auto hull = convex_hull(points);
+        if (hull.size() >= 4) {
+            Json::Value ring(Json::arrayValue);
+            for (const auto &point : hull) {
+                Json::Value coordinate(Json::arrayValue);
+                coordinate.append(point[0]);
+                coordinate.append(point[1]);
+                ring.append(coordinate);
+            }
+            outline["geometry"]["type"] = "Polygon";
+            outline["geometry"]["coordinates"].append(ring);
+        } else {
+            outline["geometry"] = Json::Value();
+        }
+        features.append(outline);
+
+        if (withNodes) {
+            Json::Value nodes;
+            nodes["type"] = "Feature";
+            nodes["properties"]["budget"] = budget;
+            nodes["geometry"]["type"] = "MultiPoint";
+            Json::Value &coordinates = nodes["geometry"]["coordinates"] = Json::Value(Json::arrayValue);
+            for (size_t i = first; i < next; ++i) {
+                Json::Value coordinate(Json::arrayValue);
+                coordinate.append(points[i][0]);
+                coordinate.append(points[i][1]);
+                coordinates.append(coordinate);
+            }
+            features.append(nodes);
+        }
+    }
+
+    Json::FastWriter writer;
+    reply(writer.write(collection));
+}
+
+/**
+ * Reply with {"profile", "edges", "arcs", "metric", "ms"}: how many edges changed,
+ * how many hierarchy arcs were recomputed, the new metric version and the time it
+ * took. Each change names the ends of an edge as {"lng", "lat"} (snapped to the
+ * nearest nodes) and sets exactly one of its "weight", a "factor" of its weight at
+ * startup (both finite and non-negative), or "closed": true. Cached routes are
+ * keyed by metric version, so those of the old weights stop being hit and age out
+ * of the cache.
+ */
+void performUpdateWeights(const Json::Value &changeList, const string &profileName, const Reply &reply, LiveGraph &liveGraph) {
+    if (!changeList.isArray() || changeList.empty()) {
+        throw std::runtime_error("Weight updates need a non-empty array of changes.");
+    }
+    auto start = std::chrono::steady_clock::now();
+    const Graph &initial = liveGraph.initial();
+    std::vector<Graph::WeightChange> changes;
+    changes.reserve(changeList.size());
+    for (Json::ArrayIndex i = 0; i < changeList.size(); ++i) {
+        const Json::Value &change = changeList[i];
+        string where = "Weight change " + std::to_string(i);
+        if (!change.isObject()) {
+            throw std::runtime_error(where + " is not an object.");
+        }
+        int kinds = change.isMember("closed") + change.isMember("factor") + change.isMember("weight");
+        if (kinds != 1) {
+            throw std::runtime_error(where + " needs exactly one of \"weight\", \"factor\" and \"closed\".");
+        }
+        if (change.isMember("closed") && !(change["closed"].isBool() && change["closed"].asBool())) {
+            throw std::runtime_error(where + " must have \"closed\": true.");
+        }
+        if (!change.isMember("closed")) {
+            const char *number = change.isMember("factor") ? "factor" : "weight";
+            const Json::Value &value = change[number];
+            if (!value.isNumeric() || !std::isfinite(value.asDouble()) || value.asDouble() < 0) {
+                throw std::runtime_error(where + " needs a finite, non-negative \"" + number + "\".");
+            }
+        }
+
+        Node from(initial.queryByArbitrary({change["from"]["lng"].asDouble(), change["from"]["lat"].asDouble()}));
+        Node to(initial.queryByArbitrary({change["to"]["lng"].asDouble(), change["to"]["lat"].asDouble()}));
+        double weight;
+        if (change.isMember("closed")) {
+            weight = std::numeric_limits<double>::infinity();
+        } else if (change.isMember("factor")) {
+            weight = change["factor"].asDouble() * initial.pathLength({from, to});
+        } else {
+            weight = change["weight"].asDouble();
+        }
+        changes.push_back({from, to, weight});
+    }
+
+    size_t recomputed = 0;
+    std::shared_ptr<const Graph> updated;
+    {
+        StageTimer timer(Stage::search);
+        updated = liveGraph.update(changes, &recomputed);
+    }
+
+    Json::Value result;
+    result["profile"] = profileName;
+    result["edges"] = Json::UInt64(changes.size());
+    result["arcs"] = Json::UInt64(recomputed);
+    result["metric"] = updated->metricVersion();
+    result["ms"] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    Json::FastWriter writer;
+    reply(writer.write(result));
+}
+
+// Run the preprocessing on a freshly built graph.
+void finishGraph(Graph &graph) {
+    cout << "Building contraction hierarchy" << endl;
+    graph.buildContractionHierarchy();
+    cout << "Selecting landmarks" << endl;
+    graph.buildLandmarks(16, LandmarkStrategy::avoid);
+}
+
+// Node ids change with every build, so cached routes are dropped on any (re)load.
+void loadData(Graph &graph, Graph &ped_graph, RouteCache &cache) {
+    cache.clear();
     string binaryFilename = working_path + "/bin/graph_cache.bin";
-    if (!loadGraph(graph, binaryFilename)) {
-        cout << "Loading from geojson and building graph" << endl;
-        load_highway(highway_file, graph);
-        load_point(point_file, graph);
-        saveGraph(graph, binaryFilename);
-    } else {
+    if (loadGraphs(graph, ped_graph, binaryFilename)) {
         cout << "Graph loaded from binary cache." << endl;
+        return;
     }
+
+    cout << "Loading from geojson and building graph" << endl;
+    load_geojson(highway_file, point_file, graph, ped_graph);
+    cout << "Building customizable hierarchy" << endl;
+    Graph::buildCustomizableHierarchy({&graph, &ped_graph});
+    finishGraph(graph);
+    finishGraph(ped_graph);
+    Graph::writeSnapshot(binaryFilename, {&graph, &ped_graph});
 }
 
-void ped_loadData(Graph &graph) {
-    string binaryFilename = working_path + "/bin/ped_graph_cache.bin";
-    if (!loadGraph(graph, binaryFilename)) {
-        cout << "Loading from geojson and building graph" << endl;
-        ped_load_highway(highway_file, graph);
-        load_point(point_file, graph);
-        saveGraph(graph, binaryFilename);
+void runQuery(const std::string &queryType, const Json::Value &jsonData, const Reply &reply, const Graph &graph, const Graph &ped_graph, RouteCache &cache) {
+    std::string algorithm = jsonData["algorithm"].asString();
+
+    if (queryType == "path") {
+        std::string startLocation = jsonData["startLocation"].asString();
+        std::string endLocation = jsonData["endLocation"].asString();
+
+        std::cout << "Path query: " << startLocation << " -> " << endLocation << std::endl;
+        calculateAndRespond(startLocation, endLocation, algorithm, departure_of(jsonData), route_encoding_of(jsonData), reply, graph, Profile::car, cache);
+
+    } else if (queryType == "fuzzy") {
+        std::string locationName = jsonData["locationName"].asString();
+
+        std::cout << "Fuzzy query: " << locationName << std::endl;
+        performFuzzyQuery(locationName, reply, graph);
+    } else if (queryType == "arbitrary") {
+        double startLat = jsonData["startLocation"]["lat"].asDouble();
+        double startLng = jsonData["startLocation"]["lng"].asDouble();
+        double endLat = jsonData["endLocation"]["lat"].asDouble();
+        double endLng = jsonData["endLocation"]["lng"].asDouble();
+        // "snap": "node" keeps the old behaviour of routing between the nearest nodes,
+        // and is the default with a departure time
+        double departure = departure_of(jsonData);
+        bool edgeSnap = jsonData.get("snap", departure == no_departure ? "edge" : "node").asString() != "node";
+        std::cout << "Arbitrary two points:" << startLat << "," << startLng << "->" << endLat << "," << endLng << std::endl;
+        performArbitrary(startLat, startLng, endLat, endLng, algorithm, edgeSnap, departure, route_encoding_of(jsonData), reply, graph);
+    } else if (queryType == "ped_path") {
+        std::string startLocation = jsonData["startLocation"].asString();
+        std::string endLocation = jsonData["endLocation"].asString();
+
+        std::cout << "Path query: " << startLocation << " -> " << endLocation << std::endl;
+        calculateAndRespond(startLocation, endLocation, algorithm, departure_of(jsonData), route_encoding_of(jsonData), reply, ped_graph, Profile::pedestrian, cache);
+    } else if (queryType == "matrix") {
+        // targets default to the sources; "profile": "pedestrian" uses the pedestrian graph
+        const Json::Value &sources = jsonData["sources"];
+        const Json::Value &targets = jsonData.isMember("targets") ? jsonData["targets"] : sources;
+        const Graph &profileGraph = jsonData["profile"].asString() == "pedestrian" ? ped_graph : graph;
+
+        std::cout << "Matrix query: " << sources.size() << "x" << targets.size() << std::endl;
+        performMatrix(sources, targets, reply, profileGraph);
+    } else if (queryType == "isochrone") {
+        double lat = jsonData["location"]["lat"].asDouble();
+        double lng = jsonData["location"]["lng"].asDouble();
+        std::vector<double> budgets;
+        for (const auto &budget : jsonData["budgets"]) {
+            budgets.push_back(budget.asDouble());
+        }
+        const Graph &profileGraph = jsonData["profile"].asString() == "pedestrian" ? ped_graph : graph;
+
+        std::cout << "Isochrone query: " << lat << "," << lng << " with " << budgets.size() << " budgets" << std::endl;
+        performIsochrone(lat, lng, budgets, jsonData.get("nodes", true).asBool(), reply, profileGraph);
+    } else if (queryType == "stats") {
+        Json::FastWriter writer;
+        reply(writer.write(Metrics::toJson()));
     } else {
-        cout << "Graph loaded from binary cache." << endl;
+        throw std::runtime_error("Unknown queryType: " + queryType);
+    }
+}
+
+QueryType queryTypeOf(const std::string &queryType) {
+    if (queryType == "path") {
+        return QueryType::path;
+    } else if (queryType == "ped_path") {
+        return QueryType::ped_path;
+    } else if (queryType == "fuzzy") {
+        return QueryType::fuzzy;
+    } else if (queryType == "arbitrary") {
+        return QueryType::arbitrary;
+    } else if (queryType == "matrix") {
+        return QueryType::matrix;
+    } else if (queryType == "isochrone") {
+        return QueryType::isochrone;
+    } else if (queryType == "update_weights") {
+        return QueryType::update_weights;
+    }
+    return QueryType::other;
+}
+
+/**
+ * Run one parsed request on the calling (worker) thread, against the graphs
+ * current when it starts.
+ */
+void handleQuery(const Json::Value &jsonData, const Reply &reply, LiveGraph &graph, LiveGraph &ped_graph, RouteCache &cache) {
+    std::string queryType = jsonData["queryType"].asString();
+    QueryScope scope(queryTypeOf(queryType));
+    try {
+        if (queryType == "update_weights") {
+            string profile = jsonData.get("profile", "car").asString();
+            std::cout << "Weight update: " << jsonData["changes"].size() << " edges of " << profile << std::endl;
+            performUpdateWeights(jsonData["changes"], profile, reply, profile == "pedestrian" ? ped_graph : graph);
+            return;
+        }
+        std::shared_ptr<const Graph> car = graph.get(), pedestrian = ped_graph.get();
+        runQuery(queryType, jsonData, reply, *car, *pedestrian, cache);
+    } catch (...) {
+        scope.fail();
+        throw;
+    }
+}
+
+// Answers every connection with the metrics in the Prometheus text format, then closes it.
+void acceptMetrics(boost::asio::ip::tcp::acceptor &acceptor) {
+    auto socket = std::make_shared<boost::asio::ip::tcp::socket>(acceptor.get_executor());
+    acceptor.async_accept(*socket, [&acceptor, socket](const boost::system::error_code &ec) {
+        if (ec) {
+            return;
+        }
+        auto request = std::make_shared<boost::asio::streambuf>(8192);
+        boost::asio::async_read_until(*socket, *request, "\r\n\r\n",
+            [socket, request](const boost::system::error_code &ec, size_t) {
+                if (ec) {
+                    return;
+                }
+                auto response = std::make_shared<string>(
+                    "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n" + Metrics::renderText());
+                boost::asio::async_write(*socket, boost::asio::buffer(*response),
+                    [socket, response](const boost::system::error_code &, size_t) {
+                        boost::system::error_code ignored;
+                        socket->shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+                    });
+            });
+        acceptMetrics(acceptor);
+    });
+}
+
+// Upper bound on the sub-queries of one batch message.
+const size_t max_batch_size = 256;
+
+/**
+ * Reply of a tagged request. JSON payloads are sent as {"id": ..., "result": payload},
+ * plain-text ones (errors, "Cannot find path!") as {"id": ..., "error": "payload"};
+ * sub-queries of a batch also carry their "index".
+ */
+Reply taggedReply(const Json::Value &id, int index, const Reply &reply) {
+    Json::FastWriter writer;
+    writer.omitEndingLineFeed();
+    string tag = "\"id\":" + writer.write(id);
+    if (index >= 0) {
+        tag += ",\"index\":" + std::to_string(index);
     }
+    return reply.tagged(std::move(tag));
 }
 
-int main()
+int main(int argc, char **argv)
 {
+    // --io-threads: threads running the websocket io_context
+    // --workers: threads running route / fuzzy / snap queries
+    // --metrics-port: local port serving the plain-text metrics, 0 to disable
+    // --route-cache-mb: budget of the serialized route cache, 0 to disable
+    size_t io_threads = 2;
+    size_t worker_threads = std::max(1u, std::thread::hardware_concurrency());
+    unsigned short metrics_port = 9102;
+    size_t route_cache_mb = 64;
+    for (int i = 1; i < argc; ++i) {
+        string flag = argv[i];
+        if ((flag == "--io-threads" || flag == "--workers") && i + 1 < argc) {
+            size_t value = std::max(1ul, std::stoul(argv[++i]));
+            (flag == "--io-threads" ? io_threads : worker_threads) = value;
+        } else if (flag == "--metrics-port" && i + 1 < argc) {
+            metrics_port = static_cast<unsigned short>(std::stoul(argv[++i]));
+        } else if (flag == "--route-cache-mb" && i + 1 < argc) {
+            route_cache_mb = std::stoul(argv[++i]);
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--io-threads N] [--workers N] [--metrics-port N] [--route-cache-mb N]" << std::endl;
+            return 1;
+        }
+    }
+
     // Load graph
     Graph graph, ped_graph;
-    loadData(graph);
-    ped_loadData(ped_graph);
+    RouteCache route_cache(route_cache_mb << 20);
+    loadData(graph, ped_graph, route_cache);
+    LiveGraph live_graph(graph), live_ped_graph(ped_graph);
 
 
     server wsServer;
     wsServer.init_asio();
-    
+
+    boost::asio::thread_pool workers(worker_threads);
+
+    // Responses are posted to a strand per connection, so a connection never has two
+    // sends racing while different connections are served in parallel.
+    using strand_ptr = std::shared_ptr<boost::asio::io_service::strand>;
+    std::mutex strands_mutex;
+    std::map<websocketpp::connection_hdl, strand_ptr, std::owner_less<websocketpp::connection_hdl>> strands;
+
+    wsServer.set_open_handler([&](websocketpp::connection_hdl hdl) {
+        std::lock_guard<std::mutex> lock(strands_mutex);
+        strands[hdl] = std::make_shared<boost::asio::io_service::strand>(wsServer.get_io_service());
+    });
+
+    wsServer.set_close_handler([&](websocketpp::connection_hdl hdl) {
+        std::lock_guard<std::mutex> lock(strands_mutex);
+        strands.erase(hdl);
+    });
+
+    auto replyTo = [&](websocketpp::connection_hdl hdl) -> Reply {
+        strand_ptr strand;
+        {
+            std::lock_guard<std::mutex> lock(strands_mutex);
+            auto it = strands.find(hdl);
+            if (it != strands.end()) {
+                strand = it->second;
+            }
+        }
+        return Reply([&wsServer, hdl, strand](const std::string &payload, bool binary) {
+            if (!strand) {
+                // connection already closed
+                return;
+            }
+            strand->post([&wsServer, hdl, payload, binary]() {
+                websocketpp::lib::error_code ec;
+                wsServer.send(hdl, payload, binary ? websocketpp::frame::opcode::binary : websocketpp::frame::opcode::text, ec);
+                if (ec) {
+                    std::cerr << "Failed to send response: " << ec.message() << std::endl;
+                }
+            });
+        });
+    };
+
     wsServer.set_message_handler([&](websocketpp::connection_hdl hdl, websocketpp::server<websocketpp::config::asio>::message_ptr msg) {
-        try {
-            std::string payload = msg->get_payload();
-            Json::Reader reader;
-            Json::Value jsonData;
-
-            if (reader.parse(payload, jsonData)) {
-                std::string queryType = jsonData["queryType"].asString();
-                
-                if (queryType == "path") {
-                    std::string startLocation = jsonData["startLocation"].asString();
-                    std::string endLocation = jsonData["endLocation"].asString();
-
-                    std::cout << "Path query: " << startLocation << " -> " << endLocation << std::endl;
-                    calculateAndRespond(startLocation, endLocation, hdl, wsServer, graph);
-
-                } else if (queryType == "fuzzy") {
-                    std::string locationName = jsonData["locationName"].asString();
-
-                    std::cout << "Fuzzy query: " << locationName << std::endl;
-                    performFuzzyQuery(locationName, hdl, wsServer, graph); // Implement this function to return fuzzy matches
-                } else if (queryType == "arbitrary") {
-                    double startLat = jsonData["startLocation"]["lat"].asDouble();
-                    double startLng = jsonData["startLocation"]["lng"].asDouble();
-                    double endLat = jsonData["endLocation"]["lat"].asDouble();
-                    double endLng = jsonData["endLocation"]["lng"].asDouble();
-                    std::cout << "Arbitrary two points:" << startLat << "," << startLng << "->" << endLat << "," << endLng << std::endl;
-                    performArbitrary(startLat, startLng, endLat, endLng, hdl, wsServer, graph);
-                } else if (queryType == "ped_path") {
-                    std::string startLocation = jsonData["startLocation"].asString();
-                    std::string endLocation = jsonData["endLocation"].asString();
-
-                    std::cout << "Path query: " << startLocation << " -> " << endLocation << std::endl;
-                    calculateAndRespond(startLocation, endLocation, hdl, wsServer, ped_graph);
+        std::string payload = msg->get_payload();
+        Json::Reader reader;
+        Json::Value jsonData;
+
+        Reply reply = replyTo(hdl);
+        if (!reader.parse(payload, jsonData)) {
+            std::cerr << "Failed to parse JSON: " << reader.getFormattedErrorMessages() << std::endl;
+            reply("Error: malformed JSON request");
+            return;
+        }
+
+        // keep the io threads free: the query itself runs on a worker
+        auto dispatch = [&](const Json::Value &query, const Reply &queryReply) {
+            boost::asio::post(workers, [query, queryReply, &live_graph, &live_ped_graph, &route_cache]() {
+                try {
+                    handleQuery(query, queryReply, live_graph, live_ped_graph, route_cache);
+                } catch (const std::exception& e) {
+                    queryReply(std::string("Error: ") + e.what());
                 }
-            } else {
-                std::cerr << "Failed to parse JSON: " << reader.getFormattedErrorMessages() << std::endl;
-            }
-        } catch (const std::exception& e) {
-            wsServer.send(hdl, std::string("Error: ") + e.what(), websocketpp::frame::opcode::text);
+            });
+        };
+
+        // Untagged requests get the bare reply. With an "id" the reply is tagged, so a
+        // client may keep many requests in flight on one connection; a "batch" of
+        // sub-queries runs concurrently and each answer is sent as soon as it is ready,
+        // tagged with the sub-query's own "id" (or the batch's) and its index.
+        if (!jsonData.isObject() || !jsonData.isMember("id")) {
+            dispatch(jsonData, reply);
+            return;
+        }
+        const Json::Value &id = jsonData["id"];
+        if (!jsonData.isMember("batch")) {
+            dispatch(jsonData, taggedReply(id, -1, reply));
+            return;
+        }
+        const Json::Value &batch = jsonData["batch"];
+        if (!batch.isArray() || batch.size() > max_batch_size) {
+            taggedReply(id, -1, reply)("Error: batch must be an array of at most " + std::to_string(max_batch_size) + " queries");
+            return;
+        }
+        for (Json::ArrayIndex i = 0; i < batch.size(); ++i) {
+            const Json::Value &query = batch[i];
+            bool ownId = query.isObject() && query.isMember("id");
+            dispatch(query, taggedReply(ownId ? query["id"] : id, static_cast<int>(i), reply));
         }
     });
 
     wsServer.listen(3002);
     wsServer.start_accept();
 
-    std::cout << "C++ WebSocket server listening on port 3002..." << std::endl;
-
-    wsServer.run();
+    std::unique_ptr<boost::asio::ip::tcp::acceptor> metrics;
+    if (metrics_port != 0) {
+        // metrics are optional: a busy port must not keep the routing server down
+        try {
+            metrics = std::make_unique<boost::asio::ip::tcp::acceptor>(wsServer.get_io_service(),
+                boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), metrics_port));
+            acceptMetrics(*metrics);
+            std::cout << "Metrics served on 127.0.0.1:" << metrics_port << std::endl;
+        } catch (const boost::system::system_error &e) {
+            metrics.reset();
+            std::cerr << "Serving without metrics, cannot listen on 127.0.0.1:" << metrics_port << ": " << e.what() << std::endl;
+        }
+    }
 
+    std::cout << "C++ WebSocket server listening on port 3002 with " << io_threads << " io threads and "
+              << worker_threads << " workers..." << std::endl;
 
+    std::vector<std::thread> io_pool;
+    for (size_t i = 1; i < io_threads; ++i) {
+        io_pool.emplace_back([&wsServer]() {
+            wsServer.run();
+        });
+    }
+    wsServer.run();
+    for (auto &thread : io_pool) {
+        thread.join();
+    }
+    workers.join();
 
     return 0;
 }